@@ -18,13 +18,228 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <linux/net_tstamp.h>
 #include "microtcp.h"
+#include "microtcp_io.h"
+#include "microtcp_demux.h"
+#include "microtcp_loop.h"
+#include "microtcp_thread.h"
+#include "microtcp_cc.h"
 #include "../utils/crc32.h"
 #define CLIENT 0
 #define SERVER 1
 
+static void sender_flush(microtcp_sock_t *socket);
+static void rate_stamp(microtcp_sock_t *socket, microtcp_segment_t *seg, uint64_t now);
+static void pacer_fire(microtcp_timer_t *timer);
+static void rtx_fire(microtcp_timer_t *timer);
+static void persist_fire(microtcp_timer_t *timer);
+static void delack_fire(microtcp_timer_t *timer);
+static void socket_input(microtcp_sock_t *socket, uint8_t *buf, ssize_t len);
+
+/*
+ * Our clock as carried in the timestamp option, never 0
+ */
+static inline uint32_t
+ts_now(void)
+{
+  uint32_t ts = microtcp_now_us();
+  return ts != 0 ? ts : 1;
+}
+
+/*
+ * The data_len field of our headers, the connection ID above the length
+ */
+static inline uint32_t
+header_len(microtcp_sock_t *socket, uint32_t len)
+{
+  return htonl((uint32_t)socket->cid << MICROTCP_CID_SHIFT | len);
+}
+
+/*
+ * Feed a round trip time sample to the estimator of RFC 6298
+ */
+static void
+rtt_sample(microtcp_sock_t *socket, uint32_t rtt)
+{
+  uint32_t delta, rto;
+
+  if(socket->srtt_us == 0){
+    socket->srtt_us = rtt;
+    socket->rttvar_us = rtt / 2;
+  }else{
+    delta = socket->srtt_us > rtt ? socket->srtt_us - rtt : rtt - socket->srtt_us;
+    socket->rttvar_us = (3 * socket->rttvar_us + delta) / 4;
+    socket->srtt_us = (7 * socket->srtt_us + rtt) / 8;
+  }
+  socket->rtt_us = rtt;
+
+  // A fresh sample also ends any backoff
+  rto = socket->srtt_us + 4 * socket->rttvar_us;
+  if(rto < MICROTCP_RTO_MIN_US)
+    rto = MICROTCP_RTO_MIN_US;
+  if(rto > MICROTCP_RTO_MAX_US)
+    rto = MICROTCP_RTO_MAX_US;
+  socket->rto_us = rto;
+}
+
+/*
+ * Double the retransmission timeout after it expired
+ */
+static inline void
+rto_backoff(microtcp_sock_t *socket)
+{
+  socket->rto_us = socket->rto_us < MICROTCP_RTO_MAX_US / 2 ? socket->rto_us * 2 : MICROTCP_RTO_MAX_US;
+}
+
+/*
+ * Time the oldest segment in flight, if any
+ */
+static inline void
+rtx_restart(microtcp_sock_t *socket, uint64_t now)
+{
+  if(socket->sb_count > 0)
+    microtcp_timer_arm(socket->timers, &socket->rtx_timer, now + socket->rto_us);
+  else
+    microtcp_timer_cancel(socket->timers, &socket->rtx_timer);
+}
+
+/*
+ * Allocate the receive ring
+ */
+static void
+recv_init(microtcp_sock_t *socket)
+{
+  socket->recvbuf = malloc(MICROTCP_RECVBUF_LEN);
+  socket->reasm_map = calloc(MICROTCP_RECVBUF_LEN / 64, sizeof(uint64_t));
+  socket->buf_fill_level = 0;
+  socket->rcv_read = socket->ack_number;
+  socket->sack_seq = socket->ack_number;
+  socket->rcv_high = socket->ack_number;
+}
+
+/*
+ * Free space of the receive ring past the in-order data
+ */
+static inline size_t
+recv_window(microtcp_sock_t *socket)
+{
+  return MICROTCP_RECVBUF_LEN - (uint32_t)(socket->ack_number - socket->rcv_read);
+}
+
+/*
+ * The window field for our next header
+ */
+static inline uint16_t
+advertised_window(microtcp_sock_t *socket)
+{
+  size_t win = recv_window(socket) >> socket->rcv_wscale;
+  return win > 0xffff ? 0xffff : win;
+}
+
+/*
+ * Everything the connection allocated
+ */
+static void
+release_buffers(microtcp_sock_t *socket)
+{
+  if(socket->loop_entry != NULL)
+    microtcp_loop_del(socket->loop_entry->loop, socket);
+  if(socket->conn != NULL){
+    microtcp_demux_close(socket->listener, socket->conn);
+    socket->conn = NULL;
+  }
+  microtcp_io_free(socket);
+  microtcp_timer_wheel_free(socket->timers);
+  socket->timers = NULL;
+  free(socket->recvbuf);
+  free(socket->reasm_map);
+  socket->recvbuf = NULL;
+  socket->reasm_map = NULL;
+}
+
+/*
+ * Initial state of a socket on the UDP socket sd
+ */
+static void
+socket_init(microtcp_sock_t *socket, int sd)
+{
+  microtcp_sock_t s;
+
+  memset(&s, 0, sizeof(microtcp_sock_t));
+  s.sd = sd;
+  s.packets_lost = 0;
+  s.packets_received = 0;
+  s.packets_send = 0;
+  s.bytes_lost = 0;
+  s.bytes_received = 0;
+  s.bytes_send = 0;
+  s.packets_retransmitted = 0;
+  s.bytes_retransmitted = 0;
+  s.connected = FALSE;
+  s.syscalls = 0;
+  s.sendbuf = NULL;
+  s.sendbuf_fill = 0;
+  s.block_crc = NULL;
+  s.recvbuf = NULL;
+  s.reasm_map = NULL;
+  s.snd_wscale = 0;
+  s.rcv_wscale = 0;
+  s.sack_ok = FALSE;
+  s.ts_ok = FALSE;
+  s.cc = MICROTCP_CC_DEFAULT;
+  s.cc->init(&s);
+  s.delivered = 0;
+  s.delivered_us = 0;
+  s.first_sent_us = 0;
+  s.app_limited = 0;
+  s.pacing = MICROTCP_PACING_TIMER;
+  s.pacing_rate = 0;
+  s.pacing_burst = 0;
+  s.pace_next_us = 0;
+  s.ts_recent = 0;
+  s.rx_timestamps = FALSE;
+  s.gso = FALSE;
+  s.gro = FALSE;
+  s.cid = 0;
+  s.listener = NULL;
+  s.conn = NULL;
+  s.handshakes = NULL;
+  s.nonblocking = FALSE;
+  s.loop_entry = NULL;
+  s.thread = NULL;
+  s.ack_every = MICROTCP_DELACK_SEGMENTS;
+  s.ack_delay_us = MICROTCP_DELACK_TIMEOUT_US;
+  s.delack_segs = 0;
+  s.last_adv_win = 0;
+  s.scoreboard = NULL;
+  s.sb_head = 0;
+  s.sb_count = 0;
+  s.persist_backoff = MICROTCP_RTO_INIT_US;
+  s.srtt_us = 0;
+  s.rttvar_us = 0;
+  s.rto_us = MICROTCP_RTO_INIT_US;
+  s.rtt_us = 0;
+  s.rtt_start = 0;
+  *socket = s;
+  microtcp_timer_init(&socket->pace_timer, pacer_fire);
+  microtcp_timer_init(&socket->rtx_timer, rtx_fire);
+  microtcp_timer_init(&socket->persist_timer, persist_fire);
+  microtcp_timer_init(&socket->delack_timer, delack_fire);
+}
+
 microtcp_sock_t
 microtcp_socket (int domain, int type, int protocol)
+{
+  return microtcp_socket_io(domain, type, protocol, MICROTCP_IO_MMSG);
+}
+
+microtcp_sock_t
+microtcp_socket_io (int domain, int type, int protocol,
+                    microtcp_io_backend_t backend)
 {
   microtcp_sock_t s; // Socket
   int sock_desc; // Socket descriptor
@@ -38,20 +253,33 @@ microtcp_socket (int domain, int type, int protocol)
   }
 
   // Initialize socket values
-  s.sd = sock_desc;
-  s.packets_lost = 0;
-  s.packets_received = 0;
-  s.packets_send = 0;
-  s.bytes_lost = 0;
-  s.bytes_received = 0;
-  s.bytes_send = 0;
+  socket_init(&s, sock_desc);
 
-  // Set timeout
+  // Set timeout, for a peer that doesn't answer at all
   struct timeval timeout;
   timeout.tv_sec = 0;
   timeout.tv_usec = MICROTCP_ACK_TIMEOUT_US;
   setsockopt(s.sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
 
+  // A full window may arrive before we get to read it
+  int sockbuf = MICROTCP_SOCKBUF_LEN;
+  setsockopt(s.sd, SOL_SOCKET, SO_RCVBUF, &sockbuf, sizeof(int));
+  setsockopt(s.sd, SOL_SOCKET, SO_SNDBUF, &sockbuf, sizeof(int));
+
+  // Batched I/O buffers
+  s.io_backend = backend;
+  if(microtcp_io_init(&s) == -1){
+    perror("allocating I/O batches");
+    exit(EXIT_FAILURE);
+  }
+  if((s.timers = microtcp_timer_wheel_new(microtcp_now_us())) == NULL){
+    perror("allocating timers");
+    exit(EXIT_FAILURE);
+  }
+
+  // Segmentation offload where the kernel has it, single datagrams otherwise
+  microtcp_io_set_offload(&s, TRUE);
+
   return s;
 }
 
@@ -77,45 +305,66 @@ microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
 {
 
   microtcp_header_t client, server; // Headers
-  client.window = htons(MICROTCP_WIN_SIZE);
-  client.data_len = htonl(32);
-  int received = -1;
+  int received = -1, tries = 0;
+  uint64_t sent;
+  uint8_t *buf;
+  ssize_t len;
 
   memset(&client, 0, sizeof(microtcp_header_t));
   memset(&server, 0, sizeof(microtcp_header_t));
 
   // Update socket
   socket->type = CLIENT;
-  socket->cwnd = MICROTCP_INIT_CWND;
-  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+  socket->cc->init(socket);
   socket->seq_number = rand();
   socket->ack_number = 0;
+  socket->snd_wscale = 0;
+  socket->rcv_wscale = 0;
+  socket->sack_ok = FALSE;
+  socket->ts_ok = FALSE;
+  socket->cid = 1 + rand() % 0xffff;
 
-  // Client SYN
+  // Client SYN, offering to scale the window, to SACK and timestamps
   client.seq_number = htonl(socket->seq_number); // Random sequence number
   client.ack_number = htonl(socket->ack_number);
   client.control = htons(SYN);
-  sendto(socket->sd,
-    (const void *)&client,
-    sizeof(microtcp_header_t),
-    0,
-    address,
-    address_len
-  );
-  socket->packets_send++;
-  socket->bytes_send += sizeof(microtcp_header_t);
+  client.data_len = header_len(socket, 0);
+  client.window = htons(MICROTCP_RECVBUF_LEN > 0xffff ? 0xffff : MICROTCP_RECVBUF_LEN);
+  client.future_use0 = htonl(MICROTCP_OPT_WSCALE | MICROTCP_WSCALE | MICROTCP_OPT_SACK | MICROTCP_OPT_TS);
 
-  // Server SYN ACK
+  // Server SYN ACK, sending the SYN again every time the timer expires
   while(received < 0){
-    received = recvfrom(socket->sd,
-      (void *)&server,
-      sizeof(microtcp_header_t),  
+    if(tries++ > MICROTCP_SYN_RETRIES){
+      perror("handshake timed out");
+      socket->state = INVALID;
+      return -1;
+    }
+    if(tries > 1)
+      rto_backoff(socket);
+
+    sendto(socket->sd,
+      (const void *)&client,
+      sizeof(microtcp_header_t),
       0,
-      (struct sockaddr *)address, 
-      &address_len
+      address,
+      address_len
     );
+    socket->packets_send++;
+    socket->bytes_send += sizeof(microtcp_header_t);
+    sent = microtcp_now_us();
+
+    if(microtcp_io_wait(socket, socket->rto_us) > 0 &&
+       (buf = microtcp_io_rx_next(socket, MSG_DONTWAIT, &len)) != NULL &&
+       len >= (ssize_t)sizeof(microtcp_header_t)){
+      memcpy(&server, buf, sizeof(microtcp_header_t));
+      received = len;
+    }
   }
 
+  // First RTT sample, unless the SYN had to be sent again
+  if(tries == 1)
+    rtt_sample(socket, microtcp_now_us() - sent);
+
   // If server successfully received first sequence number
   if(ntohl(server.ack_number) == ntohl(client.seq_number) + 1){
 
@@ -129,8 +378,19 @@ microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
       socket->init_win_size = ntohs(server.window);
       socket->curr_win_size = ntohs(server.window);
 
+      // Windows are scaled only if both ends agreed
+      if(ntohl(server.future_use0) & MICROTCP_OPT_WSCALE){
+        socket->snd_wscale = ntohl(server.future_use0) & 0xff;
+        socket->rcv_wscale = MICROTCP_WSCALE;
+      }
+      socket->sack_ok = (ntohl(server.future_use0) & MICROTCP_OPT_SACK) != 0;
+      socket->ts_ok = (ntohl(server.future_use0) & MICROTCP_OPT_TS) != 0;
+      recv_init(socket);
+
       client.ack_number = htonl(socket->ack_number);
       client.seq_number = htonl(socket->seq_number);
+      client.window = htons(advertised_window(socket));
+      client.future_use0 = 0;
     }else{
       perror("handshake failed");
       socket->state = INVALID;
@@ -154,189 +414,564 @@ microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
   socket->packets_send++;
   socket->bytes_send += sizeof(microtcp_header_t);
 
+  // Fix the peer of the UDP socket, so it isn't resolved on every send
+  memcpy(&socket->address, address, sizeof(struct sockaddr_in));
+  socket->address_len = address_len;
+  if(connect(socket->sd, address, address_len) == 0)
+    socket->connected = TRUE;
+
   // Set state
   socket->state = ESTABLISHED;
-  if(DEBUG) printf("CLIENT - INIT_WIN = %d CURR_WIN = %d\n", socket->init_win_size, socket->curr_win_size);
+  if(DEBUG) printf("CLIENT - INIT_WIN = %zu CURR_WIN = %zu\n", socket->init_win_size, socket->curr_win_size);
+  return 0;
 }
 
-int
-microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
-                 socklen_t address_len)
+/*
+ * A connection of a listener whose SYN was answered, until
+ * microtcp_accept_conn() hands it out
+ */
+struct microtcp_handshake
 {
-  microtcp_header_t client, server; // Headers
-  client.window = htons(MICROTCP_WIN_SIZE);
-  client.data_len = htonl(32);
-  int received = -1;
+  microtcp_sock_t sock;         /**< The connection, SYN_RCVD until the peer acknowledges */
+  microtcp_sock_t *owner;       /**< The listening socket, that times the SYN ACKs */
+  struct microtcp_handshake *next;
+  int tries;                    /**< SYN ACKs sent */
+  uint64_t sent_us;             /**< When the first one was sent */
+  uint8_t *data;                /**< Data that stood in for the ACK, valid until the ring is read again */
+  ssize_t data_len;
+};
+
+/*
+ * Take the options of the SYN of a peer and pick our sequence number
+ *
+ * @return -1 if it is no SYN
+ */
+static int
+handshake_syn(microtcp_sock_t *socket, const microtcp_header_t *syn)
+{
+  uint32_t options;
 
   // Init server's socket
   socket->type = SERVER;
-  socket->init_win_size = MICROTCP_WIN_SIZE;
-  socket->curr_win_size = MICROTCP_WIN_SIZE;
-  socket->recvbuf = malloc(MICROTCP_RECVBUF_LEN);
-  socket->buf_fill_level = 0;
-
-  memset(&client, 0, sizeof(microtcp_header_t));
-  memset(&server, 0, sizeof(microtcp_header_t));
-
-  // Client SYN
-  while(received < 0){
-    received = recvfrom(socket->sd,
-      (void *)&client,
-      sizeof(microtcp_header_t),  
-      0,
-      address,
-      &address_len
-    );
-  }
+  socket->cc->init(socket);
+  socket->snd_wscale = 0;
+  socket->rcv_wscale = 0;
+  socket->sack_ok = FALSE;
+  socket->ts_ok = FALSE;
 
   // Check if packet was SYN and acknowledge num
-  if(ntohs(client.control) != SYN){
-    perror("handshake failed");
-    socket->state = INVALID;
+  if(ntohs(syn->control) != SYN)
     return -1;
+
+  // Answer with the connection ID of the peer
+  socket->cid = ntohl(syn->data_len) >> MICROTCP_CID_SHIFT;
+
+  // The client's window, scaled only if it offered to
+  socket->init_win_size = ntohs(syn->window);
+  socket->curr_win_size = ntohs(syn->window);
+  options = ntohl(syn->future_use0);
+  if(options & MICROTCP_OPT_WSCALE){
+    socket->snd_wscale = options & 0xff;
+    socket->rcv_wscale = MICROTCP_WSCALE;
   }
+  socket->sack_ok = (options & MICROTCP_OPT_SACK) != 0;
+  socket->ts_ok = (options & MICROTCP_OPT_TS) != 0;
 
-  // Init Recv Win
-  if(DEBUG) printf("%d\n", socket->curr_win_size);
-  server.window = htons(socket->curr_win_size);
-  //server.ack_number = htonl(ntohl(client.seq_number) + 1);
-  socket->ack_number = ntohl(client.seq_number) + 1;
-  //socket->ack_number = ntohl(client.seq_number) + received;
+  socket->ack_number = ntohl(syn->seq_number) + 1;
   socket->seq_number = rand();
+
+  // Init Recv Win
+  recv_init(socket);
+  return 0;
+}
+
+/*
+ * Send the SYN ACK, with the options both ends agreed to
+ */
+static void
+handshake_synack(microtcp_sock_t *socket)
+{
+  microtcp_header_t server;
+  uint32_t options = 0;
+
+  memset(&server, 0, sizeof(microtcp_header_t));
   server.seq_number = htonl(socket->seq_number);
   server.ack_number = htonl(socket->ack_number);
-
-  // Server SYN ACK
   server.control = htons(SYNACK);
+  server.data_len = header_len(socket, 0);
+
+  // The window is never scaled in the SYN ACK
+  server.window = htons(MICROTCP_RECVBUF_LEN > 0xffff ? 0xffff : MICROTCP_RECVBUF_LEN);
+  if(socket->rcv_wscale != 0)
+    options |= MICROTCP_OPT_WSCALE | MICROTCP_WSCALE;
+  if(socket->sack_ok)
+    options |= MICROTCP_OPT_SACK;
+  if(socket->ts_ok)
+    options |= MICROTCP_OPT_TS;
+  server.future_use0 = htonl(options);
+
   sendto(socket->sd,
     (const void *)&server,
-    sizeof(microtcp_header_t), 
+    sizeof(microtcp_header_t),
     0,
-    address,  
-    address_len
-  ); 
+    (const struct sockaddr *)&socket->address,
+    socket->address_len
+  );
+}
 
-  // Client ACK
-  received = -1;
-  while(received < 0){
-    received = recvfrom(socket->sd,
-      (void *)&client,
-      sizeof(microtcp_header_t),  
-      0,
-      address, 
-      &address_len
-    );
+/*
+ * Take the answer of the peer to our SYN ACK
+ *
+ * @return 1 once established, 0 if the SYN was repeated, -1 if the
+ * handshake failed
+ */
+static int
+handshake_ack(microtcp_sock_t *socket, const microtcp_header_t *header)
+{
+  microtcp_header_t client;
+
+  memcpy(&client, header, sizeof(microtcp_header_t));
+  if(ntohs(client.control) == SYN)
+    return 0;
+
+  // The ACK was lost, but data of the client implies it
+  if(ntohs(client.control) == 0 && ntohl(client.seq_number) == socket->ack_number){
+    client.control = htons(ACK);
+    client.ack_number = htonl(socket->seq_number + 1);
+    client.window = htons(socket->init_win_size >> socket->snd_wscale);
   }
 
   // Check if packet was ACK and acknowledge num
-  if(ntohl(client.ack_number) == ntohl(server.seq_number) + 1){
-    if(ntohs(client.control) == ACK){
-      if(DEBUG) printf("Handshake complete.\n"); // Will be gone in 2nd phase
-      socket->seq_number = ntohl(client.ack_number);
-      socket->state = ESTABLISHED;
-    }else{
+  if(ntohs(client.control) != ACK || ntohl(client.ack_number) != socket->seq_number + 1){
+    socket->state = INVALID;
+    if(DEBUG) printf("Handshake failed.\n");
+    return -1;
+  }
+  if(DEBUG) printf("Handshake complete.\n"); // Will be gone in 2nd phase
+  socket->seq_number = ntohl(client.ack_number);
+  socket->curr_win_size = ntohs(client.window) << socket->snd_wscale;
+  socket->state = ESTABLISHED;
+  return 1;
+}
+
+/*
+ * The rest of the 3-way handshake, once the SYN of the peer arrived
+ */
+static int
+accept_handshake(microtcp_sock_t *socket, const microtcp_header_t *syn,
+                 struct sockaddr *address, socklen_t address_len)
+{
+  int result = 0, tries = 0;
+  uint64_t sent;
+  uint8_t *buf = NULL;
+  ssize_t len;
+
+  if(handshake_syn(socket, syn) == -1){
+    perror("handshake failed");
+    socket->state = INVALID;
+    return -1;
+  }
+  memcpy(&socket->address, address, sizeof(struct sockaddr_in));
+  socket->address_len = address_len;
+
+  // Server SYN ACK, sent again when the timer expires or the SYN is
+  // repeated, until the client ACK
+  while(result == 0){
+    if(tries++ > MICROTCP_SYN_RETRIES){
+      perror("handshake timed out");
       socket->state = INVALID;
-      if(DEBUG) printf("Handshake failed.\n");
+      return -1;
     }
-  }else{
-    socket->state = INVALID;
-    if(DEBUG) printf("Handshake faile.\n");
+    if(tries > 1)
+      rto_backoff(socket);
+    handshake_synack(socket);
+    sent = microtcp_now_us();
+
+    if(microtcp_io_wait(socket, socket->rto_us) > 0 &&
+       (buf = microtcp_io_rx_next(socket, MSG_DONTWAIT, &len)) != NULL &&
+       len >= (ssize_t)sizeof(microtcp_header_t))
+      result = handshake_ack(socket, (const microtcp_header_t *)buf);
+  }
+  if(result == -1)
+    return -1;
+  if(tries == 1)
+    rtt_sample(socket, microtcp_now_us() - sent);
+
+  // Serve only this peer from now on
+  if(connect(socket->sd, address, address_len) == 0)
+    socket->connected = TRUE;
+
+  // Data that implied the ACK is the first segment of the peer
+  if(ntohs(((const microtcp_header_t *)buf)->control) == 0){
+    socket_input(socket, buf, len);
+    microtcp_io_flush(socket);
   }
+  return 0;
 }
 
 int
-microtcp_shutdown (microtcp_sock_t *socket, int how)
+microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
+                 socklen_t address_len)
 {
-  microtcp_header_t client, server; // Headers
-  client.window = htons(MICROTCP_WIN_SIZE);
-  client.data_len = htonl(32);
-  struct sockaddr_in address = socket->address; // Get saved addr from socket
-  socklen_t address_len = socket->address_len;
+  microtcp_header_t client; // Header
   int received = -1;
 
   memset(&client, 0, sizeof(microtcp_header_t));
-  memset(&server, 0, sizeof(microtcp_header_t));
-
-  // HOST FIN, ACK
-  client.seq_number = htonl(rand()); // Should be rand
-  client.ack_number = htonl(0);
-  client.control = htons(FINACK);
-  sendto(socket->sd,
-    (const void *)&client,
-    sizeof(microtcp_header_t),
-    0,
-    (struct sockaddr *)&address,
-    address_len
-  );
 
-  // PEER ACK
+  // Client SYN
   while(received < 0){
     received = recvfrom(socket->sd,
-      (void *)&server,
+      (void *)&client,
       sizeof(microtcp_header_t),  
       0,
-      (struct sockaddr *)&address, 
+      address,
       &address_len
     );
   }
-  
-  received = -1; // Packet received
 
-  // Check if packet is ACK and check acknowledge
-  if(ntohs(server.control) == ACK){
-    if(socket->type == CLIENT && ntohl(server.ack_number) == ntohl(client.seq_number) + 1){
-      socket->state = CLOSING_BY_HOST;
-    }
-  }else{
-    perror("shutdown failed");
-    return 1;
-  }
+  return accept_handshake(socket, &client, address, address_len);
+}
 
-  // Server procedures are done here
-  if(socket->type == SERVER)
-    return 0;
+int
+microtcp_listen (microtcp_sock_t *socket, int backlog)
+{
+  socket->listener = microtcp_demux_new(socket, backlog);
+  if(socket->listener == NULL)
+    return -1;
+  socket->state = LISTEN;
+  return 0;
+}
 
-  // Wait for server's FIN ACK
-  while(received < 0){
-    received = recvfrom(socket->sd,
-      (void *)&server,
-      sizeof(microtcp_header_t),  
-      0,
-      (struct sockaddr *)&address, 
-      &address_len
-    );
-  }
+/*
+ * Forget a handshake, and the connection with it
+ */
+static void
+handshake_drop(struct microtcp_handshake *h)
+{
+  struct microtcp_handshake **link;
 
-  // Check if packet was FINACK 
-  if(ntohs(server.control) == FINACK){
-    if(DEBUG) printf("I requested a connection shutdown\n");
-  }else{
-    perror("shutdown failed 2");
-    return 1;
+  for(link = &h->owner->handshakes; *link != NULL; link = &(*link)->next){
+    if(*link == h){
+      *link = h->next;
+      break;
+    }
   }
 
-  // Client FIN, ACK
-  client.seq_number = server.ack_number;
-  client.ack_number = htonl(ntohl(server.seq_number) + 1);
-  client.control = htons(ACK);
-  sendto(socket->sd,
-    (const void *)&client,
-    sizeof(microtcp_header_t),
-    0,
-    (struct sockaddr *)&address,
-    address_len
-  );
-
-  if(DEBUG) printf("Connection shutdown\n");
-  socket->state = CLOSED;
+  // The wheel is the one of the listening socket
+  microtcp_timer_cancel(h->sock.timers, &h->sock.rtx_timer);
+  h->sock.timers = NULL;
+  release_buffers(&h->sock);
+  free(h);
 }
 
 /*
- * Return maximum packet length
-*/
-static inline
-int
-getMaxPacketSize(int remaining, int cwnd, int win)
+ * Send the SYN ACK again, with the timer backed off
+ *
+ * @return -1 if the peer had its chances, and the handshake is gone
+ */
+static int
+handshake_resend(struct microtcp_handshake *h)
+{
+  if(h->tries++ > MICROTCP_SYN_RETRIES){
+    handshake_drop(h);
+    return -1;
+  }
+  rto_backoff(&h->sock);
+  handshake_synack(&h->sock);
+  microtcp_timer_arm(h->sock.timers, &h->sock.rtx_timer, microtcp_now_us() + h->sock.rto_us);
+  return 0;
+}
+
+/*
+ * No answer to a SYN ACK in time
+ */
+static void
+synack_fire(microtcp_timer_t *timer)
+{
+  microtcp_sock_t *socket = microtcp_container_of(timer, microtcp_sock_t, rtx_timer);
+
+  (void)handshake_resend(microtcp_container_of(socket, struct microtcp_handshake, sock));
+}
+
+/*
+ * Answer the SYN a new connection of the listener starts with. The
+ * handshake goes on in handshake_run().
+ */
+static void
+handshake_start(microtcp_sock_t *socket, struct microtcp_conn *c)
+{
+  struct microtcp_handshake *h = calloc(1, sizeof(struct microtcp_handshake)), **link;
+  microtcp_sock_t *conn;
+  uint8_t *buf;
+  ssize_t len;
+
+  if(h == NULL){
+    microtcp_demux_close(socket->listener, c);
+    return;
+  }
+  h->owner = socket;
+
+  // A socket of its own, that sends through the port of the listener
+  conn = &h->sock;
+  socket_init(conn, socket->sd);
+  conn->listener = socket->listener;
+  conn->conn = c;
+  conn->gso = socket->listener->sock.gso;
+  conn->timers = socket->timers;
+  microtcp_timer_init(&conn->rtx_timer, synack_fire);
+  memcpy(&conn->address, &c->peer, sizeof(struct sockaddr_in));
+  conn->address_len = sizeof(struct sockaddr_in);
+
+  // The listener only starts a connection on a SYN, but don't count on it
+  if(microtcp_io_init(conn) == -1 ||
+     (buf = microtcp_io_rx_next(conn, MSG_DONTWAIT, &len)) == NULL ||
+     len < (ssize_t)sizeof(microtcp_header_t) ||
+     handshake_syn(conn, (const microtcp_header_t *)buf) == -1){
+    handshake_drop(h);
+    return;
+  }
+
+  for(link = &socket->handshakes; *link != NULL; link = &(*link)->next)
+    ;
+  *link = h;
+  microtcp_demux_handshake(socket->listener, c, TRUE);
+  conn->state = SYN_RCVD;
+  handshake_synack(conn);
+  h->tries = 1;
+  h->sent_us = microtcp_now_us();
+  microtcp_timer_arm(conn->timers, &conn->rtx_timer, h->sent_us + conn->rto_us);
+}
+
+/*
+ * Answer the SYNs the listener queued, take what the peers in the
+ * handshake sent, and send the SYN ACKs that are due
+ */
+static void
+handshake_run(microtcp_sock_t *socket)
+{
+  struct microtcp_handshake *h, *next;
+  struct microtcp_conn *c;
+  uint8_t *buf;
+  ssize_t len;
+  int result;
+
+  while((c = microtcp_demux_accept(socket->listener, 0)) != NULL)
+    handshake_start(socket, c);
+
+  // In an event loop, the loop runs the timers
+  if(socket->loop_entry == NULL)
+    microtcp_timer_run(socket->timers, microtcp_now_us());
+
+  for(h = socket->handshakes; h != NULL; h = next){
+    next = h->next;
+    result = 0;
+    while(h->sock.state == SYN_RCVD &&
+          (buf = microtcp_io_rx_next(&h->sock, MSG_DONTWAIT, &len)) != NULL){
+      if(len < (ssize_t)sizeof(microtcp_header_t))
+        continue;
+      result = handshake_ack(&h->sock, (const microtcp_header_t *)buf);
+
+      // A repeated SYN, our SYN ACK was lost
+      if(result == 0 && handshake_resend(h) == -1)
+        break;
+      if(result != 0)
+        break;
+    }
+    if(result == -1){
+      handshake_drop(h);
+    }else if(result == 1){
+      if(ntohs(((const microtcp_header_t *)buf)->control) == 0){
+        h->data = buf;
+        h->data_len = len;
+      }
+      microtcp_timer_cancel(h->sock.timers, &h->sock.rtx_timer);
+      microtcp_demux_handshake(socket->listener, h->sock.conn, FALSE);
+      if(h->tries == 1)
+        rtt_sample(&h->sock, microtcp_now_us() - h->sent_us);
+    }
+  }
+}
+
+/*
+ * Hand out a connection whose handshake is done
+ */
+static int
+handshake_accept(struct microtcp_handshake *h, microtcp_sock_t *conn,
+                 struct sockaddr *address)
+{
+  struct microtcp_handshake **link;
+  uint8_t *data = h->data;
+  ssize_t data_len = h->data_len;
+
+  for(link = &h->owner->handshakes; *link != h; link = &(*link)->next)
+    ;
+  *link = h->next;
+
+  // The socket moves to the caller, with timers of its own
+  *conn = h->sock;
+  microtcp_timer_init(&conn->rtx_timer, rtx_fire);
+  conn->nonblocking = h->owner->nonblocking;
+  conn->timers = microtcp_timer_wheel_new(microtcp_now_us());
+  free(h);
+  if(conn->timers == NULL){
+    release_buffers(conn);
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(address, &conn->address, sizeof(struct sockaddr_in));
+
+  // Nothing read the ring since, the data that implied the ACK is still
+  // there, and the first segment of the peer
+  if(data != NULL){
+    socket_input(conn, data, data_len);
+    microtcp_io_flush(conn);
+  }
+  return 0;
+}
+
+int
+microtcp_accept_conn (microtcp_sock_t *socket, microtcp_sock_t *conn,
+                      struct sockaddr *address, socklen_t address_len)
+{
+  struct microtcp_handshake *h;
+  struct microtcp_conn *c;
+  uint64_t now, next;
+
+  if(socket->listener == NULL || socket->conn != NULL ||
+     address_len < sizeof(struct sockaddr_in))
+    return -1;
+
+  for(;;){
+    handshake_run(socket);
+    for(h = socket->handshakes; h != NULL; h = h->next){
+      if(h->sock.state == ESTABLISHED)
+        return handshake_accept(h, conn, address);
+    }
+    if(socket->nonblocking){
+      errno = EAGAIN;
+      return -1;
+    }
+
+    // Until a new peer or an answer to a SYN ACK arrives, or a SYN ACK
+    // is due again
+    now = microtcp_now_us();
+    next = microtcp_timer_next(socket->timers);
+    next = next <= now ? 0 : next - now < MICROTCP_ACK_TIMEOUT_US ? next - now : MICROTCP_ACK_TIMEOUT_US;
+    c = microtcp_demux_accept(socket->listener, next);
+    if(c != NULL)
+      handshake_start(socket, c);
+  }
+}
+
+int
+microtcp_shutdown (microtcp_sock_t *socket, int how)
+{
+  microtcp_header_t *header;
+  uint32_t fin_seq = rand(), peer_seq;
+  uint64_t now, deadline;
+  uint8_t *buf;
+  ssize_t len;
+  int tries, acked = FALSE, peer_fin = socket->state == CLOSING_BY_PEER;
+
+  if(microtcp_thread_redirect(socket))
+    return microtcp_thread_stop(socket);
+
+  // A listener has no peer, only the connections nobody accepted to drop
+  if(socket->listener != NULL && socket->conn == NULL){
+    while(socket->handshakes != NULL)
+      handshake_drop(socket->handshakes);
+    microtcp_demux_free(socket->listener);
+    socket->listener = NULL;
+    release_buffers(socket);
+    socket->state = CLOSED;
+    return 0;
+  }
+
+  // Closed already, and its buffers released, maybe by the protocol
+  // thread that stopped when the peer closed
+  if(socket->state == CLOSED || socket->tx == NULL){
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  // Deliver whatever is still queued before closing
+  if(socket->sendbuf != NULL){
+    sender_flush(socket);
+    free(socket->sendbuf);
+    free(socket->scoreboard);
+    free(socket->block_crc);
+    socket->sendbuf = NULL;
+    socket->scoreboard = NULL;
+    socket->block_crc = NULL;
+  }
+
+  // Until our FIN is acknowledged and the peer sent its own
+  for(tries = 0; !(acked && peer_fin) && tries <= MICROTCP_FIN_RETRIES; tries++){
+    if(tries > 0)
+      rto_backoff(socket);
+
+    // HOST FIN, ACK, again every time the timer expires
+    if(!acked){
+      header = microtcp_io_tx_header(socket);
+      memset(header, 0, sizeof(microtcp_header_t));
+      header->seq_number = htonl(fin_seq);
+      header->control = htons(FINACK);
+      header->data_len = header_len(socket, 0);
+      header->window = htons(advertised_window(socket));
+      microtcp_io_tx_commit(socket, NULL, 0);
+    }
+    microtcp_io_flush(socket);
+
+    // PEER ACK and FIN, ignoring late ACKs of data
+    deadline = microtcp_now_us() + socket->rto_us;
+    while(!(acked && peer_fin) && (now = microtcp_now_us()) < deadline){
+      if(!microtcp_io_rx_pending(socket) && microtcp_io_wait(socket, deadline - now) <= 0)
+        break;
+      buf = microtcp_io_rx_next(socket, MSG_DONTWAIT, &len);
+      if(buf == NULL || len < (ssize_t)sizeof(microtcp_header_t))
+        continue;
+      header = (microtcp_header_t *)buf;
+
+      if(ntohs(header->control) == ACK && ntohl(header->ack_number) == fin_seq + 1){
+        acked = TRUE;
+        if(socket->type == CLIENT)
+          socket->state = CLOSING_BY_HOST;
+      }else if(ntohs(header->control) == FINACK){
+        // The server sends its FIN only after it got ours. A FIN of the
+        // client again means it missed our ACK.
+        if(socket->type == CLIENT)
+          acked = TRUE;
+        peer_fin = TRUE;
+
+        // Client FIN, ACK
+        peer_seq = ntohl(header->seq_number);
+        header = microtcp_io_tx_header(socket);
+        memset(header, 0, sizeof(microtcp_header_t));
+        header->ack_number = htonl(peer_seq + 1);
+        header->control = htons(ACK);
+        header->data_len = header_len(socket, 0);
+        microtcp_io_tx_commit(socket, NULL, 0);
+        microtcp_io_flush(socket);
+      }
+    }
+  }
+
+  if(DEBUG) printf("Connection shutdown\n");
+  socket->state = CLOSED;
+
+  // The server still hands out what it received before the FIN
+  if(socket->type == CLIENT)
+    release_buffers(socket);
+
+  return acked && peer_fin ? 0 : -1;
+}
+
+/*
+ * Return maximum packet length
+*/
+static inline
+int
+getMaxPacketSize(int remaining, int cwnd, int win)
 {
   if(remaining < cwnd && remaining < win)
     return remaining;
@@ -346,295 +981,1405 @@ getMaxPacketSize(int remaining, int cwnd, int win)
     return win;
 }
 
-ssize_t
-microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
-               int flags)
+/*
+ * Scoreboard helpers
+ */
+static inline microtcp_segment_t *
+sb_at(microtcp_sock_t *socket, size_t i)
 {
+  return &socket->scoreboard[(socket->sb_head + i) % MICROTCP_SCOREBOARD_LEN];
+}
 
-  int i, rec = 0, remaining = length, data_sent = 0, to_send, chunks = 0, bytes_lost, last_ack = 0, dup_acks = 0;
-  void* buff = malloc(sizeof(microtcp_header_t) + MICROTCP_MSS), *recbuff = malloc(sizeof(microtcp_header_t) + MICROTCP_MSS);
-  struct sockaddr_in address = socket->address; // Get saved addr from socket
-  socklen_t address_len = socket->address_len;
-  microtcp_header_t client, server;
+static inline void
+sb_pop(microtcp_sock_t *socket)
+{
+  socket->sb_head = (socket->sb_head + 1) % MICROTCP_SCOREBOARD_LEN;
+  socket->sb_count--;
+}
 
-  if(DEBUG) printf("sent: %d, length: %d\n", data_sent, length);
-  memset(&client, 0, sizeof(microtcp_header_t));
-  memset(&server, 0, sizeof(microtcp_header_t));
+/*
+ * Point at len bytes starting at sequence number seq of the send ring.
+ * Returns the number of pieces, two if the range wraps around.
+ */
+static int
+sendbuf_iov(microtcp_sock_t *socket, struct iovec *iov, uint32_t seq, size_t len)
+{
+  size_t pos = seq & (MICROTCP_SENDBUF_LEN - 1);
+  size_t first = MICROTCP_SENDBUF_LEN - pos;
+
+  // microtcp_sendfile() sends out of the mapping of the file instead
+  if(socket->sendfile_map != NULL){
+    iov[0].iov_base = (uint8_t *)socket->sendfile_map + (uint32_t)(seq - socket->sendfile_seq);
+    iov[0].iov_len = len;
+    return 1;
+  }
+
+  iov[0].iov_base = socket->sendbuf + pos;
+  if(first >= len){
+    iov[0].iov_len = len;
+    return 1;
+  }
+  iov[0].iov_len = first;
+  iov[1].iov_base = socket->sendbuf;
+  iov[1].iov_len = len - first;
+  return 2;
+}
+
+/*
+ * The CRC block starting at sequence number seq, NULL if none does
+ */
+static inline microtcp_block_crc_t *
+sendbuf_block(microtcp_sock_t *socket, uint32_t seq)
+{
+  uint32_t off = seq - socket->block_base;
+  microtcp_block_crc_t *blk = &socket->block_crc[off / MICROTCP_MSS % MICROTCP_BLOCK_CRC_LEN];
+
+  return blk->seq_number == seq ? blk : NULL;
+}
+
+/*
+ * Copy data to the tail of the send ring, taking the CRC of each block
+ * on the way
+ */
+static void
+sendbuf_append(microtcp_sock_t *socket, const uint8_t *data, size_t len)
+{
+  uint32_t seq = socket->snd_una + socket->sendbuf_fill;
+  size_t pos, off, n;
+  microtcp_block_crc_t *blk;
+
+  while(len > 0){
+    pos = seq & (MICROTCP_SENDBUF_LEN - 1);
+    off = (uint32_t)(seq - socket->block_base) % MICROTCP_MSS;
+    n = MICROTCP_MSS - off;
+    if(n > MICROTCP_SENDBUF_LEN - pos)
+      n = MICROTCP_SENDBUF_LEN - pos;
+    if(n > len)
+      n = len;
+
+    blk = &socket->block_crc[(uint32_t)(seq - socket->block_base) / MICROTCP_MSS % MICROTCP_BLOCK_CRC_LEN];
+    if(off == 0){
+      blk->seq_number = seq;
+      blk->len = 0;
+      blk->crc = 0;
+    }
 
-  while(data_sent < length){
-
-    // Get chunk size
-    to_send = getMaxPacketSize(remaining, socket->cwnd, 55555);
-    if(DEBUG) printf("I picked %d | REMAINING = %d CWND = %d SSTHRESH = %d WINDOWS = %d\n", to_send, remaining, socket->cwnd, socket->ssthresh, socket->curr_win_size);
-    //printf("Remaining: %d\n", remaining);
-    //printf("Sending a segment of %d\n", to_send);
-
-    chunks = to_send / MICROTCP_MSS;
-    for(i = 0; i < chunks; i++){
-      memset(buff, 0, sizeof(microtcp_header_t) + MICROTCP_MSS);
-      if(DEBUG) printf("Sending chunk of 1400 number %d\n", i);
-
-      // Get data length and seq num
-      ((microtcp_header_t*)buff)->data_len = htonl(MICROTCP_MSS);
-      ((microtcp_header_t*)buff)->seq_number = htonl(socket->seq_number + i * MICROTCP_MSS);
-
-      // Put current buffer part in packet
-      memcpy(buff + sizeof(microtcp_header_t), buffer + data_sent, MICROTCP_MSS);
-
-      // Checksum
-      ((microtcp_header_t*)buff)->checksum = htonl(crc32(buff, sizeof(microtcp_header_t) + MICROTCP_MSS));
-      if(DEBUG) printf("Checksum %lu\n", ntohl(((microtcp_header_t*)buff)->checksum));
-
-      sendto(socket->sd,
-            buff,
-            sizeof(microtcp_header_t) + MICROTCP_MSS,
-            0,
-            (struct sockaddr *)&address,
-            address_len
-      );
-
-      data_sent += MICROTCP_MSS;
-      remaining = length - data_sent;
-    }
-
-    // If there is any remaining thats not 1400B
-    if(to_send % MICROTCP_MSS != 0){
-      chunks++;
-      memset(buff, 0, sizeof(microtcp_header_t) + MICROTCP_MSS);
-      if(DEBUG) printf("Sending remaining %d bytes\n", to_send % MICROTCP_MSS);
-
-      // Get data length and seq num
-      ((microtcp_header_t*)buff)->data_len = htonl(to_send % MICROTCP_MSS);
-      ((microtcp_header_t*)buff)->seq_number = htonl(socket->seq_number + i * MICROTCP_MSS);
-
-      // Put current buffer part in packet
-      memcpy(buff + sizeof(microtcp_header_t), buffer + data_sent, MICROTCP_MSS);
-
-      // Checksum
-      ((microtcp_header_t*)buff)->checksum = htonl(crc32(buff, sizeof(microtcp_header_t) + to_send % MICROTCP_MSS));
-      if(DEBUG) printf("Checksum %lu\n", ntohl(((microtcp_header_t*)buff)->checksum));
-      
-      sendto(socket->sd,
-            buff,
-            sizeof(microtcp_header_t) + ntohl(((microtcp_header_t*)buff)->data_len),
-            0,
-            (struct sockaddr *)&address,
-            address_len
-      );
-
-      data_sent += to_send % MICROTCP_MSS;
-    }
-
-    // Get ACKS
-    for(int i = 0; i < chunks; i++){
-      // Receive
-      rec = recvfrom(socket->sd, &server, sizeof(microtcp_header_t), 0, &(socket->address), &(socket->address_len));
-      if(rec < 0){
-
-        // Timeout
-        socket->ssthresh = socket->cwnd / 2;
-        socket->cwnd = MICROTCP_MSS;
-
-        // Retransmit
-        bytes_lost = socket->seq_number - ntohl(server.ack_number);
-        if(DEBUG) printf("RETRANSMITTING %d LOST BYTES\n", bytes_lost);
-        socket->seq_number = ntohl(server.ack_number);
-        socket->curr_win_size = ntohl(server.window);
-        data_sent -= bytes_lost;
+    // A block whose start was copied before the blocks were realigned
+    // has no CRC to continue
+    if(blk->seq_number + blk->len == seq){
+      blk->crc = update_crc32_copy(blk->crc, socket->sendbuf + pos, data, n);
+      blk->len += n;
+    }else{
+      memcpy(socket->sendbuf + pos, data, n);
+    }
+
+    socket->sendbuf_fill += n;
+    seq += n;
+    data += n;
+    len -= n;
+  }
+}
+
+/*
+ * Build and send a single data segment of the scoreboard
+ */
+static void
+send_segment(microtcp_sock_t *socket, microtcp_segment_t *seg)
+{
+  microtcp_header_t *header = microtcp_io_tx_header(socket);
+  struct iovec payload[MICROTCP_IOV_MAX - 1];
+  microtcp_block_crc_t *blk;
+  uint32_t crc;
+  int i, iovcnt;
+
+  memset(header, 0, sizeof(microtcp_header_t));
+  header->seq_number = htonl(seg->seq_number);
+  header->data_len = header_len(socket, seg->data_len);
+  seg->ts = socket->ts_ok ? ts_now() : 0;
+  header->future_use2 = htonl(seg->ts);
+
+  // The payload is sent straight out of the send buffer
+  iovcnt = sendbuf_iov(socket, payload, seg->seq_number, seg->data_len);
+
+  // Checksum over the header and every payload piece, unless the CRC of
+  // the payload was taken when it was copied in
+  crc = update_crc32(0xffffffff, (const uint8_t *)header, sizeof(microtcp_header_t));
+  blk = socket->sendfile_map == NULL ? sendbuf_block(socket, seg->seq_number) : NULL;
+  if(blk != NULL && blk->len == seg->data_len){
+    crc = crc32_combine_op(crc, blk->crc, seg->data_len == MICROTCP_MSS ?
+                           socket->block_crc_op : crc32_combine_gen(seg->data_len));
+  }else{
+    for(i = 0; i < iovcnt; i++)
+      crc = update_crc32(crc, payload[i].iov_base, payload[i].iov_len);
+  }
+  seg->crc = crc;
+  header->checksum = htonl(crc ^ 0xffffffff);
+
+  microtcp_io_tx_commit(socket, payload, iovcnt);
+}
+
+/*
+ * Send the packet of a segment again. Only the timestamp changes, and
+ * the CRC is linear, so the old one is patched with the CRC of the
+ * difference, shifted past the bytes that follow it. The payload isn't
+ * read again, unless a partial ACK cut the segment since it was sent.
+ */
+static void
+resend_segment(microtcp_sock_t *socket, microtcp_segment_t *seg)
+{
+  microtcp_header_t *header;
+  struct iovec payload[MICROTCP_IOV_MAX - 1];
+  uint32_t ts, diff;
+  int iovcnt;
+
+  if(seg->flags & MICROTCP_SEG_TRIMMED){
+    seg->flags &= ~MICROTCP_SEG_TRIMMED;
+    send_segment(socket, seg);
+    return;
+  }
+
+  header = microtcp_io_tx_header(socket);
+  memset(header, 0, sizeof(microtcp_header_t));
+  header->seq_number = htonl(seg->seq_number);
+  header->data_len = header_len(socket, seg->data_len);
+  if(socket->ts_ok){
+    ts = ts_now();
+    diff = htonl(seg->ts ^ ts);
+    seg->crc ^= crc32_combine_op(update_crc32(0, (const uint8_t *)&diff, sizeof(diff)), 0,
+                                 seg->data_len == MICROTCP_MSS ? socket->ts_patch_op :
+                                 crc32_combine_gen(sizeof(uint32_t) + seg->data_len));
+    seg->ts = ts;
+  }
+  header->future_use2 = htonl(seg->ts);
+  header->checksum = htonl(seg->crc ^ 0xffffffff);
+
+  iovcnt = sendbuf_iov(socket, payload, seg->seq_number, seg->data_len);
+  microtcp_io_tx_commit(socket, payload, iovcnt);
+}
+
+/*
+ * Send again a segment the peer is missing
+ */
+static void
+retransmit_segment(microtcp_sock_t *socket, microtcp_segment_t *seg)
+{
+  if(DEBUG) printf("RETRANSMITTING %u BYTES AT %u\n", seg->data_len, seg->seq_number);
+  rate_stamp(socket, seg, microtcp_now_us());
+  resend_segment(socket, seg);
+  seg->retransmits++;
+
+  // Karn's rule, an ACK can't tell which copy it answers
+  socket->rtt_start = 0;
+  socket->packets_retransmitted++;
+  socket->bytes_retransmitted += seg->data_len;
+}
+
+/*
+ * Take the pacing rate of the congestion control. The burst grows with
+ * the rate, so that the timer fires about once per slack interval
+ * whatever the rate.
+ */
+static void
+pacer_update(microtcp_sock_t *socket)
+{
+  uint64_t burst;
+
+  if(socket->pacing == MICROTCP_PACING_OFF){
+    socket->pacing_rate = 0;
+    socket->pacing_burst = 0;
+    return;
+  }
+
+  socket->pacing_rate = socket->cc->pacing_rate(socket);
+  burst = socket->pacing_rate * MICROTCP_PACING_SLACK_US / 1000000;
+  if(burst < 2 * MICROTCP_MSS)
+    burst = 2 * MICROTCP_MSS;
+  if(burst > MICROTCP_PACING_BURST_MAX)
+    burst = MICROTCP_PACING_BURST_MAX;
+  socket->pacing_burst = burst;
+}
+
+/*
+ * Put on the wire as much of the queued data as the window allows
+ */
+static void
+sender_output(microtcp_sock_t *socket)
+{
+  uint32_t flight = socket->seq_number - socket->snd_una;
+  size_t cwnd;
+  int to_send, len, unsent = socket->sendbuf_fill - flight;
+  uint64_t now, ahead, burst_us = 0;
+  microtcp_segment_t *seg;
+
+  // The peer has no room, probe it until it opens the window again
+  if(socket->curr_win_size == 0){
+    if(flight == 0 && unsent > 0 && !microtcp_timer_pending(&socket->persist_timer))
+      microtcp_timer_arm(socket->timers, &socket->persist_timer, microtcp_now_us() + socket->persist_backoff);
+    return;
+  }
+
+  // Limited transmit, each of the first duplicate ACKs lets one more
+  // segment out, so that a small window still collects enough of them
+  cwnd = socket->cwnd;
+  if(!socket->in_recovery && socket->dup_acks < MICROTCP_DUP_ACK_THRESH)
+    cwnd += socket->dup_acks * MICROTCP_MSS;
+
+  if(cwnd <= flight || socket->curr_win_size <= flight)
+    return;
+
+  to_send = getMaxPacketSize(unsent, cwnd - flight, socket->curr_win_size - flight);
+  if(DEBUG) printf("I picked %d | CWND = %zu SSTHRESH = %zu WINDOWS = %zu\n", to_send, socket->cwnd, socket->ssthresh, socket->curr_win_size);
+
+  now = microtcp_now_us();
+  pacer_update(socket);
+  if(socket->pacing_rate > 0)
+    burst_us = (uint64_t)socket->pacing_burst * 1000000 / socket->pacing_rate;
+
+  while(to_send > 0 && socket->sb_count < MICROTCP_SCOREBOARD_LEN){
+    len = to_send < MICROTCP_MSS ? to_send : MICROTCP_MSS;
+
+    // Don't split the data into tiny segments, wait until a full one fits,
+    // unless the window of the peer is all we will ever get
+    if(len < MICROTCP_MSS && len < unsent && (flight > 0 || socket->curr_win_size >= MICROTCP_MSS))
+      break;
+
+    // Pacing, spread the window over the round trip instead of a burst.
+    // A burst worth of segments leaves at once, later ones are held back
+    // by the timer or, with SO_TXTIME, by the kernel.
+    ahead = 0;
+    if(socket->pacing_rate > 0){
+      if(socket->pace_next_us < now)
+        socket->pace_next_us = now;
+      ahead = socket->pace_next_us - now;
+      if(ahead > burst_us && socket->pacing == MICROTCP_PACING_TIMER){
+        microtcp_timer_arm(socket->timers, &socket->pace_timer, socket->pace_next_us - burst_us);
+        break;
       }
+    }
+
+    seg = sb_at(socket, socket->sb_count++);
+    seg->seq_number = socket->seq_number;
+    seg->data_len = len;
+    seg->retransmits = 0;
+    seg->flags = 0;
+    rate_stamp(socket, seg, now);
+    send_segment(socket, seg);
+    if(ahead > burst_us)
+      microtcp_io_tx_time(socket, socket->pace_next_us);
+    if(socket->pacing_rate > 0)
+      socket->pace_next_us += (uint64_t)len * 1000000 / socket->pacing_rate;
+
+    // Without timestamps, time one segment per round trip
+    if(!socket->ts_ok && socket->rtt_start == 0){
+      socket->rtt_seq = seg->seq_number + len;
+      socket->rtt_start = microtcp_now_us();
+    }
 
+    socket->seq_number += len;
+    flight += len;
+    to_send -= len;
+    unsent -= len;
 
-      // Check if ACK
-      if(ntohs(server.control) != ACK)
-        continue;
+    // The next segment starts off the block boundaries, move them along
+    if(len < MICROTCP_MSS)
+      socket->block_base = socket->seq_number;
+  }
+
+  // Out of data with room left in the window, the rate samples of what
+  // is in flight now tell nothing about the path
+  if(unsent == 0 && flight < cwnd)
+    socket->app_limited = socket->delivered + flight > 0 ? socket->delivered + flight : 1;
+
+  // Put the whole window on the wire at once
+  microtcp_io_flush(socket);
+
+  // Arm the retransmission timer
+  if(!microtcp_timer_pending(&socket->rtx_timer) && socket->sb_count > 0)
+    microtcp_timer_arm(socket->timers, &socket->rtx_timer, microtcp_now_us() + socket->rto_us);
+}
 
-      if(ntohl(server.ack_number) > socket->seq_number){ // Normal
-        // Advance seq nums
-        socket->seq_number = ntohl(server.ack_number);
-        socket->curr_win_size = ntohl(server.window);
-        last_ack = ntohl(server.ack_number);
-        dup_acks = 0;
-      }else if(dup_acks >= 3){ // Fast Retransmit
-        // GO-BACK-N
-        bytes_lost = socket->seq_number - ntohl(server.ack_number);
-        if(DEBUG) printf("RETRANSMITTING %d LOST BYTES\n", bytes_lost);
-        socket->seq_number = ntohl(server.ack_number);
-        socket->curr_win_size = ntohl(server.window);
-        data_sent -= bytes_lost;
-      }else if(ntohl(server.ack_number) <= socket->seq_number + MICROTCP_MSS && last_ack == ntohl(server.ack_number)){ // Duplicate ACK
-        dup_acks++;
+/*
+ * Remember the delivery state a segment leaves with, for the rate
+ * sample its ACK will take
+ */
+static void
+rate_stamp(microtcp_sock_t *socket, microtcp_segment_t *seg, uint64_t now)
+{
+  // Nothing in flight, a new sampling interval starts here
+  if(socket->seq_number == socket->snd_una){
+    socket->first_sent_us = now;
+    socket->delivered_us = now;
+  }
+
+  seg->sent_us = now;
+  seg->delivered = socket->delivered;
+  seg->delivered_us = socket->delivered_us;
+  seg->first_sent_us = socket->first_sent_us;
+  if(socket->app_limited != 0)
+    seg->flags |= MICROTCP_SEG_APP_LIMITED;
+  else
+    seg->flags &= ~MICROTCP_SEG_APP_LIMITED;
+}
+
+/*
+ * A segment reached the peer, the most recently sent one defines the
+ * interval of the rate sample
+ */
+static void
+rate_delivered(microtcp_sock_t *socket, const microtcp_segment_t *seg,
+               microtcp_rate_sample_t *rs, uint64_t now)
+{
+  socket->delivered += seg->data_len;
+  socket->delivered_us = now;
+  rs->acked += seg->data_len;
+
+  if(!rs->valid || seg->delivered >= rs->prior_delivered){
+    rs->valid = TRUE;
+    rs->prior_delivered = seg->delivered;
+    rs->prior_us = seg->delivered_us;
+    rs->send_elapsed_us = seg->sent_us - seg->first_sent_us;
+    rs->app_limited = (seg->flags & MICROTCP_SEG_APP_LIMITED) != 0;
+    rs->rtt_us = seg->retransmits == 0 ? now - seg->sent_us : 0;
+    socket->first_sent_us = seg->sent_us;
+  }
+}
+
+/*
+ * Hand the rate sample of an ACK to the congestion control
+ */
+static void
+rate_sample(microtcp_sock_t *socket, microtcp_rate_sample_t *rs)
+{
+  uint64_t ack_elapsed;
+
+  if(socket->app_limited != 0 && socket->delivered > socket->app_limited)
+    socket->app_limited = 0;
+
+  if(!rs->valid || socket->cc->on_rate_sample == NULL)
+    return;
+
+  // The slower of sending and acknowledging bounds the rate
+  rs->delivered = socket->delivered - rs->prior_delivered;
+  ack_elapsed = socket->delivered_us - rs->prior_us;
+  rs->interval_us = rs->send_elapsed_us > ack_elapsed ? rs->send_elapsed_us : ack_elapsed;
+  socket->cc->on_rate_sample(socket, rs);
+}
+
+/*
+ * Mark the segments inside the SACK block [left, right) as received
+ */
+static void
+sender_sack(microtcp_sock_t *socket, uint32_t left, uint32_t right,
+            microtcp_rate_sample_t *rs, uint64_t now)
+{
+  microtcp_segment_t *seg;
+  size_t i;
+
+  // Ignore blocks that make no sense
+  if(!SEQ_LT(left, right) || SEQ_LT(left, socket->snd_una) || SEQ_GT(right, socket->seq_number))
+    return;
+
+  for(i = 0; i < socket->sb_count; i++){
+    seg = sb_at(socket, i);
+    if(SEQ_GEQ(seg->seq_number, right))
+      break;
+    if(SEQ_GEQ(seg->seq_number, left) && SEQ_LEQ(seg->seq_number + seg->data_len, right) &&
+       !(seg->flags & MICROTCP_SEG_SACKED)){
+      seg->flags |= MICROTCP_SEG_SACKED;
+      rate_delivered(socket, seg, rs, now);
+    }
+  }
+}
+
+/*
+ * Retransmit the holes the SACKs reveal. A segment is taken as lost once
+ * MICROTCP_DUP_ACK_THRESH segments above it were SACKed, and is sent
+ * again only once per recovery.
+ */
+static void
+sack_retransmit(microtcp_sock_t *socket)
+{
+  microtcp_segment_t *seg;
+  size_t i, sacked = 0;
+
+  for(i = 0; i < socket->sb_count; i++)
+    if(sb_at(socket, i)->flags & MICROTCP_SEG_SACKED)
+      sacked++;
+
+  // sacked counts the SACKed segments above the current one
+  for(i = 0; i < socket->sb_count && sacked >= MICROTCP_DUP_ACK_THRESH; i++){
+    seg = sb_at(socket, i);
+    if(seg->flags & MICROTCP_SEG_SACKED){
+      sacked--;
+    }else if(!(seg->flags & MICROTCP_SEG_RESENT)){
+      retransmit_segment(socket, seg);
+      seg->flags |= MICROTCP_SEG_RESENT;
+    }
+  }
+}
+
+/*
+ * Process an ACK from the peer
+ */
+static void
+sender_input(microtcp_sock_t *socket, const microtcp_header_t *server)
+{
+  uint32_t ack_number = ntohl(server->ack_number);
+  uint32_t snd_una = socket->snd_una, bytes_acked;
+  size_t window, i;
+  uint32_t rtt;
+  uint64_t delay, now;
+  int window_changed;
+  microtcp_segment_t *seg;
+  microtcp_rate_sample_t rs;
+
+  // Check if ACK
+  if(ntohs(server->control) != ACK)
+    return;
+
+  memset(&rs, 0, sizeof(rs));
+  now = microtcp_now_us();
+
+  // A window update is not a duplicate ACK
+  window = (size_t)ntohs(server->window) << socket->snd_wscale;
+  window_changed = window != socket->curr_win_size;
+  socket->curr_win_size = window;
+  if(window > 0){
+    microtcp_timer_cancel(socket->timers, &socket->persist_timer);
+    socket->persist_backoff = socket->rto_us;
+  }
+
+  if(SEQ_GT(ack_number, snd_una) && SEQ_LEQ(ack_number, socket->seq_number)){ // New data acknowledged
+    // Drop every segment that is fully covered, trim a partially covered one
+    while(socket->sb_count > 0){
+      seg = sb_at(socket, 0);
+      if(SEQ_LEQ(seg->seq_number + seg->data_len, ack_number)){
+        if(!(seg->flags & MICROTCP_SEG_SACKED))
+          rate_delivered(socket, seg, &rs, now);
+        sb_pop(socket);
+      }else{
+        if(SEQ_GT(ack_number, seg->seq_number)){
+          seg->data_len -= ack_number - seg->seq_number;
+          seg->seq_number = ack_number;
+          seg->flags |= MICROTCP_SEG_TRIMMED;
+        }
+        break;
       }
+    }
+    // The echo of our timestamp gives a sample on every ACK, even for
+    // retransmitted data, minus the time the ACK waited in the socket
+    if(socket->ts_ok && server->future_use2 != 0){
+      rtt = ts_now() - ntohl(server->future_use2);
+      delay = microtcp_io_rx_delay(socket);
+      rtt_sample(socket, rtt > delay ? rtt - delay : rtt);
+    }else if(socket->rtt_start != 0 && SEQ_GEQ(ack_number, socket->rtt_seq)){ // The timed segment arrived
+      rtt_sample(socket, microtcp_now_us() - socket->rtt_start);
+      socket->rtt_start = 0;
+    }
 
-      // Congestion Control
-      if(socket->cwnd <= socket->ssthresh){ // Slow Start
-        socket->cwnd += MICROTCP_MSS;
-      }else if(socket->cwnd > socket->ssthresh){ // Congestion Avoidance
-        socket->cwnd += 1;
+    bytes_acked = ack_number - snd_una;
+    socket->sendbuf_fill -= bytes_acked;
+    socket->snd_una = ack_number;
+    socket->dup_acks = 0;
+    rtx_restart(socket, now);
+
+    if(socket->sack_ok && server->future_use1 != 0)
+      sender_sack(socket, ntohl(server->future_use0), ntohl(server->future_use1), &rs, now);
+
+    if(socket->in_recovery){
+      // A partial ACK means the next segment is missing as well
+      if(SEQ_LT(ack_number, socket->recover) && socket->sb_count > 0 && socket->cc->partial_ack_recovery){
+        seg = sb_at(socket, 0);
+        if(!(seg->flags & MICROTCP_SEG_RESENT)){
+          retransmit_segment(socket, seg);
+          seg->flags |= MICROTCP_SEG_RESENT;
+        }
+        if(socket->sack_ok)
+          sack_retransmit(socket);
+      }else{
+        socket->in_recovery = FALSE;
       }
+    }
+
+    // Congestion Control, the window stays put during recovery
+    if(!socket->in_recovery)
+      socket->cc->on_ack(socket, bytes_acked);
+    rate_sample(socket, &rs);
+  }else if(ack_number == snd_una && socket->sb_count > 0 && !window_changed){ // Duplicate ACK
+    socket->dup_acks++;
+    if(socket->sack_ok && server->future_use1 != 0)
+      sender_sack(socket, ntohl(server->future_use0), ntohl(server->future_use1), &rs, now);
+
+    if(socket->dup_acks == MICROTCP_DUP_ACK_THRESH && !socket->in_recovery){ // Fast Retransmit
+      // Whatever was resent in an earlier recovery may be lost again
+      for(i = 0; i < socket->sb_count; i++)
+        sb_at(socket, i)->flags &= ~MICROTCP_SEG_RESENT;
+
+      seg = sb_at(socket, 0);
+      retransmit_segment(socket, seg);
+      seg->flags |= MICROTCP_SEG_RESENT;
+      socket->cc->on_loss(socket);
+      socket->in_recovery = TRUE;
+      socket->recover = socket->seq_number;
+    }
+
+    // Every hole SACKed over, not just the first one
+    if(socket->in_recovery && socket->sack_ok)
+      sack_retransmit(socket);
+    rate_sample(socket, &rs);
+  }
+}
+
+/*
+ * The oldest segment was not acknowledged in time
+ */
+static void
+sender_timeout(microtcp_sock_t *socket)
+{
+  size_t i;
+
+  socket->cc->on_timeout(socket);
+
+  // Forget the SACKs, the peer might have dropped what it reported, but
+  // not that a segment was cut since its CRC was taken
+  for(i = 0; i < socket->sb_count; i++)
+    sb_at(socket, i)->flags &= MICROTCP_SEG_TRIMMED;
+
+  // Retransmit only the oldest segment, the rest are resent as partial ACKs reveal them missing
+  if(socket->sb_count > 0)
+    retransmit_segment(socket, sb_at(socket, 0));
+  socket->in_recovery = TRUE;
+  socket->recover = socket->seq_number;
+  socket->dup_acks = 0;
+  rto_backoff(socket);
+  rtx_restart(socket, microtcp_now_us());
+}
+
+/*
+ * Process the ACKs that arrived. If block is set, wait for at least one
+ * (or the socket timeout), otherwise only drain what is already queued.
+ */
+static void
+sender_poll(microtcp_sock_t *socket, int block)
+{
+  uint64_t now, deadline;
+  uint8_t *buf;
+  ssize_t len;
+
+  // Wait for an ACK, but no longer than the nearest timer
+  if(block && !microtcp_io_rx_pending(socket)){
+    microtcp_io_flush(socket);
+    deadline = microtcp_timer_next(socket->timers);
+    now = microtcp_now_us();
+    if(deadline == UINT64_MAX)
+      microtcp_io_wait(socket, socket->rto_us);
+    else if(deadline > now)
+      microtcp_io_wait(socket, deadline - now);
+  }
+
+  // Drain every queued ACK
+  while((buf = microtcp_io_rx_next(socket, MSG_DONTWAIT, &len)) != NULL){
+    if(len >= (ssize_t)sizeof(microtcp_header_t))
+      sender_input(socket, (microtcp_header_t *)buf);
+  }
+
+  // Retransmissions, held back segments and window probes that are due
+  microtcp_timer_run(socket->timers, microtcp_now_us());
+  microtcp_io_flush(socket);
+}
 
-      // Flow Control
-      if(socket->curr_win_size == 0){
-        // If window is 0, we will send empty packets till its normal again
-        
-        // Send 0 data packet
-        sendto(socket->sd,
-            buff,
-            sizeof(microtcp_header_t),
-            0,
-            (struct sockaddr *)&address,
-            address_len
-        );
-
-        usleep(rand() % MICROTCP_ACK_TIMEOUT_US);
+/*
+ * The oldest segment was not acknowledged in time
+ */
+static void
+rtx_fire(microtcp_timer_t *timer)
+{
+  microtcp_sock_t *socket = microtcp_container_of(timer, microtcp_sock_t, rtx_timer);
+
+  sender_timeout(socket);
+  microtcp_loop_touch(socket);
+}
+
+/*
+ * The window of the peer is still 0, an empty segment makes it tell us
+ * its window
+ */
+static void
+persist_fire(microtcp_timer_t *timer)
+{
+  microtcp_sock_t *socket = microtcp_container_of(timer, microtcp_sock_t, persist_timer);
+  microtcp_header_t *server;
+
+  server = microtcp_io_tx_header(socket);
+  memset(server, 0, sizeof(microtcp_header_t));
+  server->seq_number = htonl(socket->seq_number);
+  server->data_len = header_len(socket, 0);
+  server->checksum = htonl(crc32((const uint8_t *)server, sizeof(microtcp_header_t)));
+  microtcp_io_tx_commit(socket, NULL, 0);
+
+  // Back off, in case the peer keeps its window closed
+  socket->persist_backoff *= 2;
+  if(socket->persist_backoff > MICROTCP_PERSIST_MAX_US)
+    socket->persist_backoff = MICROTCP_PERSIST_MAX_US;
+  microtcp_timer_arm(socket->timers, &socket->persist_timer, microtcp_now_us() + socket->persist_backoff);
+  microtcp_loop_touch(socket);
+}
+
+/*
+ * The pacer lets the next segments go
+ */
+static void
+pacer_fire(microtcp_timer_t *timer)
+{
+  microtcp_sock_t *socket = microtcp_container_of(timer, microtcp_sock_t, pace_timer);
+
+  sender_output(socket);
+  microtcp_loop_touch(socket);
+}
+
+/*
+ * Block until everything in the send buffer is acknowledged
+ */
+static void
+sender_flush(microtcp_sock_t *socket)
+{
+  while(socket->sendbuf_fill > 0){
+    sender_output(socket);
+    sender_poll(socket, TRUE);
+  }
+}
+
+/*
+ * Allocate the send buffer and the scoreboard at the first send
+ */
+static void
+sender_init(microtcp_sock_t *socket)
+{
+  if(socket->sendbuf == NULL){
+    socket->sendbuf = malloc(MICROTCP_SENDBUF_LEN);
+    socket->scoreboard = malloc(MICROTCP_SCOREBOARD_LEN * sizeof(microtcp_segment_t));
+    socket->block_crc = calloc(MICROTCP_BLOCK_CRC_LEN, sizeof(microtcp_block_crc_t));
+    socket->block_base = socket->seq_number;
+    socket->block_crc_op = crc32_combine_gen(MICROTCP_MSS);
+    socket->ts_patch_op = crc32_combine_gen(sizeof(uint32_t) + MICROTCP_MSS);
+    socket->sendbuf_fill = 0;
+    socket->sb_head = 0;
+    socket->sb_count = 0;
+    socket->snd_una = socket->seq_number;
+    socket->dup_acks = 0;
+    socket->in_recovery = FALSE;
+    microtcp_timer_cancel(socket->timers, &socket->rtx_timer);
+    microtcp_timer_cancel(socket->timers, &socket->persist_timer);
+    socket->persist_backoff = socket->rto_us;
+    socket->rtt_start = 0;
+  }
+}
+
+ssize_t
+microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
+               int flags)
+{
+  size_t copied = 0, space, n;
+
+  if(microtcp_thread_redirect(socket))
+    return microtcp_thread_send(socket, buffer, length);
+  if(socket->state == CLOSED || socket->tx == NULL){
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  sender_init(socket);
+  if(DEBUG) printf("length: %zu\n", length);
+
+  while(copied < length){
+    space = MICROTCP_SENDBUF_LEN - socket->sendbuf_fill;
+
+    // Buffer is full, make room by waiting for ACKs
+    if(space == 0){
+      if(socket->nonblocking){
+        sender_poll(socket, FALSE);
+        sender_output(socket);
+        if(socket->sendbuf_fill == MICROTCP_SENDBUF_LEN)
+          break;
+        continue;
       }
+      sender_poll(socket, TRUE);
+      sender_output(socket);
+      continue;
     }
+
+    // Queue as much as fits
+    n = length - copied < space ? length - copied : space;
+    sendbuf_append(socket, (const uint8_t *)buffer + copied, n);
+    copied += n;
+
+    sender_output(socket);
   }
 
-  free(buff);
-  free(recbuff);
-  return data_sent;
+  // Keep the pipe full with whatever ACKs are already here
+  sender_poll(socket, FALSE);
+  sender_output(socket);
+  microtcp_loop_touch(socket);
+
+  if(copied == 0 && length > 0){
+    errno = EAGAIN;
+    return -1;
+  }
+  return copied;
+}
+
+/*
+ * microtcp_sendfile() for what can't be mapped, in large reads that the
+ * kernel is told to read ahead of
+ */
+static ssize_t
+sendfile_read(microtcp_sock_t *socket, int fd, off_t offset, size_t count)
+{
+  uint8_t *block;
+  size_t sent = 0, n;
+  ssize_t got, queued;
+
+  if(posix_memalign((void **)&block, sysconf(_SC_PAGESIZE), MICROTCP_SENDFILE_BLOCK) != 0){
+    errno = ENOMEM;
+    return -1;
+  }
+  posix_fadvise(fd, offset, count, POSIX_FADV_SEQUENTIAL);
+
+  while(sent < count){
+    n = count - sent < MICROTCP_SENDFILE_BLOCK ? count - sent : MICROTCP_SENDFILE_BLOCK;
+    got = pread(fd, block, n, offset + sent);
+    if(got <= 0){
+      if(got < 0 && sent == 0){
+        free(block);
+        return -1;
+      }
+      break;
+    }
+    posix_fadvise(fd, offset + sent + got, MICROTCP_SENDFILE_BLOCK, POSIX_FADV_WILLNEED);
+
+    // A non-blocking socket may take less, the rest is read again next time
+    queued = microtcp_send(socket, block, got, 0);
+    if(queued > 0)
+      sent += queued;
+    if(queued < got)
+      break;
+  }
+  free(block);
+  if(sent == 0 && count > 0 && socket->nonblocking){
+    errno = EAGAIN;
+    return -1;
+  }
+  return sent;
 }
 
 ssize_t
-microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+microtcp_sendfile (microtcp_sock_t *socket, int fd, off_t offset, size_t count)
 {
-  microtcp_header_t client, server; // Headers
-  client.window = htons(MICROTCP_WIN_SIZE);
-  struct sockaddr_in address = socket->address; // Get saved addr from socket
-  socklen_t address_len = socket->address_len;
-  int received = -1, remaining_bytes = length, received_total = 0, checksum, buffer_index = 0;
-  uint8_t *recvbuf = socket->recvbuf;
-  uint8_t *buf = (uint8_t*)malloc(sizeof(microtcp_header_t) + MICROTCP_MSS);
+  long page = sysconf(_SC_PAGESIZE);
+  off_t start = offset & ~(off_t)(page - 1);
+  size_t map_len = count + (offset - start), queued = 0, n;
+  uint8_t *map;
+
+  if(count == 0)
+    return 0;
+  if(!microtcp_thread_redirect(socket) && (socket->state == CLOSED || socket->tx == NULL)){
+    errno = ENOTCONN;
+    return -1;
+  }
+  if(socket->nonblocking || microtcp_thread_redirect(socket))
+    return sendfile_read(socket, fd, offset, count);
+  map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, start);
+  if(map == MAP_FAILED)
+    return sendfile_read(socket, fd, offset, count);
+  madvise(map, map_len, MADV_SEQUENTIAL);
+
+  // The send buffer and the mapping can't both hold data in flight
+  sender_init(socket);
+  sender_flush(socket);
+  socket->sendfile_map = map + (offset - start);
+  socket->sendfile_seq = socket->snd_una;
+
+  // The file is queued a bit at a time, so that its pages are read in
+  // ahead of the segments and the sequence numbers never wrap in the queue
+  while(queued < count || socket->sendbuf_fill > 0){
+    // Offsets from sendfile_seq are taken in 32 bits, so it follows
+    // snd_una through files over 4 GiB
+    socket->sendfile_map += (uint32_t)(socket->snd_una - socket->sendfile_seq);
+    socket->sendfile_seq = socket->snd_una;
+    if(queued < count && socket->sendbuf_fill < MICROTCP_SENDFILE_AHEAD / 2){
+      n = count - queued < MICROTCP_SENDFILE_AHEAD - socket->sendbuf_fill ?
+          count - queued : MICROTCP_SENDFILE_AHEAD - socket->sendbuf_fill;
+      madvise(map + ((offset - start + queued) & ~(size_t)(page - 1)),
+              n + ((offset - start + queued) & (page - 1)), MADV_WILLNEED);
+      socket->sendbuf_fill += n;
+      queued += n;
+    }
+    sender_output(socket);
+    sender_poll(socket, TRUE);
+  }
 
-  // If connection is shutdown, exit with -1
-  if(socket->state == CLOSED) return -1;
+  // Data of microtcp_send() starts off the blocks of what came before
+  socket->sendfile_map = NULL;
+  socket->block_base = socket->seq_number;
+  munmap(map, map_len);
+  microtcp_loop_touch(socket);
+  return count;
+}
 
-  if(DEBUG) printf("ACK %d\n", socket->ack_number);
-  memset(&client, 0, sizeof(microtcp_header_t));
-  memset(&server, 0, sizeof(microtcp_header_t));
+int
+microtcp_set_rx_timestamps (microtcp_sock_t *socket, int enable)
+{
+  int flags = enable ? SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE : 0;
 
-  // Receive a packet
-  while(remaining_bytes > 0){
-    memset(buf, 0, sizeof(microtcp_header_t) + MICROTCP_MSS);
+  if(setsockopt(socket->sd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(int)) == -1)
+    return -1;
+  socket->rx_timestamps = enable;
+  return 0;
+}
 
-    // Receive
-    received = recvfrom(socket->sd,
-      buf,
-      sizeof(microtcp_header_t) + MICROTCP_MSS,  
-      0,
-      (struct sockaddr *)&address, 
-      &address_len
-    );
-    if(received < 0){
+int
+microtcp_set_congestion_control (microtcp_sock_t *socket, const char *name)
+{
+  const struct microtcp_cc_ops *cc = microtcp_cc_find(name);
+
+  if(cc == NULL)
+    return -1;
+  socket->cc = cc;
+  socket->cc->init(socket);
+  return 0;
+}
+
+int
+microtcp_set_pacing (microtcp_sock_t *socket, microtcp_pacing_t mode)
+{
+  struct sock_txtime txtime;
+
+  txtime.clockid = CLOCK_MONOTONIC;
+  txtime.flags = 0;
+  if(mode == MICROTCP_PACING_TXTIME &&
+     setsockopt(socket->sd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) == -1){
+    perror("SO_TXTIME");
+    socket->pacing = MICROTCP_PACING_TIMER;
+    return -1;
+  }
+
+  if(mode != MICROTCP_PACING_TIMER)
+    microtcp_timer_cancel(socket->timers, &socket->pace_timer);
+  socket->pacing = mode;
+  return 0;
+}
+
+int
+microtcp_set_offload (microtcp_sock_t *socket, int enable)
+{
+  return microtcp_io_set_offload(socket, enable);
+}
+
+int
+microtcp_pool_stats (microtcp_sock_t *socket, microtcp_pool_stats_t *stats)
+{
+  if(socket->listener == NULL)
+    return -1;
+  microtcp_pool_get_stats(socket->listener->pool, stats);
+  return 0;
+}
+
+/*
+ * Set or clear the arrival bits of len bytes starting at sequence number seq
+ */
+static void
+reasm_mark(microtcp_sock_t *socket, uint32_t seq, size_t len, int set)
+{
+  size_t pos, n;
+  uint64_t mask;
+
+  while(len > 0){
+    pos = seq & (MICROTCP_RECVBUF_LEN - 1);
+    n = 64 - (pos & 63);
+    if(n > len)
+      n = len;
+    mask = (n == 64 ? ~0ULL : (1ULL << n) - 1) << (pos & 63);
+    if(set)
+      socket->reasm_map[pos >> 6] |= mask;
+    else
+      socket->reasm_map[pos >> 6] &= ~mask;
+    seq += n;
+    len -= n;
+  }
+}
+
+/*
+ * Length of the run of bytes from sequence number seq on, up to limit,
+ * that arrived (set) or are missing (!set)
+ */
+static size_t
+reasm_span(microtcp_sock_t *socket, uint32_t seq, size_t limit, int set)
+{
+  size_t run = 0, pos;
+  uint64_t other;
+
+  while(run < limit){
+    pos = (seq + run) & (MICROTCP_RECVBUF_LEN - 1);
+    other = (set ? ~socket->reasm_map[pos >> 6] : socket->reasm_map[pos >> 6]) >> (pos & 63);
+    if(other == 0){
+      run += 64 - (pos & 63);
       continue;
     }
+    run += __builtin_ctzll(other);
+    break;
+  }
+  return run < limit ? run : limit;
+}
+
+/*
+ * The block of out-of-order data to SACK: the one holding the most
+ * recent arrival, or else the first one past the gap
+ */
+static int
+sack_block(microtcp_sock_t *socket, uint32_t *left, uint32_t *right)
+{
+  uint32_t seq = socket->ack_number, high = socket->rcv_high;
+  size_t run;
+  int found = FALSE, latest;
+
+  while(SEQ_LT(seq, high)){
+    seq += reasm_span(socket, seq, high - seq, FALSE);
+    if(!SEQ_LT(seq, high))
+      break;
+    run = reasm_span(socket, seq, high - seq, TRUE);
+    latest = SEQ_GEQ(socket->sack_seq, seq) && SEQ_LT(socket->sack_seq, seq + run);
+    if(!found || latest){
+      *left = seq;
+      *right = seq + run;
+      found = TRUE;
+    }
+    if(latest)
+      break;
+    seq += run;
+  }
+  return found;
+}
 
-    memset(&server, 0, sizeof(microtcp_header_t));
+/*
+ * Queue an ACK for the peer
+ */
+static void
+send_ack(microtcp_sock_t *socket, uint32_t ack_number)
+{
+  microtcp_header_t *header = microtcp_io_tx_header(socket);
+  uint32_t left, right;
+
+  memset(header, 0, sizeof(microtcp_header_t));
+  header->control = htons(ACK);
+  header->ack_number = htonl(ack_number);
+  header->data_len = header_len(socket, 0);
+  header->window = htons(advertised_window(socket));
+  if(socket->ts_ok)
+    header->future_use2 = htonl(socket->ts_recent);
+
+  // Report what arrived past the gap
+  if(socket->sack_ok && ack_number == socket->ack_number && sack_block(socket, &left, &right)){
+    header->future_use0 = htonl(left);
+    header->future_use1 = htonl(right);
+  }
+  microtcp_io_tx_commit(socket, NULL, 0);
 
-    if(DEBUG) printf("Expected: %d Received: %d\n", socket->ack_number, ntohl(((microtcp_header_t*)buf)->seq_number));
+  // Whatever was held back is covered now
+  socket->delack_segs = 0;
+  microtcp_timer_cancel(socket->timers, &socket->delack_timer);
+  socket->last_adv_win = recv_window(socket);
+}
 
-    /* ----------- SHUTDOWN CHECK ------------- */
+/*
+ * ACK in-order data, every ack_every segments or when the delayed ACK
+ * timer expires
+ */
+static void
+schedule_ack(microtcp_sock_t *socket)
+{
+  if(++socket->delack_segs >= socket->ack_every){
+    send_ack(socket, socket->ack_number);
+    return;
+  }
+  if(!microtcp_timer_pending(&socket->delack_timer))
+    microtcp_timer_arm(socket->timers, &socket->delack_timer, microtcp_now_us() + socket->ack_delay_us);
+}
 
-    // If client requested shutdown
-    if(ntohs(((microtcp_header_t*)buf)->control) == FINACK){
-      if(DEBUG) printf("Was finack %d %d\n", ntohs(((microtcp_header_t*)buf)->control), FINACK);
-      // Acknowledge the FIN with an ACk
-      server.ack_number = htonl(ntohl(((microtcp_header_t*)buf)->seq_number) + 1);
-      server.control = htons(ACK);
-      sendto(socket->sd,
-        (const void *)&server,
-        sizeof(microtcp_header_t),
-        0,
-        (struct sockaddr *)&address,
-        address_len
-      );
-      socket->state = CLOSING_BY_PEER;
+/*
+ * The delayed ACK timer expired, ACK what is held back
+ */
+static void
+delack_fire(microtcp_timer_t *timer)
+{
+  microtcp_sock_t *socket = microtcp_container_of(timer, microtcp_sock_t, delack_timer);
 
-      // Shutdown from server
-      if(microtcp_shutdown(socket,0) == 0){
-        socket->state = CLOSED;
-        if(DEBUG) printf("Server closed connection\n");
+  send_ack(socket, socket->ack_number);
+  microtcp_loop_touch(socket);
+}
 
-        // Empty receive buffer
-        memcpy(buffer, recvbuf, socket->buf_fill_level);
-        socket->buf_fill_level = 0;
-        socket->curr_win_size = socket->init_win_size;
+/*
+ * Tell the sender at once when the window opens up again. Small
+ * increases wait for the next ACK, so that the sender isn't lured into
+ * sending tiny segments.
+ */
+static void
+window_update(microtcp_sock_t *socket)
+{
+  size_t window = recv_window(socket);
 
-        return received_total;
-      }
+  if((socket->last_adv_win < MICROTCP_MSS && window >= MICROTCP_MSS) ||
+     window >= socket->last_adv_win + MICROTCP_RECVBUF_LEN / 4)
+    send_ack(socket, socket->ack_number);
+}
+
+int
+microtcp_set_ack_rate (microtcp_sock_t *socket, int segments, uint32_t delay_us)
+{
+  if(segments < 1)
+    return -1;
+  socket->ack_every = segments;
+  socket->ack_delay_us = delay_us;
+  return 0;
+}
+
+/*
+ * Continue the CRC over the payload of a segment that is yet to be
+ * checked, copying the part that fits the window into the receive ring
+ * on the way. That is only done if none of those bytes arrived before,
+ * so that a corrupt segment overwrites nothing.
+ */
+static uint32_t
+recv_store(microtcp_sock_t *socket, uint32_t seq, const uint8_t *payload, size_t len,
+           uint32_t crc, int *stored)
+{
+  uint32_t end = socket->rcv_read + MICROTCP_RECVBUF_LEN;
+  size_t skip = 0, fit, pos, first;
+
+  *stored = FALSE;
+  if(SEQ_LT(seq, socket->ack_number))
+    skip = (uint32_t)(socket->ack_number - seq);
+  if(skip >= len || SEQ_GEQ(seq + skip, end))
+    return update_crc32(crc, payload, len);
+  fit = SEQ_GT(seq + len, end) ? end - (seq + skip) : len - skip;
+  if(reasm_span(socket, seq + skip, fit, FALSE) != fit)
+    return update_crc32(crc, payload, len);
+
+  crc = update_crc32(crc, payload, skip);
+  pos = (seq + skip) & (MICROTCP_RECVBUF_LEN - 1);
+  first = MICROTCP_RECVBUF_LEN - pos < fit ? MICROTCP_RECVBUF_LEN - pos : fit;
+  crc = update_crc32_copy(crc, socket->recvbuf + pos, payload + skip, first);
+  crc = update_crc32_copy(crc, socket->recvbuf, payload + skip + first, fit - first);
+  *stored = TRUE;
+  return update_crc32(crc, payload + skip + fit, len - skip - fit);
+}
+
+/*
+ * Process a data segment, or the FIN, of the peer
+ */
+static void
+recv_segment(microtcp_sock_t *socket, uint8_t *buf, ssize_t received)
+{
+  microtcp_header_t *header = (microtcp_header_t *)buf;
+  uint32_t checksum, crc, seq_number, end;
+  size_t data_len, n, pos, first, run;
+  int stored;
+
+  if(DEBUG) printf("Expected: %u Received: %u\n", socket->ack_number, ntohl(header->seq_number));
+
+  /* ----------- SHUTDOWN CHECK ------------- */
+
+  // If client requested shutdown
+  if(ntohs(header->control) == FINACK){
+    if(DEBUG) printf("Was finack %d %d\n", ntohs(header->control), FINACK);
+    // Acknowledge the FIN with an ACk
+    send_ack(socket, ntohl(header->seq_number) + 1);
+    microtcp_io_flush(socket);
+    socket->state = CLOSING_BY_PEER;
+
+    // Shutdown from server, closed even if the client stopped answering
+    microtcp_shutdown(socket, 0);
+    if(DEBUG) printf("Server closed connection\n");
+    return;
+  }
+
+  /* ----------- CHECKS ------------- */
+  if(DEBUG) printf("Received :%zd\n", received);
+
+  checksum = ntohl(header->checksum);
+  header->checksum = 0;
+  crc = update_crc32(0xffffffff, buf, sizeof(microtcp_header_t));
+  crc = recv_store(socket, ntohl(header->seq_number), buf + sizeof(microtcp_header_t),
+                   received - sizeof(microtcp_header_t), crc, &stored);
+  if(checksum != (crc ^ 0xffffffff)){
+
+    // Send duplicate ACK
+    send_ack(socket, socket->ack_number);
+
+    socket->packets_lost++;
+    socket->bytes_lost += received;
+    return;
+  }
+
+  seq_number = ntohl(header->seq_number);
+  data_len = received - sizeof(microtcp_header_t);
+  buf += sizeof(microtcp_header_t);
+
+  // Window probe, answer with the current window
+  if(data_len == 0){
+    send_ack(socket, socket->ack_number);
+    return;
+  }
+
+  // Drop the part we already have
+  if(SEQ_LT(seq_number, socket->ack_number)){
+    n = (uint32_t)(socket->ack_number - seq_number);
+    if(n >= data_len){
+      send_ack(socket, socket->ack_number);
+      return;
     }
+    seq_number += n;
+    buf += n;
+    data_len -= n;
+  }
+
+  // And the part that doesn't fit in the window
+  end = socket->rcv_read + MICROTCP_RECVBUF_LEN;
+  if(SEQ_GEQ(seq_number, end)){
+    send_ack(socket, socket->ack_number);
+    return;
+  }
+  if(SEQ_GT(seq_number + data_len, end))
+    data_len = end - seq_number;
+
+  socket->bytes_received += received;
+  socket->packets_received++;
+
+  // Store it where its sequence number says, if the check didn't already
+  if(!stored){
+    pos = seq_number & (MICROTCP_RECVBUF_LEN - 1);
+    first = MICROTCP_RECVBUF_LEN - pos < data_len ? MICROTCP_RECVBUF_LEN - pos : data_len;
+    memcpy(socket->recvbuf + pos, buf, first);
+    memcpy(socket->recvbuf, buf + first, data_len - first);
+  }
+
+  /* ----------- OUT OF ORDER PACKET ------------- */
+  if(seq_number != socket->ack_number){
+    // Keep it for when the gap fills, and tell the sender what is missing
+    reasm_mark(socket, seq_number, data_len, TRUE);
+    socket->sack_seq = seq_number;
+    if(SEQ_GT(seq_number + data_len, socket->rcv_high))
+      socket->rcv_high = seq_number + data_len;
+    send_ack(socket, socket->ack_number);
+    return;
+  }
+
+  /* ----------- CORRECT PACKET ------------- */
+
+  // Echo the oldest segment the next ACK covers, so that its delay counts
+  if(socket->ts_ok && socket->delack_segs == 0)
+    socket->ts_recent = ntohl(header->future_use2);
+
+  reasm_mark(socket, seq_number, data_len, FALSE);
+  socket->ack_number += data_len;
+
+  // The gap may have been filled, take what was waiting behind it
+  run = reasm_span(socket, socket->ack_number, end - socket->ack_number, TRUE);
+  if(run > 0){
+    reasm_mark(socket, socket->ack_number, run, FALSE);
+    socket->ack_number += run;
+  }
+
+  // The marks of the out-of-order data move along, or else 2^31 bytes
+  // later they would compare as ahead of ack_number again
+  if(SEQ_GT(socket->ack_number, socket->rcv_high)){
+    socket->rcv_high = socket->ack_number;
+    socket->sack_seq = socket->ack_number;
+  }
+  socket->buf_fill_level = (uint32_t)(socket->ack_number - socket->rcv_read);
+
+  // One cumulative ACK, at once if a gap was filled, else possibly delayed
+  if(run > 0)
+    send_ack(socket, socket->ack_number);
+  else
+    schedule_ack(socket);
+}
+
+ssize_t
+microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+{
+  ssize_t received = -1;
+  size_t n, pos, first;
+  uint64_t now, next;
+  uint8_t *buf;
+
+  if(microtcp_thread_redirect(socket))
+    return microtcp_thread_recv(socket, buffer, length);
 
-    /* ----------- CHECKS ------------- */
-    if(DEBUG) printf("Received :%d\n", received);
+  // Wait until there is in-order data to read
+  while(socket->ack_number == socket->rcv_read){
+
+    // If connection is shutdown, exit with -1
+    if(socket->state == CLOSED){
+      release_buffers(socket);
+      errno = ENOTCONN;
+      return -1;
+    }
 
-    checksum = ntohl(((microtcp_header_t*)buf)->checksum);
-    ((microtcp_header_t*)buf)->checksum = 0;
-    if(checksum != crc32(buf, received) || ntohl(((microtcp_header_t*)buf)->seq_number) != socket->ack_number){
-      
-      // Send duplicate ACK
-      memset(&server, 0, sizeof(microtcp_header_t));
-      server.ack_number = htonl(socket->ack_number);
+    // Take what arrived, but don't wait for more
+    if(socket->nonblocking){
+      microtcp_service(socket);
+      if(socket->ack_number == socket->rcv_read && socket->state != CLOSED){
+        errno = EAGAIN;
+        return -1;
+      }
+      continue;
+    }
 
-      sendto(socket->sd, &server, sizeof(microtcp_header_t), 0, (struct sockaddr *)&address, address_len);
-      socket->packets_send++;
-      socket->bytes_send += sizeof(microtcp_header_t);
+    // Don't wait for more data past the delayed ACK timer
+    while(microtcp_timer_pending(&socket->delack_timer) && !microtcp_io_rx_pending(socket)){
+      now = microtcp_now_us();
+      next = microtcp_timer_next(socket->timers);
+      if(next > now && microtcp_io_wait(socket, next - now) > 0)
+        break;
+      microtcp_timer_run(socket->timers, microtcp_now_us());
+    }
 
-      socket->packets_lost++;
-      socket->bytes_lost += received;
+    // Receive, a whole batch at a time
+    buf = microtcp_io_rx_next(socket, MSG_WAITFORONE, &received);
+    if(buf == NULL || received < (ssize_t)sizeof(microtcp_header_t))
       continue;
+    recv_segment(socket, buf, received);
+
+    // And the rest of the batch
+    while(socket->state != CLOSED && microtcp_io_rx_pending(socket)){
+      buf = microtcp_io_rx_next(socket, MSG_DONTWAIT, &received);
+      if(received >= (ssize_t)sizeof(microtcp_header_t))
+        recv_segment(socket, buf, received);
     }
+  }
+
+  // Hand out as much as fits
+  n = (uint32_t)(socket->ack_number - socket->rcv_read);
+  if(n > length)
+    n = length;
+  pos = socket->rcv_read & (MICROTCP_RECVBUF_LEN - 1);
+  first = MICROTCP_RECVBUF_LEN - pos < n ? MICROTCP_RECVBUF_LEN - pos : n;
+  memcpy(buffer, socket->recvbuf + pos, first);
+  memcpy((uint8_t *)buffer + first, socket->recvbuf, n - first);
+  socket->rcv_read += n;
+  socket->buf_fill_level -= n;
+
+  // The window slides forward
+  if(socket->state != CLOSED){
+    window_update(socket);
+    microtcp_io_flush(socket);
+  }
+  microtcp_loop_touch(socket);
 
-    // ACK -<<>>LP>LPPL{ASCSCACS}
-    //if(ntohl(((microtcp_header_t*)buf)->seq_number) == socket->ack_number) socket->ack_number = socket->ack_number + received - sizeof(microtcp_header_t);
+  return n;
+}
 
-    /* ----------- CORRECT PACKET ------------- */
-    socket->ack_number = socket->ack_number + received - sizeof(microtcp_header_t); // <--
-    socket->bytes_received += received;
-    socket->packets_received++;
+/*
+ * Hand a datagram to the sender if it is an ACK, else to the receiver
+ */
+static void
+socket_input(microtcp_sock_t *socket, uint8_t *buf, ssize_t len)
+{
+  microtcp_header_t *header = (microtcp_header_t *)buf;
 
-    // Decrease win size
-    socket->curr_win_size = socket->curr_win_size - received - sizeof(microtcp_header_t);
-    if((int)(socket->curr_win_size) - (int)ntohl(((microtcp_header_t*)buf)->data_len) < 0)
-      socket->curr_win_size = 0;
-    //printf("Curr win size: %zu\n", socket->curr_win_size);
+  if(len < (ssize_t)sizeof(microtcp_header_t))
+    return;
+  if(ntohs(header->control) == ACK){
+    if(socket->sendbuf != NULL)
+      sender_input(socket, header);
+  }
+  else if(socket->state != CLOSED){
+    recv_segment(socket, buf, len);
+  }
+}
 
-    // memcpy(buffer + received_total, buf + sizeof(microtcp_header_t), received - sizeof(microtcp_header_t));
-    received_total += received - sizeof(microtcp_header_t);
-    remaining_bytes -= received - sizeof(microtcp_header_t);
-    //printf("Remaining: %d Received: %d\n", remaining_bytes, received);
-    //printf("%s\n", buffer);
+void
+microtcp_service (microtcp_sock_t *socket)
+{
+  uint8_t *buf;
+  ssize_t len;
+
+  // A listener only answers the SYNs, its port is read for the connections
+  if(socket->listener != NULL && socket->conn == NULL){
+    if(socket->state == LISTEN)
+      handshake_run(socket);
+    return;
+  }
+  if(socket->state == CLOSED)
+    return;
+
+  while(socket->state != CLOSED &&
+        (buf = microtcp_io_rx_next(socket, MSG_DONTWAIT, &len)) != NULL)
+    socket_input(socket, buf, len);
+  if(socket->state == CLOSED)
+    return;
+
+  // The timers that are due, then what the window lets out
+  if(socket->sendbuf != NULL){
+    sender_poll(socket, FALSE);
+    sender_output(socket);
+  }
+  else{
+    microtcp_timer_run(socket->timers, microtcp_now_us());
+  }
+  microtcp_io_flush(socket);
+}
 
-    // Check if recvbuf needs emptying
-    if(socket->buf_fill_level > 0.85 * MICROTCP_RECVBUF_LEN){
-      
-      // Empty receive buffer
-      memcpy(buffer + buffer_index, recvbuf, socket->buf_fill_level);
-      buffer_index += socket->buf_fill_level;
-      socket->buf_fill_level = 0;
-      socket->curr_win_size = socket->init_win_size;
+void
+microtcp_move_timers (microtcp_sock_t *socket, struct microtcp_timer_wheel *wheel)
+{
+  microtcp_timer_t *timers[] = { &socket->pace_timer, &socket->rtx_timer,
+                                 &socket->persist_timer, &socket->delack_timer };
+  struct microtcp_handshake *h;
+  size_t i;
+
+  for(i = 0; i < sizeof(timers) / sizeof(timers[0]); i++){
+    if(microtcp_timer_pending(timers[i])){
+      microtcp_timer_cancel(socket->timers, timers[i]);
+      microtcp_timer_arm(wheel, timers[i], timers[i]->expires * MICROTCP_TIMER_TICK_US);
     }
+  }
+  socket->timers = wheel;
 
-    // Sliding window
-    memcpy(recvbuf + buffer_index + socket->buf_fill_level, buf + sizeof(microtcp_header_t), received - sizeof(microtcp_header_t));
-    socket->buf_fill_level += received - sizeof(microtcp_header_t);
+  // The SYN ACKs of a listener go with it
+  for(h = socket->handshakes; h != NULL; h = h->next)
+    microtcp_move_timers(&h->sock, wheel);
+}
 
-    // Ready header
-    server.control = htons(ACK);
-    server.ack_number = htonl(socket->ack_number);
-    server.window = htons(socket->curr_win_size);
+int
+microtcp_ready (microtcp_sock_t *socket)
+{
+  struct microtcp_handshake *h;
+  int events = 0;
 
-    sendto(socket->sd, &server, sizeof(microtcp_header_t), 0, (struct sockaddr *)&address, address_len);
-    socket->packets_send++;
-    socket->bytes_send += sizeof(microtcp_header_t);
-    if(DEBUG) printf("%d\n", buffer_index);
+  if(socket->listener != NULL && socket->conn == NULL){
+    for(h = socket->handshakes; h != NULL; h = h->next){
+      if(h->sock.state == ESTABLISHED)
+        return MICROTCP_POLLIN;
+    }
+    return microtcp_demux_backlog(socket->listener) > 0 ? MICROTCP_POLLIN : 0;
   }
 
-  // Empty receive buffer
-  memcpy(buffer + buffer_index, recvbuf, socket->buf_fill_level);
-  buffer_index += socket->buf_fill_level;
-  socket->buf_fill_level = 0;
-  socket->curr_win_size = socket->init_win_size;
+  if(socket->state == CLOSED || socket->state == CLOSING_BY_PEER ||
+     (socket->recvbuf != NULL && socket->ack_number != socket->rcv_read))
+    events |= MICROTCP_POLLIN;
+  if(socket->state == ESTABLISHED &&
+     (socket->sendbuf == NULL || socket->sendbuf_fill < MICROTCP_SENDBUF_LEN))
+    events |= MICROTCP_POLLOUT;
+  return events;
+}
 
-  free(buf);
-  return received_total;
-}
\ No newline at end of file
+int
+microtcp_set_nonblocking (microtcp_sock_t *socket, int enable)
+{
+  if(microtcp_thread_redirect(socket))
+    socket->thread->nonblocking = enable;
+  else
+    socket->nonblocking = enable;
+  return 0;
+}
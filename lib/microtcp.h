@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include "microtcp_timer.h"
 
 /*
  * Bitwise
@@ -51,10 +52,77 @@
  */
 #define MICROTCP_ACK_TIMEOUT_US 200000
 #define MICROTCP_MSS 1400
-#define MICROTCP_RECVBUF_LEN 8192
+#define MICROTCP_RECVBUF_LEN (1 << 18) /* Must be a power of 2 */
+#define MICROTCP_WSCALE 3 /* Fits MICROTCP_RECVBUF_LEN in the 16-bit window */
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
+#define MICROTCP_SOCKBUF_LEN (4 * MICROTCP_RECVBUF_LEN) /* Kernel buffer that holds a whole window of datagrams */
 #define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
 #define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+#define MICROTCP_SENDBUF_LEN (1 << 18) /* Must be a power of 2 */
+#define MICROTCP_SCOREBOARD_LEN 1024
+#define MICROTCP_BLOCK_CRC_LEN (MICROTCP_SENDBUF_LEN / MICROTCP_MSS + 2) /* Blocks the send buffer spans */
+#define MICROTCP_DUP_ACK_THRESH 3
+#define MICROTCP_DELACK_SEGMENTS 2
+#define MICROTCP_DELACK_TIMEOUT_US 10000
+#define MICROTCP_PERSIST_MAX_US 1000000
+#define MICROTCP_RTO_INIT_US MICROTCP_ACK_TIMEOUT_US /* Until the first RTT sample */
+#define MICROTCP_RTO_MIN_US (2 * MICROTCP_DELACK_TIMEOUT_US) /* Outlasts a delayed ACK */
+#define MICROTCP_RTO_MAX_US 60000000
+#define MICROTCP_SYN_RETRIES 6
+#define MICROTCP_FIN_RETRIES 6
+#define MICROTCP_PACING_SLACK_US 1000 /* Paced segments may leave that much early, in a burst */
+#define MICROTCP_PACING_BURST_MAX (64 * 1024)
+#define MICROTCP_SENDFILE_AHEAD (1 << 22) /* File data microtcp_sendfile() queues, and pages in, past the acknowledged data */
+#define MICROTCP_SENDFILE_BLOCK (1 << 20) /* Reads of microtcp_sendfile() when the file can't be mapped */
+
+/*
+ * Handshake options, carried in future_use0 of SYN and SYN ACK
+ */
+#define MICROTCP_OPT_WSCALE (1 << 8) /* Low 8 bits hold the shift */
+#define MICROTCP_OPT_SACK (1 << 9) /* ACKs may carry a SACK block in future_use0/1 */
+#define MICROTCP_OPT_TS (1 << 10) /* future_use2 holds the timestamp of data, its echo in ACKs */
+
+/*
+ * Connection IDs, carried in the upper half of data_len that a payload
+ * never reaches. They tell apart connections a listener has with the
+ * same peer address and port.
+ */
+#define MICROTCP_CID_SHIFT 16
+#define MICROTCP_DEMUX_QUEUE_LEN 128 /* Datagrams a listener holds for each of its connections */
+#define MICROTCP_DEMUX_BUCKETS 64 /* Initial size of the connection table, a power of 2 */
+#define MICROTCP_POOL_PKTS 16384 /* Datagrams a listener holds for all its connections at once */
+#define MICROTCP_POOL_HUGE_PAGES 1 /* Back the pool of a listener by huge pages where there are any */
+
+/*
+ * Events of a socket in an event loop
+ */
+#define MICROTCP_POLLIN 1 /* Data to read, the peer closed, or on a listener a connection to accept */
+#define MICROTCP_POLLOUT 2 /* Room in the send buffer */
+
+#define MICROTCP_ENGINE_POLL_MS 50 /* How soon a shard notices it has to stop */
+
+/*
+ * Buffers between the application and the protocol thread of a socket,
+ * in each direction
+ */
+#define MICROTCP_THREAD_BUFS 64
+#define MICROTCP_THREAD_BUF_LEN 16384
+
+/*
+ * Flags of a scoreboard entry
+ */
+#define MICROTCP_SEG_SACKED 1 /* The peer reported it received */
+#define MICROTCP_SEG_RESENT 2 /* Retransmitted during the current recovery */
+#define MICROTCP_SEG_APP_LIMITED 4 /* Sent while the application had nothing more */
+#define MICROTCP_SEG_TRIMMED 8 /* Cut by a partial ACK, its CRC covers the packet it was */
+
+/*
+ * Sequence number comparisons, modulo 2^32
+ */
+#define SEQ_LT(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define SEQ_GT(a, b) SEQ_LT(b, a)
+#define SEQ_GEQ(a, b) SEQ_LEQ(b, a)
 
 /**
  * Possible states of the microTCP socket
@@ -65,6 +133,7 @@
 typedef enum
 {
   LISTEN,
+  SYN_RCVD,
   ESTABLISHED,
   CLOSING_BY_PEER,
   CLOSING_BY_HOST,
@@ -72,6 +141,71 @@ typedef enum
   INVALID
 } mircotcp_state_t;
 
+/**
+ * How the sender spreads its segments at the pacing rate
+ */
+typedef enum
+{
+  MICROTCP_PACING_OFF,          /**< Whole windows leave back to back */
+  MICROTCP_PACING_TIMER,        /**< A timer wheel holds segments until they are due */
+  MICROTCP_PACING_TXTIME        /**< The kernel holds them, with SO_TXTIME and the fq qdisc */
+} microtcp_pacing_t;
+
+/**
+ * How datagrams cross the kernel
+ */
+typedef enum
+{
+  MICROTCP_IO_MMSG,             /**< Batches of sendmmsg() and recvmmsg() */
+  MICROTCP_IO_URING,            /**< io_uring, with a multishot receive into a ring of buffers */
+  MICROTCP_IO_URING_SQPOLL      /**< io_uring with a kernel thread that polls for the sends */
+} microtcp_io_backend_t;
+
+struct microtcp_tx_batch;
+struct microtcp_rx_batch;
+struct microtcp_cc_ops;
+struct microtcp_listener;
+struct microtcp_conn;
+struct microtcp_handshake;
+struct microtcp_loop_entry;
+struct microtcp_thread;
+struct microtcp_uring;
+struct microtcp_pool;
+
+/**
+ * Entry of the sender scoreboard. Every in-flight segment is tracked by
+ * its sequence range, so that only the missing ones are retransmitted.
+ * Together with its payload, which stays in the send buffer until the
+ * peer acknowledges it, an entry holds the packet as it was built: a
+ * retransmission sends the same bytes and only patches the CRC for the
+ * fields that changed.
+ */
+typedef struct
+{
+  uint32_t seq_number;        /**< Sequence number of the first payload byte */
+  uint32_t data_len;            /**< Payload length in bytes */
+  uint32_t crc;                 /**< CRC-32 of the packet as last sent, before the final xor */
+  uint32_t ts;                  /**< Timestamp it was last sent with */
+  uint32_t retransmits;         /**< Times this segment was sent again */
+  uint32_t flags;               /**< MICROTCP_SEG_* */
+  uint64_t sent_us;             /**< When it was last sent */
+  uint64_t delivered;           /**< Bytes delivered when it was last sent */
+  uint64_t delivered_us;        /**< When delivery last grew, at the time it was sent */
+  uint64_t first_sent_us;       /**< Start of the sending interval it belongs to */
+} microtcp_segment_t;
+
+/**
+ * CRC-32 of a block of the send buffer, taken while the data was copied
+ * in. Blocks are MICROTCP_MSS long, like the segments that will carry
+ * them, so that a segment only has to combine it with its header.
+ */
+typedef struct
+{
+  uint32_t seq_number;        /**< Sequence number of the first byte */
+  uint32_t len;                 /**< Bytes copied in so far */
+  uint32_t crc;                 /**< CRC-32 of those bytes, fed with 0 */
+} microtcp_block_crc_t;
+
 
 /**
  * This is the microTCP socket structure. It holds all the necessary
@@ -82,22 +216,97 @@ typedef enum
 typedef struct
 {
   int sd;                       /**< The underline UDP socket descriptor */
+  int connected;                /**< Whether sd is connected to the peer */
   int type;                     /**< Wether the socket is for a client or a server */
   mircotcp_state_t state;       /**< The state of the microTCP socket */
   size_t init_win_size;         /**< The window size negotiated at the 3-way handshake */
-  size_t curr_win_size;         /**< The current window size */
+  size_t curr_win_size;         /**< The current window size of the peer */
+  int snd_wscale;               /**< Shift of the windows the peer advertises */
+  int rcv_wscale;               /**< Shift of the windows we advertise */
+  int sack_ok;                  /**< Both ends agreed to exchange SACK blocks */
+  int ts_ok;                    /**< Both ends agreed to exchange timestamps */
+  uint32_t ts_recent;           /**< Timestamp of the peer to echo in our next ACK */
+  int rx_timestamps;            /**< The kernel stamps received datagrams */
+  int gso;                      /**< The kernel segments our batches (UDP GSO) */
+  int gro;                      /**< The kernel coalesces what we receive (UDP GRO) */
+  uint16_t cid;                 /**< Connection ID our headers carry */
+  struct microtcp_listener *listener; /**< Owner of the port, for a listening socket and its connections */
+  struct microtcp_conn *conn;   /**< Where the listener queues our datagrams, NULL unless accepted from one */
+  struct microtcp_handshake *handshakes; /**< Of a listening socket, the connections whose SYN it answered */
+  int nonblocking;              /**< Calls return EAGAIN instead of waiting */
+  struct microtcp_loop_entry *loop_entry; /**< The event loop that drives the socket, NULL if none */
+  struct microtcp_thread *thread; /**< The protocol thread of the socket, NULL if the protocol runs in the calls */
 
   uint8_t *recvbuf;             /**< The *receive* buffer of the TCP
                                      connection. It is allocated during the connection establishment and
                                      is freed at the shutdown of the connection. This buffer is used
-                                     to retrieve the data from the network. */
-  size_t buf_fill_level;        /**< Amount of data in the buffer */
+                                     to retrieve the data from the network. It is a ring indexed by
+                                     sequence number: data from rcv_read to ack_number waits for the
+                                     application, data past ack_number arrived out of order. */
+  size_t buf_fill_level;        /**< Amount of in-order data in the buffer */
+  uint32_t rcv_read;            /**< Next sequence number the application reads */
+  uint64_t *reasm_map;          /**< One bit per byte of recvbuf past ack_number, set if the byte arrived */
+  uint32_t sack_seq;            /**< Start of the most recent out-of-order segment */
+  uint32_t rcv_high;            /**< End of the highest out-of-order segment */
+
+  int ack_every;                /**< ACK every that many in-order segments */
+  uint32_t ack_delay_us;        /**< Longest time an ACK is held back */
+  int delack_segs;              /**< Segments received since the last ACK */
+  microtcp_timer_t delack_timer; /**< Delayed ACK timer */
+  size_t last_adv_win;          /**< Window advertised with the last ACK */
 
   size_t cwnd;
   size_t ssthresh;
+  const struct microtcp_cc_ops *cc; /**< The congestion control algorithm */
+  uint64_t cc_priv[24];         /**< State of the congestion control algorithm */
+  uint64_t delivered;           /**< Bytes the peer acknowledged so far, SACKs included */
+  uint64_t delivered_us;        /**< When delivered last grew */
+  uint64_t first_sent_us;       /**< Send time of the newest segment delivered */
+  uint64_t app_limited;         /**< Rate samples are app-limited until delivered passes this, 0 if not */
+  microtcp_pacing_t pacing;     /**< How segments are paced */
+  uint64_t pacing_rate;         /**< Current pacing rate in bytes per second, 0 if unpaced */
+  uint32_t pacing_burst;        /**< Bytes that may leave back to back */
+  uint64_t pace_next_us;        /**< Earliest departure of the next paced segment */
+  struct microtcp_timer_wheel *timers; /**< Timers of the connection, those of its event loop while in one */
+  microtcp_timer_t pace_timer;  /**< Releases the segments the pacer held back */
+
+  uint8_t *sendbuf;             /**< The *send* ring buffer of the TCP connection.
+                                     Data passed to microtcp_send() is kept here, indexed
+                                     by sequence number, until the peer acknowledges it.
+                                     It is allocated at the first send and is freed at the
+                                     shutdown of the connection. */
+  size_t sendbuf_fill;          /**< Bytes in the send buffer, starting at snd_una */
+  microtcp_block_crc_t *block_crc; /**< Ring of the CRCs of the send buffer blocks */
+  uint32_t block_base;          /**< Sequence number the blocks are aligned to */
+  uint32_t block_crc_op;        /**< crc32_combine_gen() of a full block */
+  uint32_t ts_patch_op;         /**< crc32_combine_gen() of what follows the timestamp in a full segment */
+  const uint8_t *sendfile_map;  /**< The file microtcp_sendfile() is sending, which then holds all data past snd_una, NULL if none */
+  uint32_t sendfile_seq;        /**< Sequence number of the first byte of sendfile_map */
 
-  size_t seq_number;            /**< Keep the state of the sequence number */
-  size_t ack_number;            /**< Keep the state of the ack number */
+  struct microtcp_tx_batch *tx; /**< Packets waiting for the next sendmmsg() */
+  struct microtcp_rx_batch *rx; /**< Datagrams of the last recvmmsg() */
+  microtcp_io_backend_t io_backend; /**< How the datagrams go, after any fallback */
+  struct microtcp_uring *uring; /**< The rings of the io_uring backend, NULL with the other */
+
+  microtcp_segment_t *scoreboard; /**< Ring of the in-flight segments, oldest first */
+  size_t sb_head;               /**< Index of the oldest in-flight segment */
+  size_t sb_count;              /**< Number of in-flight segments */
+
+  uint32_t snd_una;             /**< Oldest unacknowledged sequence number */
+  uint32_t recover;             /**< Highest sequence sent when fast recovery started */
+  int dup_acks;                 /**< Consecutive duplicate ACKs */
+  int in_recovery;              /**< Whether the sender is in fast recovery */
+  microtcp_timer_t rtx_timer;   /**< Retransmission timer */
+  uint32_t srtt_us;             /**< Smoothed round trip time, 0 before the first sample */
+  uint32_t rttvar_us;           /**< Round trip time variation */
+  uint32_t rto_us;              /**< Retransmission timeout, backed off on expiry */
+  uint32_t rtt_seq;             /**< The ACK of this sequence number ends the RTT measurement */
+  uint64_t rtt_start;           /**< When the timed segment was sent, 0 if none is timed */
+  microtcp_timer_t persist_timer; /**< Zero window probe timer */
+  uint32_t persist_backoff;     /**< Interval between zero window probes in us */
+
+  uint32_t seq_number;          /**< Keep the state of the sequence number */
+  uint32_t ack_number;          /**< Keep the state of the ack number */
   struct sockaddr_in address;      /**< Socket binded address */
   socklen_t address_len;        /**< Socket binded address length */
   uint64_t packets_send;
@@ -106,6 +315,10 @@ typedef struct
   uint64_t bytes_send;
   uint64_t bytes_received;
   uint64_t bytes_lost;
+  uint64_t packets_retransmitted;
+  uint64_t bytes_retransmitted;
+  uint64_t syscalls;            /**< Datagram I/O system calls of the data path */
+  uint32_t rtt_us;              /**< Latest round trip time sample */
 } microtcp_sock_t;
 
 
@@ -115,8 +328,8 @@ typedef struct
  */
 typedef struct
 {
-  uint32_t seq_number;          /**< Sequence number */
-  uint32_t ack_number;          /**< ACK number */
+  uint32_t seq_number;        /**< Sequence number */
+  uint32_t ack_number;        /**< ACK number */
   uint16_t control;             /**< Control bits (e.g. SYN, ACK, FIN) */
   uint16_t window;              /**< Window size in bytes */
   uint32_t data_len;            /**< Data length in bytes (EXCLUDING header) */
@@ -126,10 +339,74 @@ typedef struct
   uint32_t checksum;            /**< CRC-32 checksum, see crc32() in utils folder */
 } microtcp_header_t;
 
+/**
+ * Occupancy of the packet pool of a listener
+ */
+typedef struct
+{
+  uint64_t size;                /**< Buffers in the pool, the most it holds */
+  uint64_t buffer_len;          /**< Bytes of each buffer */
+  uint64_t in_use;              /**< Buffers holding datagrams now */
+  uint64_t peak;                /**< The most ever in use at once */
+  uint64_t exhausted;           /**< Datagrams dropped because none was free */
+  int huge_pages;               /**< Backed by huge pages */
+} microtcp_pool_stats_t;
+
+/**
+ * An event loop, that drives any number of non-blocking sockets from one
+ * thread
+ */
+typedef struct microtcp_loop microtcp_loop_t;
+
+/**
+ * Called by microtcp_poll() when a socket is ready.
+ *
+ * @param socket the socket structure
+ * @param events the MICROTCP_POLL* events it is ready for
+ * @param arg as given to microtcp_loop_add()
+ */
+typedef void (*microtcp_event_fn) (microtcp_sock_t *socket, int events, void *arg);
+
+/**
+ * A server of many threads, each one owning the connections the kernel
+ * steers to its socket on a shared port
+ */
+typedef struct microtcp_engine microtcp_engine_t;
+
+/**
+ * Called by every shard of an engine, in its own thread, once its
+ * listener is up. It typically allocates the state of the shard and adds
+ * the listener to the loop with a callback that accepts connections into
+ * the same loop.
+ *
+ * @param loop the event loop of the shard
+ * @param listener the listening socket of the shard
+ * @param shard the index of the shard, from 0
+ * @param arg as given to microtcp_engine_new()
+ * @return 0 on success, or -1 to fail microtcp_engine_new()
+ */
+typedef int (*microtcp_shard_fn) (microtcp_loop_t *loop, microtcp_sock_t *listener,
+                                  int shard, void *arg);
+
 
 microtcp_sock_t
 microtcp_socket (int domain, int type, int protocol);
 
+/**
+ * Like microtcp_socket(), with the datagram I/O of choice. Should the
+ * kernel lack what io_uring needs (multishot receives and buffer rings,
+ * Linux 6.0), the socket quietly uses sendmmsg() and recvmmsg(); should
+ * it refuse an SQPOLL thread, the sends are submitted by the caller.
+ * io_backend tells which one it got. The connections of a listener send
+ * on their own with sendmmsg(); the listener receives for them either
+ * way.
+ *
+ * @param backend one of microtcp_io_backend_t
+ */
+microtcp_sock_t
+microtcp_socket_io (int domain, int type, int protocol,
+                    microtcp_io_backend_t backend);
+
 int
 microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address,
                socklen_t address_len);
@@ -151,15 +428,293 @@ int
 microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len);
 
+/**
+ * Turns a bound socket into a listener, that serves any number of peers
+ * on its port. Incoming datagrams are handed to their connection by peer
+ * address, port and connection ID. Connections are taken with
+ * microtcp_accept_conn(); microtcp_shutdown() of the listener frees it,
+ * once they are all shut down.
+ *
+ * @param socket the bound socket structure
+ * @param backlog the most connections that wait to be accepted, SYNs
+ * past that are dropped
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_listen (microtcp_sock_t *socket, int backlog);
+
+/**
+ * Blocks waiting for a new connection on a listening socket. Other
+ * connections of the listener keep going meanwhile, and each one may be
+ * served by a thread of its own. The listener answers the SYN of a peer
+ * and hands out the connection once the peer acknowledged, a
+ * non-blocking one returns -1 with errno EAGAIN until then.
+ *
+ * @param socket the listening socket structure
+ * @param conn the socket structure of the new connection
+ * @param address pointer to store the address information of the connected peer
+ * @param address_len the length of the address structure.
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_accept_conn (microtcp_sock_t *socket, microtcp_sock_t *conn,
+                      struct sockaddr *address, socklen_t address_len);
+
 int
 microtcp_shutdown(microtcp_sock_t *socket, int how);
 
+/**
+ * Queues data for the peer, waiting for room in the send buffer as
+ * needed.
+ *
+ * @return the number of bytes queued. A non-blocking socket queues what
+ * fits and returns -1 with errno EAGAIN if nothing did.
+ */
 ssize_t
 microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
                int flags);
 
+/**
+ * Sends count bytes of the file fd, starting at offset, without copying
+ * them into the send buffer. The file is mapped and segments point
+ * straight into the page cache, which retransmissions are served from
+ * too. Whatever microtcp_send() queued before goes first. The file must
+ * not shrink meanwhile.
+ *
+ * Files that can't be mapped, non-blocking sockets and sockets with a
+ * protocol thread read the file in blocks of MICROTCP_SENDFILE_BLOCK
+ * instead, and queue them with microtcp_send().
+ *
+ * @return the number of bytes sent, which the peer acknowledged unless
+ * the file was read in blocks, or -1 on failure with errno set. A
+ * non-blocking socket may send less.
+ */
+ssize_t
+microtcp_sendfile (microtcp_sock_t *socket, int fd, off_t offset, size_t count);
+
+/**
+ * Waits for in-order data of the peer and hands out what fits.
+ *
+ * @return the number of bytes read, or -1 once the connection is closed.
+ * A non-blocking socket returns -1 with errno EAGAIN if no data arrived.
+ */
 ssize_t
 microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
 
+/**
+ * Makes microtcp_send(), microtcp_recv() and, on a listener,
+ * microtcp_accept_conn() return at once instead of waiting. The
+ * handshakes of microtcp_connect() and microtcp_shutdown() still wait
+ * for the peer, for a round trip if it answers.
+ *
+ * @param socket the socket structure
+ * @param enable TRUE to enable, FALSE to disable
+ * @return 0 on success
+ */
+int
+microtcp_set_nonblocking (microtcp_sock_t *socket, int enable);
+
+/**
+ * Creates an event loop. It waits on epoll for the datagrams of its
+ * sockets and on a timerfd for their earliest retransmission, delayed
+ * ACK, persist or pacing timer, so that ACKs and timers of every socket
+ * are handled in microtcp_poll().
+ *
+ * @return the loop or NULL on failure
+ */
+microtcp_loop_t *
+microtcp_loop_new (void);
+
+/**
+ * Frees an event loop. Its sockets are left as they are.
+ */
+void
+microtcp_loop_free (microtcp_loop_t *loop);
+
+/**
+ * Adds a socket to an event loop and makes it non-blocking. The socket
+ * must stay where it is until it is removed, which happens by itself
+ * when it is closed. A socket belongs to one loop at a time.
+ *
+ * @param events the MICROTCP_POLL* events to report
+ * @param fn called when the socket is ready for some of them
+ * @param arg passed to fn
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_loop_add (microtcp_loop_t *loop, microtcp_sock_t *socket, int events,
+                   microtcp_event_fn fn, void *arg);
+
+/**
+ * Changes the events reported for a socket of the loop.
+ *
+ * @return 0 on success or -1 if the socket is not in the loop
+ */
+int
+microtcp_loop_modify (microtcp_loop_t *loop, microtcp_sock_t *socket, int events);
+
+/**
+ * Removes a socket from its event loop. It may be called from a
+ * callback.
+ *
+ * @return 0 on success or -1 if the socket is not in the loop
+ */
+int
+microtcp_loop_del (microtcp_loop_t *loop, microtcp_sock_t *socket);
+
+/**
+ * Makes a microtcp_poll() in progress, or the next one, return without
+ * waiting. It may be called from any thread.
+ */
+void
+microtcp_loop_wake (microtcp_loop_t *loop);
+
+/**
+ * @return the event loop of the socket, or NULL if it is in none
+ */
+microtcp_loop_t *
+microtcp_loop_of (microtcp_sock_t *socket);
+
+/**
+ * Runs one round of an event loop: waits until a socket has datagrams or
+ * a timer is due, handles them, and calls back the sockets that are
+ * ready. Readiness is level triggered, so a socket left ready is called
+ * back again in the next round, which then doesn't wait.
+ *
+ * @param timeout_ms the longest wait in milliseconds, -1 for no limit
+ * @return the number of callbacks or -1 on failure
+ */
+int
+microtcp_poll (microtcp_loop_t *loop, int timeout_ms);
+
+/**
+ * Hands a connected socket over to a protocol thread of its own, that
+ * sends, receives, ACKs and retransmits while the application does
+ * something else. microtcp_send() and microtcp_recv() then only copy
+ * to and from buffers that pass between the two threads through
+ * lock-free single producer, single consumer rings, and make a system
+ * call only to wake a side up that waits on an empty ring.
+ * microtcp_shutdown(), or microtcp_recv() returning -1, stops the
+ * thread. The socket must not be in an event loop.
+ *
+ * @param socket the socket structure
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_thread_start (microtcp_sock_t *socket);
+
+/**
+ * Starts a server of that many shards on one address. Each shard is a
+ * thread pinned to a CPU of its own, with a listening UDP socket on the
+ * address (SO_REUSEPORT) and an event loop. The kernel hashes the
+ * addresses and ports of every datagram to pick the socket, so a
+ * connection stays with the shard that accepted it and its state is only
+ * ever touched by that thread. Whatever a shard allocates lands on the
+ * NUMA node of its CPU.
+ *
+ * @param address the address to listen on
+ * @param address_len its length
+ * @param shards the number of threads, 0 for one per CPU
+ * @param backlog the backlog of each listener
+ * @param init called by every shard, see microtcp_shard_fn
+ * @param arg passed to init
+ * @return the engine once every shard listens, or NULL on failure
+ */
+microtcp_engine_t *
+microtcp_engine_new (const struct sockaddr *address, socklen_t address_len,
+                     int shards, int backlog, microtcp_shard_fn init, void *arg);
+
+/**
+ * @return the number of shards of the engine
+ */
+int
+microtcp_engine_shards (microtcp_engine_t *engine);
+
+/**
+ * Stops the shards and frees the engine. The connections must have been
+ * closed already.
+ */
+void
+microtcp_engine_free (microtcp_engine_t *engine);
+
+/**
+ * Configures the delayed ACKs of the socket. In-order data is ACKed
+ * every that many segments, or when the delay expires, whichever comes
+ * first. Out-of-order data and window updates are always ACKed at once.
+ *
+ * @param socket the socket structure
+ * @param segments ACK every that many segments, 1 to ACK each one
+ * @param delay_us the longest an ACK may be held back in microseconds
+ * @return 0 on success or -1 on invalid arguments
+ */
+int
+microtcp_set_ack_rate (microtcp_sock_t *socket, int segments, uint32_t delay_us);
+
+/**
+ * Enables software receive timestamps of the kernel (SO_TIMESTAMPING).
+ * RTT samples then leave out the time ACKs waited in the socket until
+ * the application called into the library.
+ *
+ * @param socket the socket structure
+ * @param enable TRUE to enable, FALSE to disable
+ * @return 0 on success or -1 if the kernel refused
+ */
+int
+microtcp_set_rx_timestamps (microtcp_sock_t *socket, int enable);
+
+/**
+ * Selects the congestion control algorithm of the socket: "reno",
+ * "newreno" (the default), "cubic" or "bbr". Call it before the
+ * connection is established; later calls start the new algorithm from
+ * the initial window.
+ *
+ * @param socket the socket structure
+ * @param name the name of the algorithm
+ * @return 0 on success or -1 if there is no such algorithm
+ */
+int
+microtcp_set_congestion_control (microtcp_sock_t *socket, const char *name);
+
+/**
+ * Selects how the sender paces its segments. MICROTCP_PACING_TXTIME only
+ * works if the interface runs the fq (or etf) qdisc, otherwise the
+ * kernel sends the segments at once.
+ *
+ * @param socket the socket structure
+ * @param mode one of microtcp_pacing_t
+ * @return 0 on success, -1 if the kernel refused SO_TXTIME, in which case
+ * the timer is used
+ */
+int
+microtcp_set_pacing (microtcp_sock_t *socket, microtcp_pacing_t mode);
+
+/**
+ * Enables or disables UDP segmentation offload. With it, a run of
+ * segments crosses the kernel as one large datagram (GSO) and so do
+ * segments that arrive back to back (GRO). Sockets start with it
+ * enabled when the kernel supports it; should the device later refuse
+ * to segment, the sender quietly falls back to single datagrams. The
+ * connections of a listener follow the listener.
+ *
+ * @param socket the socket structure
+ * @param enable TRUE to enable, FALSE to disable
+ * @return 0 on success or -1 if the kernel lacks support
+ */
+int
+microtcp_set_offload (microtcp_sock_t *socket, int enable);
+
+/**
+ * Reads the counters of the packet pool that holds the datagrams a
+ * listener sorted to its connections until they are processed. It is
+ * shared by the listener and all of them, and bounds their memory:
+ * datagrams that find it empty are dropped.
+ *
+ * @param socket a listening socket or a connection accepted from one
+ * @param stats where to store the counters
+ * @return 0 on success or -1 if the socket has no pool
+ */
+int
+microtcp_pool_stats (microtcp_sock_t *socket, microtcp_pool_stats_t *stats);
+
 
 #endif /* LIB_MICROTCP_H_ */
@@ -0,0 +1,318 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "microtcp_cc.h"
+
+/*
+ * BBR (draft-cardwell-iccrg-bbr-congestion-control). Instead of reacting
+ * to losses, it models the path from the delivery rate samples: the
+ * bottleneck bandwidth is the highest rate seen over the last rounds and
+ * the propagation delay the lowest RTT seen over the last seconds.
+ * Segments are paced at the bandwidth, and cwnd only caps what is in
+ * flight at a small multiple of their product, so the bottleneck queue
+ * stays nearly empty.
+ *
+ * Gains are fixed point, BBR_UNIT is 1.
+ */
+#define BBR_UNIT 256
+#define BBR_HIGH_GAIN 739       /* 2/ln(2), doubles the rate each round */
+#define BBR_DRAIN_GAIN 88       /* 1/BBR_HIGH_GAIN, empties the queue STARTUP built */
+#define BBR_CWND_GAIN 512
+#define BBR_BW_ROUNDS 10
+#define BBR_CYCLE_LEN 8
+#define BBR_FULL_BW_THRESH 320  /* 1.25, growth that still means the pipe isn't full */
+#define BBR_FULL_BW_ROUNDS 3
+#define BBR_MIN_RTT_WIN_US 10000000
+#define BBR_PROBE_RTT_US 200000
+#define BBR_MIN_CWND (4 * MICROTCP_MSS)
+
+enum bbr_mode
+{
+  BBR_STARTUP,
+  BBR_DRAIN,
+  BBR_PROBE_BW,
+  BBR_PROBE_RTT
+};
+
+/* Probe for more bandwidth, then drain the queue that built, then cruise */
+static const uint32_t bbr_cycle_gain[BBR_CYCLE_LEN] = {
+  320, 192, 256, 256, 256, 256, 256, 256
+};
+
+struct bbr
+{
+  uint64_t bw[BBR_BW_ROUNDS];   /**< Highest delivery rate of each recent round in bytes/s */
+  uint64_t round_delivered;     /**< Delivered at the start of the current round */
+  uint64_t min_rtt_stamp;       /**< When min_rtt_us was measured */
+  uint64_t probe_rtt_done;      /**< End of PROBE_RTT, 0 until the flight drained */
+  uint64_t cycle_stamp;         /**< Start of the current PROBE_BW phase */
+  uint64_t full_bw;             /**< Bandwidth when it last grew by BBR_FULL_BW_THRESH */
+  uint32_t round;               /**< Round trips so far */
+  uint32_t min_rtt_us;          /**< Propagation delay estimate, 0 if none */
+  uint32_t mode;                /**< enum bbr_mode */
+  uint32_t cycle_index;         /**< Phase of PROBE_BW */
+  uint32_t full_bw_count;       /**< Rounds without enough growth */
+  uint32_t full_pipe;           /**< STARTUP found the bottleneck */
+  uint32_t prior_cwnd;          /**< cwnd to restore after PROBE_RTT or a timeout */
+  uint32_t rto_recovery;        /**< A timeout cut cwnd, until the recovery it started ends */
+};
+
+_Static_assert(sizeof(struct bbr) <= sizeof(((microtcp_sock_t *)0)->cc_priv),
+               "struct bbr does not fit in cc_priv");
+
+static uint64_t
+bbr_max_bw(const struct bbr *bbr)
+{
+  uint64_t bw = 0;
+  int i;
+
+  for(i = 0; i < BBR_BW_ROUNDS; i++)
+    if(bbr->bw[i] > bw)
+      bw = bbr->bw[i];
+  return bw;
+}
+
+/*
+ * Bytes in flight that the model says fill the pipe, times gain
+ */
+static size_t
+bbr_bdp(const struct bbr *bbr, uint32_t gain)
+{
+  return bbr_max_bw(bbr) * bbr->min_rtt_us / 1000000 * gain / BBR_UNIT;
+}
+
+static uint32_t
+bbr_pacing_gain(const struct bbr *bbr)
+{
+  switch(bbr->mode){
+  case BBR_STARTUP:
+    return BBR_HIGH_GAIN;
+  case BBR_DRAIN:
+    return BBR_DRAIN_GAIN;
+  case BBR_PROBE_BW:
+    return bbr_cycle_gain[bbr->cycle_index];
+  default:
+    return BBR_UNIT;
+  }
+}
+
+static void
+bbr_init(microtcp_sock_t *socket)
+{
+  struct bbr *bbr = (struct bbr *)socket->cc_priv;
+
+  socket->cwnd = MICROTCP_INIT_CWND;
+  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+  memset(bbr, 0, sizeof(struct bbr));
+  bbr->mode = BBR_STARTUP;
+  bbr->min_rtt_stamp = microtcp_now_us();
+}
+
+/*
+ * The window follows the rate samples, not the ACKs
+ */
+static void
+bbr_on_ack(microtcp_sock_t *socket, uint32_t bytes_acked)
+{
+  (void)socket;
+  (void)bytes_acked;
+}
+
+/*
+ * Remember the window to go back to. Once PROBE_RTT or a timeout cut
+ * it, only a larger one replaces it.
+ */
+static void
+bbr_save_cwnd(microtcp_sock_t *socket, struct bbr *bbr)
+{
+  if(bbr->mode != BBR_PROBE_RTT && !bbr->rto_recovery)
+    bbr->prior_cwnd = socket->cwnd;
+  else if(socket->cwnd > bbr->prior_cwnd)
+    bbr->prior_cwnd = socket->cwnd;
+}
+
+static void
+bbr_enter_probe_bw(struct bbr *bbr, uint64_t now)
+{
+  bbr->mode = BBR_PROBE_BW;
+  bbr->cycle_stamp = now;
+
+  // Start anywhere but in the draining phase, so that flows sharing a
+  // bottleneck don't probe in lockstep
+  bbr->cycle_index = now % (BBR_CYCLE_LEN - 1);
+  if(bbr->cycle_index >= 1)
+    bbr->cycle_index++;
+}
+
+static void
+bbr_update_mode(microtcp_sock_t *socket, struct bbr *bbr, int round_start, uint64_t now)
+{
+  uint32_t flight = socket->seq_number - socket->snd_una;
+  uint32_t gain;
+
+  // STARTUP ends once three rounds in a row failed to raise the bandwidth
+  if(round_start && !bbr->full_pipe){
+    if(bbr_max_bw(bbr) >= bbr->full_bw * BBR_FULL_BW_THRESH / BBR_UNIT){
+      bbr->full_bw = bbr_max_bw(bbr);
+      bbr->full_bw_count = 0;
+    }else if(++bbr->full_bw_count >= BBR_FULL_BW_ROUNDS){
+      bbr->full_pipe = TRUE;
+    }
+  }
+
+  if(bbr->mode == BBR_STARTUP && bbr->full_pipe)
+    bbr->mode = BBR_DRAIN;
+  if(bbr->mode == BBR_DRAIN && flight <= bbr_bdp(bbr, BBR_UNIT))
+    bbr_enter_probe_bw(bbr, now);
+
+  // Next phase after a min RTT, the draining one as soon as the queue is gone
+  if(bbr->mode == BBR_PROBE_BW){
+    gain = bbr_cycle_gain[bbr->cycle_index];
+    if(now - bbr->cycle_stamp > bbr->min_rtt_us ||
+       (gain < BBR_UNIT && flight <= bbr_bdp(bbr, BBR_UNIT))){
+      bbr->cycle_index = (bbr->cycle_index + 1) % BBR_CYCLE_LEN;
+      bbr->cycle_stamp = now;
+    }
+  }
+
+  // The min RTT is stale, drain the pipe to measure it again
+  if(bbr->mode != BBR_PROBE_RTT && now - bbr->min_rtt_stamp > BBR_MIN_RTT_WIN_US){
+    bbr_save_cwnd(socket, bbr);
+    bbr->mode = BBR_PROBE_RTT;
+    bbr->probe_rtt_done = 0;
+  }
+
+  if(bbr->mode == BBR_PROBE_RTT){
+    if(bbr->probe_rtt_done == 0 && flight <= BBR_MIN_CWND){
+      bbr->probe_rtt_done = now + BBR_PROBE_RTT_US;
+    }else if(bbr->probe_rtt_done != 0 && now >= bbr->probe_rtt_done){
+      bbr->min_rtt_stamp = now;
+      if(socket->cwnd < bbr->prior_cwnd)
+        socket->cwnd = bbr->prior_cwnd;
+      if(bbr->full_pipe)
+        bbr_enter_probe_bw(bbr, now);
+      else
+        bbr->mode = BBR_STARTUP;
+    }
+  }
+}
+
+static void
+bbr_on_rate_sample(microtcp_sock_t *socket, const microtcp_rate_sample_t *rs)
+{
+  struct bbr *bbr = (struct bbr *)socket->cc_priv;
+  uint64_t now = microtcp_now_us(), bw;
+  int round_start = FALSE;
+  size_t target;
+
+  // A round ends when a segment sent after its start is delivered
+  if(rs->prior_delivered >= bbr->round_delivered){
+    bbr->round_delivered = socket->delivered;
+    bbr->round++;
+    bbr->bw[bbr->round % BBR_BW_ROUNDS] = 0;
+    round_start = TRUE;
+  }
+
+  // An app-limited sample only counts if it beats the estimate anyway
+  if(rs->interval_us > 0 && rs->delivered > 0){
+    bw = rs->delivered * 1000000 / rs->interval_us;
+    if(!rs->app_limited || bw >= bbr_max_bw(bbr))
+      if(bw > bbr->bw[bbr->round % BBR_BW_ROUNDS])
+        bbr->bw[bbr->round % BBR_BW_ROUNDS] = bw;
+  }
+
+  if(rs->rtt_us != 0 && (bbr->min_rtt_us == 0 || rs->rtt_us <= bbr->min_rtt_us ||
+                         now - bbr->min_rtt_stamp > BBR_MIN_RTT_WIN_US)){
+    bbr->min_rtt_us = rs->rtt_us;
+    if(bbr->mode != BBR_PROBE_RTT)
+      bbr->min_rtt_stamp = now;
+  }
+
+  bbr_update_mode(socket, bbr, round_start, now);
+
+  // The segments lost to a timeout are delivered, back to the window
+  // before it
+  if(bbr->rto_recovery && !socket->in_recovery){
+    bbr->rto_recovery = FALSE;
+    if(socket->cwnd < bbr->prior_cwnd)
+      socket->cwnd = bbr->prior_cwnd;
+  }
+
+  // Room for twice the pipe, so that delayed and stretched ACKs don't
+  // starve the pacer
+  target = bbr_bdp(bbr, BBR_CWND_GAIN) + 3 * MICROTCP_MSS;
+  if(bbr->full_pipe){
+    socket->cwnd += rs->acked;
+    if(socket->cwnd > target)
+      socket->cwnd = target;
+  }else if(socket->cwnd < target || socket->delivered < MICROTCP_INIT_CWND ||
+           bbr_max_bw(bbr) == 0){
+    socket->cwnd += rs->acked;
+  }
+  if(socket->cwnd < BBR_MIN_CWND)
+    socket->cwnd = BBR_MIN_CWND;
+  if(bbr->mode == BBR_PROBE_RTT)
+    socket->cwnd = BBR_MIN_CWND;
+}
+
+/*
+ * Losses are not a congestion signal, the model already keeps the queue short
+ */
+static void
+bbr_on_loss(microtcp_sock_t *socket)
+{
+  (void)socket;
+}
+
+static void
+bbr_on_timeout(microtcp_sock_t *socket)
+{
+  struct bbr *bbr = (struct bbr *)socket->cc_priv;
+
+  bbr_save_cwnd(socket, bbr);
+  bbr->rto_recovery = TRUE;
+  socket->cwnd = BBR_MIN_CWND;
+}
+
+static uint64_t
+bbr_pacing_rate(microtcp_sock_t *socket)
+{
+  struct bbr *bbr = (struct bbr *)socket->cc_priv;
+  uint64_t bw = bbr_max_bw(bbr);
+
+  // Until the first sample, as fast as STARTUP would grow the window
+  if(bw == 0){
+    if(socket->srtt_us == 0)
+      return 0;
+    bw = (uint64_t)socket->cwnd * 1000000 / socket->srtt_us;
+  }
+  return bw * bbr_pacing_gain(bbr) / BBR_UNIT;
+}
+
+const struct microtcp_cc_ops microtcp_cc_bbr = {
+  .name = "bbr",
+  .init = bbr_init,
+  .on_ack = bbr_on_ack,
+  .on_loss = bbr_on_loss,
+  .on_timeout = bbr_on_timeout,
+  .pacing_rate = bbr_pacing_rate,
+  .on_rate_sample = bbr_on_rate_sample,
+  .partial_ack_recovery = TRUE,
+};
@@ -0,0 +1,138 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "microtcp_cc.h"
+
+static const struct microtcp_cc_ops *algorithms[] = {
+  &microtcp_cc_reno,
+  &microtcp_cc_newreno,
+  &microtcp_cc_cubic,
+  &microtcp_cc_bbr,
+};
+
+const struct microtcp_cc_ops *
+microtcp_cc_find (const char *name)
+{
+  size_t i;
+
+  for(i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++)
+    if(strcmp(algorithms[i]->name, name) == 0)
+      return algorithms[i];
+  return NULL;
+}
+
+uint32_t
+microtcp_cc_slow_start (microtcp_sock_t *socket, uint32_t bytes_acked)
+{
+  size_t room = socket->ssthresh - socket->cwnd;
+  uint32_t grow = bytes_acked < 2 * MICROTCP_MSS ? bytes_acked : 2 * MICROTCP_MSS;
+
+  if(grow > room)
+    grow = room;
+  socket->cwnd += grow;
+  return bytes_acked - grow;
+}
+
+size_t
+microtcp_cc_half_flight (microtcp_sock_t *socket)
+{
+  size_t half = (uint32_t)(socket->seq_number - socket->snd_una) / 2;
+
+  return half > 2 * MICROTCP_MSS ? half : 2 * MICROTCP_MSS;
+}
+
+uint64_t
+microtcp_cc_cwnd_rate (microtcp_sock_t *socket)
+{
+  uint64_t rate;
+
+  if(socket->srtt_us == 0)
+    return 0;
+  rate = (uint64_t)socket->cwnd * 1000000 / socket->srtt_us;
+  return socket->cwnd < socket->ssthresh ? rate * 2 : rate * 6 / 5;
+}
+
+/*
+ * Reno (RFC 5681), one segment more per window of data in congestion
+ * avoidance, half the window on loss
+ */
+static void
+reno_init(microtcp_sock_t *socket)
+{
+  socket->cwnd = MICROTCP_INIT_CWND;
+  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+  socket->cc_priv[0] = 0;
+}
+
+static void
+reno_on_ack(microtcp_sock_t *socket, uint32_t bytes_acked)
+{
+  uint64_t *acked = &socket->cc_priv[0];
+
+  if(socket->cwnd < socket->ssthresh)
+    bytes_acked = microtcp_cc_slow_start(socket, bytes_acked);
+
+  // Congestion Avoidance, counting bytes so that delayed ACKs don't slow it down
+  *acked += bytes_acked;
+  if(*acked >= socket->cwnd){
+    *acked -= socket->cwnd;
+    socket->cwnd += MICROTCP_MSS;
+  }
+}
+
+static void
+reno_on_loss(microtcp_sock_t *socket)
+{
+  socket->ssthresh = microtcp_cc_half_flight(socket);
+  socket->cwnd = socket->ssthresh;
+  socket->cc_priv[0] = 0;
+}
+
+static void
+reno_on_timeout(microtcp_sock_t *socket)
+{
+  socket->ssthresh = microtcp_cc_half_flight(socket);
+  socket->cwnd = MICROTCP_MSS;
+  socket->cc_priv[0] = 0;
+}
+
+const struct microtcp_cc_ops microtcp_cc_reno = {
+  .name = "reno",
+  .init = reno_init,
+  .on_ack = reno_on_ack,
+  .on_loss = reno_on_loss,
+  .on_timeout = reno_on_timeout,
+  .pacing_rate = microtcp_cc_cwnd_rate,
+  .partial_ack_recovery = FALSE,
+};
+
+/*
+ * NewReno (RFC 6582), Reno that repairs a hole per partial ACK instead of
+ * leaving fast recovery at the first one
+ */
+const struct microtcp_cc_ops microtcp_cc_newreno = {
+  .name = "newreno",
+  .init = reno_init,
+  .on_ack = reno_on_ack,
+  .on_loss = reno_on_loss,
+  .on_timeout = reno_on_timeout,
+  .pacing_rate = microtcp_cc_cwnd_rate,
+  .partial_ack_recovery = TRUE,
+};
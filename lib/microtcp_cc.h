@@ -0,0 +1,112 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_CC_H_
+#define LIB_MICROTCP_CC_H_
+
+#include "microtcp.h"
+
+/**
+ * A delivery rate sample, taken on every ACK that delivers new data
+ * (draft-cheng-iccrg-delivery-rate-estimation). The rate is delivered
+ * over interval_us.
+ */
+typedef struct
+{
+  uint64_t delivered;           /**< Bytes delivered over the interval */
+  uint64_t interval_us;         /**< Length of the interval, 0 if there is no sample */
+  uint64_t prior_delivered;     /**< Bytes delivered when the newest acknowledged segment was sent */
+  uint64_t prior_us;            /**< When delivery reached prior_delivered */
+  uint64_t send_elapsed_us;     /**< How long the sending of the interval took */
+  uint32_t acked;               /**< Bytes this ACK newly delivered */
+  uint32_t rtt_us;              /**< RTT of the newest acknowledged segment, 0 if it was resent */
+  int app_limited;              /**< The sender ran out of data during the interval */
+  int valid;                    /**< A segment was delivered, the fields above are set */
+} microtcp_rate_sample_t;
+
+/**
+ * A congestion control algorithm. The sender calls into it on the events
+ * below; the algorithm keeps cwnd and ssthresh of the socket, in bytes,
+ * and any state of its own in cc_priv.
+ */
+struct microtcp_cc_ops
+{
+  const char *name;
+
+  /** Sets up the window of a new connection */
+  void (*init)(microtcp_sock_t *socket);
+
+  /** New data was acknowledged outside of fast recovery */
+  void (*on_ack)(microtcp_sock_t *socket, uint32_t bytes_acked);
+
+  /** Duplicate ACKs or SACKs revealed a loss, fast recovery starts */
+  void (*on_loss)(microtcp_sock_t *socket);
+
+  /** The retransmission timer expired */
+  void (*on_timeout)(microtcp_sock_t *socket);
+
+  /** Rate to pace segments at in bytes per second, 0 if unpaced */
+  uint64_t (*pacing_rate)(microtcp_sock_t *socket);
+
+  /** A delivery rate sample, on every ACK of new data. May be NULL. */
+  void (*on_rate_sample)(microtcp_sock_t *socket, const microtcp_rate_sample_t *rs);
+
+  int partial_ack_recovery;     /**< Stay in fast recovery across partial ACKs (RFC 6582) */
+};
+
+extern const struct microtcp_cc_ops microtcp_cc_reno;
+extern const struct microtcp_cc_ops microtcp_cc_newreno;
+extern const struct microtcp_cc_ops microtcp_cc_cubic;
+extern const struct microtcp_cc_ops microtcp_cc_bbr;
+
+#define MICROTCP_CC_DEFAULT (&microtcp_cc_newreno)
+
+/**
+ * @return the algorithm called name, or NULL if there is none
+ */
+const struct microtcp_cc_ops *
+microtcp_cc_find (const char *name);
+
+/*
+ * Helpers shared by the algorithms
+ */
+
+/**
+ * Grows cwnd in slow start, by at most two segments per ACK (RFC 3465).
+ *
+ * @return the bytes of bytes_acked left once cwnd reached ssthresh
+ */
+uint32_t
+microtcp_cc_slow_start (microtcp_sock_t *socket, uint32_t bytes_acked);
+
+/**
+ * @return half the data in flight, but at least two segments
+ */
+size_t
+microtcp_cc_half_flight (microtcp_sock_t *socket);
+
+/**
+ * Paces at a multiple of cwnd per smoothed RTT, twice as fast in slow
+ * start so that the window can still double.
+ */
+uint64_t
+microtcp_cc_cwnd_rate (microtcp_sock_t *socket);
+
+#endif /* LIB_MICROTCP_CC_H_ */
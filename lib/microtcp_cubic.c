@@ -0,0 +1,146 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include "microtcp_cc.h"
+
+/*
+ * CUBIC (RFC 9438). After a loss the window grows along a cubic curve
+ * that levels off around the window where the loss happened, so it is
+ * regained within a few seconds whatever the RTT.
+ */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+#define CUBIC_ALPHA (3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA))
+
+struct cubic
+{
+  double w_max;                 /**< Window before the last reduction in bytes */
+  double k;                     /**< Seconds from the epoch start until w_max is reached */
+  double w_est;                 /**< Window Reno would have in bytes */
+  double carry;                 /**< Growth less than a byte, saved for the next ACK */
+  uint64_t epoch_start;         /**< Start of the current growth in us, 0 if none */
+};
+
+_Static_assert(sizeof(struct cubic) <= sizeof(((microtcp_sock_t *)0)->cc_priv),
+               "struct cubic does not fit in cc_priv");
+
+static void
+cubic_init(microtcp_sock_t *socket)
+{
+  struct cubic *ca = (struct cubic *)socket->cc_priv;
+
+  socket->cwnd = MICROTCP_INIT_CWND;
+  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+  memset(ca, 0, sizeof(struct cubic));
+}
+
+static void
+cubic_on_ack(microtcp_sock_t *socket, uint32_t bytes_acked)
+{
+  struct cubic *ca = (struct cubic *)socket->cc_priv;
+  double cwnd, t, target, grow;
+  uint64_t now;
+
+  if(socket->cwnd < socket->ssthresh){
+    bytes_acked = microtcp_cc_slow_start(socket, bytes_acked);
+    if(bytes_acked == 0)
+      return;
+  }
+
+  now = microtcp_now_us();
+  cwnd = socket->cwnd;
+  if(ca->epoch_start == 0){
+    ca->epoch_start = now;
+    if(ca->w_max <= cwnd){
+      ca->w_max = cwnd;
+      ca->k = 0;
+    }else{
+      ca->k = cbrt((ca->w_max - cwnd) / MICROTCP_MSS / CUBIC_C);
+    }
+    ca->w_est = cwnd;
+  }
+
+  // Where the curve will be one RTT from now, growing at most by half
+  t = (now - ca->epoch_start + socket->srtt_us) / 1e6;
+  target = ca->w_max + CUBIC_C * pow(t - ca->k, 3) * MICROTCP_MSS;
+  if(target > 1.5 * cwnd)
+    target = 1.5 * cwnd;
+
+  if(target > cwnd)
+    grow = (target - cwnd) * bytes_acked / cwnd;
+  else
+    grow = 0.01 * MICROTCP_MSS * bytes_acked / cwnd;
+
+  // Never slower than Reno would be
+  ca->w_est += CUBIC_ALPHA * MICROTCP_MSS * bytes_acked / cwnd;
+  if(ca->w_est > cwnd + grow)
+    grow = ca->w_est - cwnd;
+
+  grow += ca->carry;
+  socket->cwnd += (size_t)grow;
+  ca->carry = grow - floor(grow);
+}
+
+/*
+ * Remember where the loss happened, lower if the window was already
+ * shrinking so that a new flow gets its share sooner
+ */
+static void
+cubic_reduce(microtcp_sock_t *socket)
+{
+  struct cubic *ca = (struct cubic *)socket->cc_priv;
+  double cwnd = socket->cwnd;
+
+  if(cwnd < ca->w_max)
+    ca->w_max = cwnd * (1 + CUBIC_BETA) / 2;
+  else
+    ca->w_max = cwnd;
+  ca->epoch_start = 0;
+  ca->carry = 0;
+
+  socket->ssthresh = cwnd * CUBIC_BETA;
+  if(socket->ssthresh < 2 * MICROTCP_MSS)
+    socket->ssthresh = 2 * MICROTCP_MSS;
+}
+
+static void
+cubic_on_loss(microtcp_sock_t *socket)
+{
+  cubic_reduce(socket);
+  socket->cwnd = socket->ssthresh;
+}
+
+static void
+cubic_on_timeout(microtcp_sock_t *socket)
+{
+  cubic_reduce(socket);
+  socket->cwnd = MICROTCP_MSS;
+}
+
+const struct microtcp_cc_ops microtcp_cc_cubic = {
+  .name = "cubic",
+  .init = cubic_init,
+  .on_ack = cubic_on_ack,
+  .on_loss = cubic_on_loss,
+  .on_timeout = cubic_on_timeout,
+  .pacing_rate = microtcp_cc_cwnd_rate,
+  .partial_ack_recovery = TRUE,
+};
@@ -0,0 +1,424 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "microtcp_demux.h"
+
+/*
+ * Bucket of a peer address, port and connection ID, before the mask
+ */
+static inline size_t
+conn_hash(const struct sockaddr_in *peer, uint16_t cid)
+{
+  uint64_t h = (uint64_t)peer->sin_addr.s_addr << 32 | (uint32_t)peer->sin_port << 16 | cid;
+
+  // The finalizer of MurmurHash3, every input bit moves every output bit
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static struct microtcp_conn *
+conn_find(struct microtcp_listener *listener, const struct sockaddr_in *peer, uint16_t cid)
+{
+  struct microtcp_conn *conn;
+
+  conn = listener->buckets[conn_hash(peer, cid) & (listener->nbuckets - 1)];
+  for(; conn != NULL; conn = conn->next){
+    if(conn->cid == cid && conn->peer.sin_port == peer->sin_port &&
+       conn->peer.sin_addr.s_addr == peer->sin_addr.s_addr)
+      return conn;
+  }
+  return NULL;
+}
+
+/*
+ * Double the buckets once there are more connections than buckets, so
+ * that chains stay about one long
+ */
+static void
+conn_table_grow(struct microtcp_listener *listener)
+{
+  struct microtcp_conn **buckets, *conn, *next;
+  size_t nbuckets = listener->nbuckets * 2, i, b;
+
+  buckets = calloc(nbuckets, sizeof(struct microtcp_conn *));
+  if(buckets == NULL)
+    return;
+  for(i = 0; i < listener->nbuckets; i++){
+    for(conn = listener->buckets[i]; conn != NULL; conn = next){
+      next = conn->next;
+      b = conn_hash(&conn->peer, conn->cid) & (nbuckets - 1);
+      conn->next = buckets[b];
+      buckets[b] = conn;
+    }
+  }
+  free(listener->buckets);
+  listener->buckets = buckets;
+  listener->nbuckets = nbuckets;
+}
+
+static struct microtcp_conn *
+conn_new(struct microtcp_listener *listener, const struct sockaddr_in *peer, uint16_t cid)
+{
+  struct microtcp_conn *conn = calloc(1, sizeof(struct microtcp_conn));
+  size_t b;
+
+  if(conn == NULL)
+    return NULL;
+  conn->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(conn->efd < 0){
+    free(conn);
+    return NULL;
+  }
+  conn->peer = *peer;
+  conn->cid = cid;
+
+  if(listener->nconns >= listener->nbuckets)
+    conn_table_grow(listener);
+  b = conn_hash(peer, cid) & (listener->nbuckets - 1);
+  conn->next = listener->buckets[b];
+  listener->buckets[b] = conn;
+  listener->nconns++;
+  return conn;
+}
+
+/*
+ * Frees a connection, giving the datagrams still in its ring back to the
+ * pool
+ */
+static void
+conn_free(struct microtcp_listener *listener, struct microtcp_conn *conn)
+{
+  int i;
+
+  for(i = 0; i < conn->count; i++)
+    microtcp_pool_put(listener->pool, conn->pkts[(conn->head + i) % MICROTCP_DEMUX_QUEUE_LEN]);
+  close(conn->efd);
+  free(conn);
+}
+
+static inline void
+efd_signal(int efd)
+{
+  uint64_t one = 1;
+  if(write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+}
+
+static inline void
+efd_clear(int efd)
+{
+  uint64_t count;
+  if(read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+}
+
+/*
+ * Hand a datagram to its connection. A SYN of an unknown peer starts a
+ * new one, anything else of an unknown peer is dropped.
+ */
+static void
+demux_input(struct microtcp_listener *listener, const uint8_t *buf, ssize_t len,
+            const struct sockaddr_in *peer)
+{
+  const microtcp_header_t *header = (const microtcp_header_t *)buf;
+  struct microtcp_conn *conn;
+  uint8_t *pkt;
+  uint16_t cid;
+  int slot;
+
+  if(len < (ssize_t)sizeof(microtcp_header_t) || len > (ssize_t)MICROTCP_PKT_LEN){
+    listener->dropped++;
+    return;
+  }
+
+  // An empty pool drops like a full socket buffer would, before a SYN
+  // can start a connection with nothing in its ring
+  cid = ntohl(header->data_len) >> MICROTCP_CID_SHIFT;
+  conn = conn_find(listener, peer, cid);
+  pkt = microtcp_pool_get(listener->pool);
+  if(pkt == NULL){
+    if(conn != NULL)
+      conn->dropped++;
+    else
+      listener->dropped++;
+    return;
+  }
+  if(conn == NULL){
+    if(ntohs(header->control) != SYN || listener->backlog >= listener->backlog_max ||
+       (conn = conn_new(listener, peer, cid)) == NULL){
+      microtcp_pool_put(listener->pool, pkt);
+      listener->dropped++;
+      return;
+    }
+    if(listener->backlog_tail != NULL)
+      listener->backlog_tail->backlog_next = conn;
+    else
+      listener->backlog_head = conn;
+    listener->backlog_tail = conn;
+    listener->backlog++;
+    efd_signal(listener->efd);
+  }
+
+  // So does a full ring
+  if(conn->count == MICROTCP_DEMUX_QUEUE_LEN){
+    microtcp_pool_put(listener->pool, pkt);
+    conn->dropped++;
+    return;
+  }
+  slot = (conn->head + conn->count) % MICROTCP_DEMUX_QUEUE_LEN;
+  memcpy(pkt, buf, len);
+  conn->pkts[slot] = pkt;
+  conn->lens[slot] = len;
+  if(conn->count++ == conn->taken)
+    efd_signal(conn->efd);
+  if(conn->handshake)
+    efd_signal(listener->efd);
+}
+
+/*
+ * Sort one batch of the port into the rings, with the lock held
+ */
+static void
+demux_read(struct microtcp_listener *listener)
+{
+  uint8_t *buf;
+  ssize_t len;
+
+  buf = microtcp_io_rx_next(&listener->sock, MSG_DONTWAIT, &len);
+  while(buf != NULL){
+    demux_input(listener, buf, len, microtcp_io_rx_addr(&listener->sock));
+    if(!microtcp_io_rx_pending(&listener->sock))
+      break;
+    buf = microtcp_io_rx_next(&listener->sock, MSG_DONTWAIT, &len);
+  }
+}
+
+/*
+ * Sleep until the port has datagrams or efd is signalled, reading the
+ * port if it does
+ *
+ * @return 0 on timeout
+ */
+static int
+demux_poll(struct microtcp_listener *listener, int efd, uint64_t timeout_us)
+{
+  struct pollfd pfd[2];
+  struct timespec ts;
+  int ret;
+
+  pfd[0].fd = microtcp_io_fd(&listener->sock);
+  pfd[0].events = POLLIN;
+  pfd[1].fd = efd;
+  pfd[1].events = POLLIN;
+  ts.tv_sec = timeout_us / 1000000;
+  ts.tv_nsec = (timeout_us % 1000000) * 1000;
+  ret = ppoll(pfd, 2, &ts, NULL);
+  if(ret <= 0)
+    return 0;
+
+  if(pfd[1].revents & POLLIN)
+    efd_clear(efd);
+  if(pfd[0].revents & POLLIN)
+    microtcp_demux_read(listener);
+  return 1;
+}
+
+struct microtcp_listener *
+microtcp_demux_new (const microtcp_sock_t *socket, int backlog)
+{
+  struct microtcp_listener *listener = calloc(1, sizeof(struct microtcp_listener));
+
+  if(listener == NULL)
+    return NULL;
+  listener->sock = *socket;
+  listener->sock.listener = NULL;
+  listener->nbuckets = MICROTCP_DEMUX_BUCKETS;
+  listener->buckets = calloc(listener->nbuckets, sizeof(struct microtcp_conn *));
+  listener->backlog_max = backlog > 0 ? backlog : 1;
+  listener->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  listener->pool = microtcp_pool_new(MICROTCP_PKT_LEN, MICROTCP_POOL_PKTS);
+  if(listener->buckets == NULL || listener->efd < 0 || listener->pool == NULL){
+    if(listener->efd >= 0)
+      close(listener->efd);
+    microtcp_pool_free(listener->pool);
+    free(listener->buckets);
+    free(listener);
+    return NULL;
+  }
+  pthread_mutex_init(&listener->lock, NULL);
+  return listener;
+}
+
+void
+microtcp_demux_free (struct microtcp_listener *listener)
+{
+  struct microtcp_conn *conn, *next;
+  size_t i;
+
+  for(i = 0; i < listener->nbuckets; i++){
+    for(conn = listener->buckets[i]; conn != NULL; conn = next){
+      next = conn->next;
+      conn_free(listener, conn);
+    }
+  }
+  microtcp_pool_free(listener->pool);
+  pthread_mutex_destroy(&listener->lock);
+  close(listener->efd);
+  free(listener->buckets);
+  free(listener);
+}
+
+struct microtcp_conn *
+microtcp_demux_accept (struct microtcp_listener *listener, uint64_t timeout_us)
+{
+  struct microtcp_conn *conn;
+  uint64_t now, deadline = microtcp_now_us() + timeout_us;
+  int woken = FALSE;
+
+  for(;;){
+    pthread_mutex_lock(&listener->lock);
+    if(listener->backlog == 0)
+      demux_read(listener);
+    conn = listener->backlog_head;
+    if(conn != NULL){
+      listener->backlog_head = conn->backlog_next;
+      if(listener->backlog_head == NULL)
+        listener->backlog_tail = NULL;
+      conn->backlog_next = NULL;
+      listener->backlog--;
+    }
+    pthread_mutex_unlock(&listener->lock);
+
+    if(conn != NULL || woken || (now = microtcp_now_us()) >= deadline)
+      return conn;
+    woken = demux_poll(listener, listener->efd, deadline - now);
+  }
+}
+
+void
+microtcp_demux_handshake (struct microtcp_listener *listener,
+                          struct microtcp_conn *conn, int handshake)
+{
+  pthread_mutex_lock(&listener->lock);
+  conn->handshake = handshake;
+  pthread_mutex_unlock(&listener->lock);
+}
+
+void
+microtcp_demux_close (struct microtcp_listener *listener,
+                      struct microtcp_conn *conn)
+{
+  struct microtcp_conn **link;
+
+  pthread_mutex_lock(&listener->lock);
+  link = &listener->buckets[conn_hash(&conn->peer, conn->cid) & (listener->nbuckets - 1)];
+  while(*link != conn)
+    link = &(*link)->next;
+  *link = conn->next;
+  listener->nconns--;
+  pthread_mutex_unlock(&listener->lock);
+  conn_free(listener, conn);
+}
+
+uint8_t *
+microtcp_demux_next (struct microtcp_listener *listener,
+                     struct microtcp_conn *conn, uint64_t timeout_us,
+                     ssize_t *len)
+{
+  uint8_t *buf = NULL;
+  uint64_t now, deadline = microtcp_now_us() + timeout_us;
+
+  for(;;){
+    pthread_mutex_lock(&listener->lock);
+
+    // The datagram handed out last is done with
+    if(conn->taken){
+      microtcp_pool_put(listener->pool, conn->pkts[conn->head]);
+      conn->head = (conn->head + 1) % MICROTCP_DEMUX_QUEUE_LEN;
+      conn->count--;
+      conn->taken = FALSE;
+    }
+    if(conn->count == 0)
+      demux_read(listener);
+    if(conn->count > 0){
+      buf = conn->pkts[conn->head];
+      *len = conn->lens[conn->head];
+      conn->taken = TRUE;
+    }
+    pthread_mutex_unlock(&listener->lock);
+
+    if(buf != NULL || timeout_us == 0 || (now = microtcp_now_us()) >= deadline)
+      return buf;
+    demux_poll(listener, conn->efd, deadline - now);
+  }
+}
+
+void
+microtcp_demux_read (struct microtcp_listener *listener)
+{
+  pthread_mutex_lock(&listener->lock);
+  demux_read(listener);
+  pthread_mutex_unlock(&listener->lock);
+}
+
+int
+microtcp_demux_backlog (struct microtcp_listener *listener)
+{
+  int backlog;
+
+  pthread_mutex_lock(&listener->lock);
+  backlog = listener->backlog;
+  pthread_mutex_unlock(&listener->lock);
+  return backlog;
+}
+
+int
+microtcp_demux_pending (struct microtcp_listener *listener,
+                        struct microtcp_conn *conn)
+{
+  int pending;
+
+  pthread_mutex_lock(&listener->lock);
+  pending = conn->count > conn->taken;
+  pthread_mutex_unlock(&listener->lock);
+  return pending;
+}
+
+int
+microtcp_demux_wait (struct microtcp_listener *listener,
+                     struct microtcp_conn *conn, uint64_t timeout_us)
+{
+  uint64_t now, deadline = microtcp_now_us() + timeout_us;
+
+  for(;;){
+    if(microtcp_demux_pending(listener, conn))
+      return 1;
+    if((now = microtcp_now_us()) >= deadline)
+      return 0;
+    demux_poll(listener, conn->efd, deadline - now);
+  }
+}
@@ -0,0 +1,156 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_DEMUX_H_
+#define LIB_MICROTCP_DEMUX_H_
+
+#include <pthread.h>
+#include "microtcp_io.h"
+#include "microtcp_pool.h"
+
+/**
+ * A connection of a listener, as the listener sees it. Datagrams of the
+ * peer are copied into a ring, from where the socket of the connection
+ * takes them.
+ */
+struct microtcp_conn
+{
+  struct microtcp_conn *next;   /**< Next connection of the same hash bucket */
+  struct microtcp_conn *backlog_next; /**< Next connection waiting to be accepted */
+  struct sockaddr_in peer;
+  uint16_t cid;                 /**< Connection ID the peer picked */
+  int efd;                      /**< eventfd, signalled when the ring stops being empty */
+  uint8_t *pkts[MICROTCP_DEMUX_QUEUE_LEN]; /**< Ring of datagrams, in buffers of the listener pool */
+  uint16_t lens[MICROTCP_DEMUX_QUEUE_LEN];
+  int head;                     /**< Oldest datagram of the ring */
+  int count;                    /**< Datagrams in the ring */
+  int taken;                    /**< The oldest one was handed out and is still in use */
+  int handshake;                /**< Its datagrams wake up the listener, which answers its SYN */
+  uint64_t dropped;             /**< Datagrams that found the ring full, or the pool empty */
+};
+
+/**
+ * The owner of a port shared by many connections. Whichever thread
+ * needs datagrams reads the port and sorts what it got into the rings of
+ * their connections, waking up the threads that wait for them.
+ */
+struct microtcp_listener
+{
+  microtcp_sock_t sock;         /**< The listening socket, its batches read the port */
+  pthread_mutex_t lock;         /**< Guards everything below and the rings */
+  struct microtcp_conn **buckets; /**< Connections by peer address, port and ID */
+  size_t nbuckets;              /**< Size of buckets, a power of 2 */
+  size_t nconns;                /**< Connections in buckets */
+  struct microtcp_conn *backlog_head; /**< Oldest connection waiting to be accepted */
+  struct microtcp_conn *backlog_tail;
+  int backlog;                  /**< Connections waiting to be accepted */
+  int backlog_max;
+  int efd;                      /**< eventfd, signalled when a connection joins the backlog */
+  struct microtcp_pool *pool;   /**< Buffers of the datagrams queued to all connections */
+  uint64_t dropped;             /**< Datagrams of no connection, or SYNs past the backlog */
+};
+
+/**
+ * Creates a listener on the port of a bound socket. The listener takes
+ * over its descriptor and batches.
+ *
+ * @return the listener or NULL on failure
+ */
+struct microtcp_listener *
+microtcp_demux_new (const microtcp_sock_t *socket, int backlog);
+
+/**
+ * Frees the listener and the connections still waiting to be accepted.
+ * Those accepted must have been closed already.
+ */
+void
+microtcp_demux_free (struct microtcp_listener *listener);
+
+/**
+ * Waits for a connection, whose SYN is the first datagram of its ring.
+ * A datagram of a connection in the handshake ends the wait as well.
+ *
+ * @param timeout_us how long to wait in microseconds
+ * @return the connection or NULL if none arrived
+ */
+struct microtcp_conn *
+microtcp_demux_accept (struct microtcp_listener *listener, uint64_t timeout_us);
+
+/**
+ * Sets whether the datagrams of a connection also wake up whoever waits
+ * in microtcp_demux_accept(), while the handshake is not done.
+ */
+void
+microtcp_demux_handshake (struct microtcp_listener *listener,
+                          struct microtcp_conn *conn, int handshake);
+
+/**
+ * Removes a connection from the listener and frees it.
+ */
+void
+microtcp_demux_close (struct microtcp_listener *listener,
+                      struct microtcp_conn *conn);
+
+/**
+ * Returns the next datagram of a connection. It stays valid until the
+ * next call.
+ *
+ * @param timeout_us how long to wait for one in microseconds, 0 to only
+ * take what is already queued
+ * @param len pointer to store the datagram length
+ * @return the datagram or NULL if none arrived
+ */
+uint8_t *
+microtcp_demux_next (struct microtcp_listener *listener,
+                     struct microtcp_conn *conn, uint64_t timeout_us,
+                     ssize_t *len);
+
+/**
+ * Sorts one batch of the datagrams the port has into the rings of their
+ * connections, without waiting.
+ */
+void
+microtcp_demux_read (struct microtcp_listener *listener);
+
+/**
+ * @return the number of connections waiting to be accepted
+ */
+int
+microtcp_demux_backlog (struct microtcp_listener *listener);
+
+/**
+ * @return TRUE if datagrams of the connection are queued
+ */
+int
+microtcp_demux_pending (struct microtcp_listener *listener,
+                        struct microtcp_conn *conn);
+
+/**
+ * Waits until a datagram of the connection arrives or the timeout
+ * expires.
+ *
+ * @param timeout_us the timeout in microseconds
+ * @return 1 if a datagram is waiting or 0 on timeout
+ */
+int
+microtcp_demux_wait (struct microtcp_listener *listener,
+                     struct microtcp_conn *conn, uint64_t timeout_us);
+
+#endif /* LIB_MICROTCP_DEMUX_H_ */
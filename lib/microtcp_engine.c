@@ -0,0 +1,236 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sched.h>
+#include "microtcp_engine.h"
+#include "microtcp_io.h"
+#include "microtcp_timer.h"
+
+/*
+ * Give back the socket and buffers microtcp_socket() made for a
+ * listener that never got to listen
+ */
+static void
+shard_close(struct microtcp_shard *shard)
+{
+  microtcp_io_free(&shard->listener);
+  microtcp_timer_wheel_free(shard->listener.timers);
+  shard->listener.timers = NULL;
+  close(shard->listener.sd);
+}
+
+/*
+ * Set up a shard, in its own thread
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int
+shard_start(struct microtcp_shard *shard)
+{
+  struct microtcp_engine *engine = shard->engine;
+  int one = 1;
+
+  shard->loop = microtcp_loop_new();
+  if(shard->loop == NULL)
+    return -1;
+
+  // Every shard binds the same address, the kernel picks one per flow
+  shard->listener = microtcp_socket(engine->address.ss_family, SOCK_DGRAM, 0);
+  if(setsockopt(shard->listener.sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1 ||
+     bind(shard->listener.sd, (struct sockaddr *)&engine->address, engine->address_len) == -1){
+    perror("microtcp engine bind");
+    shard_close(shard);
+    return -1;
+  }
+  shard->listener.state = LISTEN;
+  if(microtcp_listen(&shard->listener, engine->backlog) == -1){
+    shard_close(shard);
+    return -1;
+  }
+  shard->listening = TRUE;
+  return engine->init(shard->loop, &shard->listener, shard->index, engine->arg);
+}
+
+static void *
+shard_run(void *arg)
+{
+  struct microtcp_shard_handle *handle = arg;
+  struct microtcp_engine *engine = handle->engine;
+  struct microtcp_shard *shard;
+  cpu_set_t set;
+  int sd, failed, cpu = engine->cpus[handle->index];
+
+  // Pinned before anything is allocated, so that the pages of the shard
+  // are first touched on the NUMA node of its CPU
+  if(cpu >= 0){
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      cpu = -1;
+  }
+
+  // The shards set up in parallel, and the init callback of the
+  // application may call into the engine, so not under the lock
+  shard = calloc(1, sizeof(struct microtcp_shard));
+  failed = shard == NULL;
+  if(!failed){
+    shard->engine = engine;
+    shard->index = handle->index;
+    shard->cpu = cpu;
+    failed = shard_start(shard) == -1;
+  }
+
+  // Wait until every shard listens, so that the kernel spreads flows over all of them
+  pthread_mutex_lock(&engine->lock);
+  if(failed)
+    engine->failed = TRUE;
+  engine->ready++;
+  pthread_cond_broadcast(&engine->cond);
+  while(!engine->go)
+    pthread_cond_wait(&engine->cond, &engine->lock);
+  pthread_mutex_unlock(&engine->lock);
+
+  if(shard == NULL)
+    return NULL;
+  if(!engine->failed){
+    while(!__atomic_load_n(&engine->stop, __ATOMIC_ACQUIRE)){
+      if(microtcp_poll(shard->loop, MICROTCP_ENGINE_POLL_MS) == -1){
+        perror("microtcp engine poll");
+        break;
+      }
+    }
+  }
+
+  if(shard->loop != NULL)
+    microtcp_loop_free(shard->loop);
+  if(shard->listening){
+    sd = shard->listener.sd;
+    microtcp_shutdown(&shard->listener, SHUT_RDWR);
+    close(sd);
+  }
+  free(shard);
+  return NULL;
+}
+
+/*
+ * Spread the shards over the CPUs we may run on
+ */
+static int
+engine_cpus(struct microtcp_engine *engine, int shards)
+{
+  int allowed[CPU_SETSIZE];
+  cpu_set_t set;
+  int cpu, n = 0, i;
+
+  if(sched_getaffinity(0, sizeof(set), &set) == 0){
+    for(cpu = 0; cpu < CPU_SETSIZE; cpu++){
+      if(CPU_ISSET(cpu, &set))
+        allowed[n++] = cpu;
+    }
+  }
+  if(shards <= 0)
+    shards = n > 0 ? n : 1;
+  engine->cpus = malloc(shards * sizeof(int));
+  if(engine->cpus == NULL)
+    return -1;
+
+  // More shards than CPUs share them round robin
+  for(i = 0; i < shards; i++)
+    engine->cpus[i] = n > 0 ? allowed[i % n] : -1;
+  return shards;
+}
+
+microtcp_engine_t *
+microtcp_engine_new (const struct sockaddr *address, socklen_t address_len,
+                     int shards, int backlog, microtcp_shard_fn init, void *arg)
+{
+  struct microtcp_engine *engine;
+  int i;
+
+  if(address_len > sizeof(struct sockaddr_storage) || init == NULL)
+    return NULL;
+  engine = calloc(1, sizeof(struct microtcp_engine));
+  if(engine == NULL)
+    return NULL;
+  memcpy(&engine->address, address, address_len);
+  engine->address_len = address_len;
+  engine->backlog = backlog;
+  engine->init = init;
+  engine->arg = arg;
+  pthread_mutex_init(&engine->lock, NULL);
+  pthread_cond_init(&engine->cond, NULL);
+  engine->nshards = engine_cpus(engine, shards);
+  if(engine->nshards == -1){
+    microtcp_engine_free(engine);
+    return NULL;
+  }
+  engine->threads = calloc(engine->nshards, sizeof(pthread_t));
+  engine->handles = calloc(engine->nshards, sizeof(struct microtcp_shard_handle));
+  if(engine->threads == NULL || engine->handles == NULL){
+    microtcp_engine_free(engine);
+    return NULL;
+  }
+
+  // Each thread allocates its shard itself, once pinned to its CPU
+  for(i = 0; i < engine->nshards; i++){
+    engine->handles[i].engine = engine;
+    engine->handles[i].index = i;
+    if(pthread_create(&engine->threads[i], NULL, shard_run, &engine->handles[i]) != 0)
+      break;
+    engine->started++;
+  }
+
+  pthread_mutex_lock(&engine->lock);
+  if(engine->started < engine->nshards)
+    engine->failed = TRUE;
+  while(engine->ready < engine->started)
+    pthread_cond_wait(&engine->cond, &engine->lock);
+  engine->go = TRUE;
+  pthread_cond_broadcast(&engine->cond);
+  pthread_mutex_unlock(&engine->lock);
+
+  if(engine->failed){
+    microtcp_engine_free(engine);
+    return NULL;
+  }
+  return engine;
+}
+
+int
+microtcp_engine_shards (microtcp_engine_t *engine)
+{
+  return engine->nshards;
+}
+
+void
+microtcp_engine_free (microtcp_engine_t *engine)
+{
+  int i;
+
+  __atomic_store_n(&engine->stop, TRUE, __ATOMIC_RELEASE);
+  for(i = 0; i < engine->started; i++)
+    pthread_join(engine->threads[i], NULL);
+  pthread_mutex_destroy(&engine->lock);
+  pthread_cond_destroy(&engine->cond);
+  free(engine->threads);
+  free(engine->handles);
+  free(engine->cpus);
+  free(engine);
+}
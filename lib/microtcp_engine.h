@@ -0,0 +1,70 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_ENGINE_H_
+#define LIB_MICROTCP_ENGINE_H_
+
+#include <pthread.h>
+#include "microtcp.h"
+
+/**
+ * A thread of an engine and everything it owns. It is allocated by the
+ * thread itself, on the NUMA node of its CPU.
+ */
+struct microtcp_shard
+{
+  struct microtcp_engine *engine;
+  int index;
+  int cpu;                      /**< The CPU it is pinned to, -1 if not pinned */
+  microtcp_loop_t *loop;
+  microtcp_sock_t listener;     /**< Bound with SO_REUSEPORT to the address of the engine */
+  int listening;
+};
+
+/**
+ * What the engine keeps of a shard, whose thread allocates the rest
+ */
+struct microtcp_shard_handle
+{
+  struct microtcp_engine *engine;
+  int index;
+};
+
+struct microtcp_engine
+{
+  struct sockaddr_storage address;
+  socklen_t address_len;
+  int backlog;
+  microtcp_shard_fn init;
+  void *arg;
+  int nshards;
+  int *cpus;                    /**< CPU of each shard */
+  pthread_t *threads;
+  struct microtcp_shard_handle *handles; /**< One per shard, the argument of its thread */
+  int started;                  /**< Threads created */
+  pthread_mutex_t lock;         /**< Guards the start up below */
+  pthread_cond_t cond;
+  int ready;                    /**< Shards that listen, or gave up */
+  int failed;                   /**< Some shard could not start */
+  int go;                       /**< Every shard is ready, they may poll */
+  int stop;                     /**< Set once to make the shards return */
+};
+
+#endif /* LIB_MICROTCP_ENGINE_H_ */
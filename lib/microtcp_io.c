@@ -0,0 +1,467 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include "microtcp_io.h"
+#include "microtcp_demux.h"
+#include "microtcp_uring.h"
+
+static int
+rx_alloc (microtcp_sock_t *socket, int slots, size_t slot_len)
+{
+  struct microtcp_rx_batch *rx = socket->rx;
+  uint8_t *pkts;
+
+  // io_uring receives into buffers of its own, and always has some
+  // more of them than a batch takes
+  if(socket->uring != NULL){
+    if(microtcp_uring_rx_buffers(socket->uring,
+                                 slot_len > MICROTCP_PKT_LEN ? MICROTCP_URING_GRO_BUFS : MICROTCP_URING_BUFS,
+                                 slot_len, MICROTCP_RX_CMSG_LEN) == -1)
+      return -1;
+    free(rx->pkts);
+    rx->pkts = NULL;
+  }
+  else{
+    pkts = malloc(slots * slot_len);
+    if(pkts == NULL)
+      return -1;
+    free(rx->pkts);
+    rx->pkts = pkts;
+  }
+  rx->slots = slots;
+  rx->slot_len = slot_len;
+  return 0;
+}
+
+/*
+ * Gives up on io_uring for sendmmsg() and recvmmsg()
+ */
+static int
+uring_fallback (microtcp_sock_t *socket)
+{
+  if(DEBUG) printf("io_uring unavailable (%s), falling back to sendmmsg/recvmmsg\n",
+                   strerror(errno));
+  microtcp_uring_free(socket->uring);
+  socket->uring = NULL;
+  socket->io_backend = MICROTCP_IO_MMSG;
+  if(socket->rx == NULL)
+    return 0;
+  return rx_alloc(socket, socket->rx->slots, socket->rx->slot_len);
+}
+
+int
+microtcp_io_init (microtcp_sock_t *socket)
+{
+  int sqpoll;
+
+  socket->tx = calloc(1, sizeof(struct microtcp_tx_batch));
+  socket->rx = NULL;
+  socket->uring = NULL;
+  if(socket->tx == NULL)
+    return -1;
+
+  // Connections of a listener receive through the listener
+  if(socket->conn != NULL){
+    socket->io_backend = MICROTCP_IO_MMSG;
+    return 0;
+  }
+  socket->rx = calloc(1, sizeof(struct microtcp_rx_batch));
+  if(socket->rx == NULL){
+    microtcp_io_free(socket);
+    return -1;
+  }
+
+  // The rings, or whatever of them the kernel has
+  if(socket->io_backend != MICROTCP_IO_MMSG){
+    sqpoll = socket->io_backend == MICROTCP_IO_URING_SQPOLL;
+    socket->uring = microtcp_uring_new(socket->sd, &sqpoll);
+    if(socket->uring == NULL)
+      socket->io_backend = MICROTCP_IO_MMSG;
+    else if(!sqpoll)
+      socket->io_backend = MICROTCP_IO_URING;
+  }
+  if(rx_alloc(socket, MICROTCP_BATCH_LEN, MICROTCP_PKT_LEN) < 0 &&
+     (socket->uring == NULL || uring_fallback(socket) < 0)){
+    microtcp_io_free(socket);
+    return -1;
+  }
+  return 0;
+}
+
+void
+microtcp_io_free (microtcp_sock_t *socket)
+{
+  free(socket->tx);
+  if(socket->rx != NULL)
+    free(socket->rx->pkts);
+  free(socket->rx);
+  microtcp_uring_free(socket->uring);
+  socket->tx = NULL;
+  socket->rx = NULL;
+  socket->uring = NULL;
+}
+
+microtcp_header_t *
+microtcp_io_tx_header (microtcp_sock_t *socket)
+{
+  if(socket->tx->count == MICROTCP_BATCH_LEN)
+    microtcp_io_flush(socket);
+  return &socket->tx->hdrs[socket->tx->count];
+}
+
+void
+microtcp_io_tx_commit (microtcp_sock_t *socket, const struct iovec *payload,
+                       int iovcnt)
+{
+  struct microtcp_tx_batch *tx = socket->tx;
+  struct msghdr *hdr = &tx->msgs[tx->count].msg_hdr;
+  struct iovec *iov = &tx->iovs[tx->iov_count];
+  size_t len = sizeof(microtcp_header_t);
+  int i;
+
+  // Header first, then the payload straight from where it lives
+  iov[0].iov_base = &tx->hdrs[tx->count];
+  iov[0].iov_len = sizeof(microtcp_header_t);
+  for(i = 0; i < iovcnt; i++){
+    iov[i + 1] = payload[i];
+    len += payload[i].iov_len;
+  }
+
+  // A connected socket already knows its peer
+  memset(hdr, 0, sizeof(struct msghdr));
+  if(!socket->connected){
+    hdr->msg_name = &socket->address;
+    hdr->msg_namelen = socket->address_len;
+  }
+  hdr->msg_iov = iov;
+  hdr->msg_iovlen = iovcnt + 1;
+
+  tx->lens[tx->count] = len;
+  tx->iov_count += iovcnt + 1;
+  tx->count++;
+  socket->packets_send++;
+  socket->bytes_send += len;
+}
+
+void
+microtcp_io_tx_time (microtcp_sock_t *socket, uint64_t at_us)
+{
+  struct microtcp_tx_batch *tx = socket->tx;
+  struct msghdr *hdr = &tx->msgs[tx->count - 1].msg_hdr;
+  struct cmsghdr *cmsg;
+  uint64_t at_ns = at_us * 1000;
+
+  hdr->msg_control = tx->cmsgs[tx->count - 1];
+  hdr->msg_controllen = MICROTCP_TXTIME_CMSG_LEN;
+  cmsg = CMSG_FIRSTHDR(hdr);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TXTIME;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+  memcpy(CMSG_DATA(cmsg), &at_ns, sizeof(uint64_t));
+}
+
+int
+microtcp_io_set_offload (microtcp_sock_t *socket, int enable)
+{
+  int on = enable ? 1 : 0;
+  int gso_size = MICROTCP_PKT_LEN;
+  int slots = enable ? MICROTCP_GRO_BATCH_LEN : MICROTCP_BATCH_LEN;
+  size_t slot_len = enable ? MICROTCP_GRO_SLOT_LEN : MICROTCP_PKT_LEN;
+
+  if(socket->gso == on && socket->gro == on)
+    return 0;
+  if(socket->rx == NULL)
+    return -1;
+
+  // Probe GSO with a socket wide size, then drop it again. Every run of
+  // packets carries its own size instead.
+  if(enable){
+    if(setsockopt(socket->sd, SOL_UDP, UDP_SEGMENT, &gso_size,
+                  sizeof(gso_size)) < 0)
+      return -1;
+    gso_size = 0;
+    setsockopt(socket->sd, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size));
+  }
+  if(setsockopt(socket->sd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0)
+    return -1;
+  if(rx_alloc(socket, slots, slot_len) < 0){
+    on = 0;
+    setsockopt(socket->sd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+    return -1;
+  }
+  socket->gso = on;
+  socket->gro = on;
+  return 0;
+}
+
+/*
+ * Builds the messages for the packets from first onwards. With GSO, runs
+ * of packets of the same length share one message; the last one of a run
+ * may be shorter. Packets with a departure time always go alone, since
+ * the kernel would release the whole run at once.
+ */
+static int
+tx_group (microtcp_sock_t *socket, int first)
+{
+  struct microtcp_tx_batch *tx = socket->tx;
+  struct cmsghdr *cmsg;
+  struct msghdr *hdr;
+  uint16_t gso_size;
+  size_t total;
+  int n = 0, i, j;
+
+  for(i = first; i < tx->count; i = j){
+    tx->out[n] = tx->msgs[i];
+    hdr = &tx->out[n].msg_hdr;
+    total = tx->lens[i];
+    j = i + 1;
+    if(socket->gso && hdr->msg_controllen == 0){
+      while(j < tx->count && j - i < MICROTCP_GSO_MAX_SEGS
+            && tx->msgs[j].msg_hdr.msg_controllen == 0
+            && tx->lens[j] <= tx->lens[i]
+            && tx->lens[j - 1] == tx->lens[i]
+            && total + tx->lens[j] <= MICROTCP_GSO_MAX_LEN){
+        hdr->msg_iovlen += tx->msgs[j].msg_hdr.msg_iovlen;
+        total += tx->lens[j];
+        j++;
+      }
+      if(j - i > 1){
+        gso_size = tx->lens[i];
+        hdr->msg_control = tx->gso_cmsgs[n];
+        hdr->msg_controllen = MICROTCP_GSO_CMSG_LEN;
+        cmsg = CMSG_FIRSTHDR(hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(uint16_t));
+      }
+    }
+    tx->out_pkts[n++] = j - i;
+  }
+  return n;
+}
+
+int
+microtcp_io_flush (microtcp_sock_t *socket)
+{
+  struct microtcp_tx_batch *tx = socket->tx;
+  int sent = 0, done = 0, n, ret, i;
+
+  n = tx_group(socket, 0);
+  while(done < n){
+    if(socket->uring != NULL){
+      ret = microtcp_uring_send(socket->uring, tx->out + done, n - done, &socket->syscalls);
+    }
+    else{
+      ret = sendmmsg(socket->sd, tx->out + done, n - done, 0);
+      socket->syscalls++;
+    }
+    if(ret < 0){
+      if(errno == EIO && socket->gso){
+        // The device cannot segment, fall back to one packet a message
+        socket->gso = FALSE;
+        n = tx_group(socket, sent);
+        done = 0;
+        continue;
+      }
+      perror(socket->uring != NULL ? "io_uring sendmsg" : "sendmmsg");
+      break;
+    }
+    for(i = done; i < done + ret; i++)
+      sent += tx->out_pkts[i];
+    done += ret;
+  }
+  tx->count = 0;
+  tx->iov_count = 0;
+  return sent;
+}
+
+/*
+ * The size of the datagrams GRO coalesced into a message, or 0 when it
+ * holds only one.
+ */
+static size_t
+rx_gro_size (struct msghdr *hdr)
+{
+  struct cmsghdr *cmsg;
+  int size;
+
+  for(cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)){
+    if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO){
+      memcpy(&size, CMSG_DATA(cmsg), sizeof(int));
+      return size;
+    }
+  }
+  return 0;
+}
+
+uint8_t *
+microtcp_io_rx_next (microtcp_sock_t *socket, int flags, ssize_t *len)
+{
+  struct microtcp_rx_batch *rx = socket->rx;
+  uint8_t *pkt;
+  size_t msg_len;
+  int i, ret;
+
+  if(socket->conn != NULL){
+    if(socket->tx->count > 0 && !microtcp_demux_pending(socket->listener, socket->conn))
+      microtcp_io_flush(socket);
+    return microtcp_demux_next(socket->listener, socket->conn,
+                               flags & MSG_DONTWAIT ? 0 : MICROTCP_ACK_TIMEOUT_US, len);
+  }
+
+  if(rx->next == rx->count){
+    // Nothing left, push out our packets before waiting for new ones
+    if(socket->tx->count > 0)
+      microtcp_io_flush(socket);
+
+    for(i = 0; i < rx->slots; i++){
+      rx->iovs[i].iov_base = rx->pkts != NULL ? rx->pkts + i * rx->slot_len : NULL;
+      rx->iovs[i].iov_len = rx->slot_len;
+      memset(&rx->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+      rx->msgs[i].msg_hdr.msg_name = &rx->addrs[i];
+      rx->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      rx->msgs[i].msg_hdr.msg_iov = &rx->iovs[i];
+      rx->msgs[i].msg_hdr.msg_iovlen = 1;
+      if(socket->rx_timestamps || socket->gro){
+        rx->msgs[i].msg_hdr.msg_control = rx->cmsgs[i];
+        rx->msgs[i].msg_hdr.msg_controllen = MICROTCP_RX_CMSG_LEN;
+      }
+    }
+
+    rx->next = 0;
+    rx->count = 0;
+    if(socket->uring != NULL){
+      ret = microtcp_uring_recv(socket->uring, rx->msgs, rx->slots,
+                                flags & MSG_DONTWAIT ? 0 : MICROTCP_ACK_TIMEOUT_US,
+                                &socket->syscalls);
+      if(ret < 0)
+        return uring_fallback(socket) == 0 ? microtcp_io_rx_next(socket, flags, len) : NULL;
+    }
+    else{
+      ret = recvmmsg(socket->sd, rx->msgs, rx->slots, flags, NULL);
+      socket->syscalls++;
+    }
+    if(ret <= 0)
+      return NULL;
+    rx->count = ret;
+    rx->off = 0;
+    rx->seg_len = socket->gro ? rx_gro_size(&rx->msgs[0].msg_hdr) : 0;
+  }
+
+  // Hand out a coalesced message one datagram at a time
+  msg_len = rx->msgs[rx->next].msg_len;
+  pkt = (uint8_t *)rx->iovs[rx->next].iov_base + rx->off;
+  rx->last = rx->next;
+  if(rx->seg_len > 0 && msg_len - rx->off > rx->seg_len){
+    *len = rx->seg_len;
+    rx->off += rx->seg_len;
+    return pkt;
+  }
+  *len = msg_len - rx->off;
+  rx->off = 0;
+  if(++rx->next < rx->count && socket->gro)
+    rx->seg_len = rx_gro_size(&rx->msgs[rx->next].msg_hdr);
+  return pkt;
+}
+
+int
+microtcp_io_rx_pending (microtcp_sock_t *socket)
+{
+  if(socket->conn != NULL)
+    return microtcp_demux_pending(socket->listener, socket->conn);
+  return socket->rx->next < socket->rx->count;
+}
+
+const struct sockaddr_in *
+microtcp_io_rx_addr (microtcp_sock_t *socket)
+{
+  if(socket->conn != NULL)
+    return &socket->conn->peer;
+  return &socket->rx->addrs[socket->rx->last];
+}
+
+uint64_t
+microtcp_io_rx_delay (microtcp_sock_t *socket)
+{
+  struct msghdr *hdr;
+  struct cmsghdr *cmsg;
+  struct scm_timestamping stamps;
+  struct timespec now;
+  int64_t delay;
+
+  if(!socket->rx_timestamps || socket->rx == NULL || socket->rx->count == 0)
+    return 0;
+
+  hdr = &socket->rx->msgs[socket->rx->last].msg_hdr;
+  for(cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)){
+    if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+      continue;
+
+    // The software stamp comes first, in the realtime clock
+    memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+    if(stamps.ts[0].tv_sec == 0 && stamps.ts[0].tv_nsec == 0)
+      return 0;
+    clock_gettime(CLOCK_REALTIME, &now);
+    delay = (int64_t)(now.tv_sec - stamps.ts[0].tv_sec) * 1000000 +
+            (now.tv_nsec - stamps.ts[0].tv_nsec) / 1000;
+    return delay > 0 ? delay : 0;
+  }
+  return 0;
+}
+
+int
+microtcp_io_wait (microtcp_sock_t *socket, uint64_t timeout_us)
+{
+  struct pollfd pfd;
+  struct timespec ts;
+  int ret;
+
+  if(socket->conn != NULL)
+    return microtcp_demux_wait(socket->listener, socket->conn, timeout_us);
+  if(socket->uring != NULL){
+    ret = microtcp_uring_wait(socket->uring, timeout_us, &socket->syscalls);
+    if(ret >= 0 || uring_fallback(socket) < 0)
+      return ret;
+  }
+
+  pfd.fd = socket->sd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  ts.tv_sec = timeout_us / 1000000;
+  ts.tv_nsec = (timeout_us % 1000000) * 1000;
+  socket->syscalls++;
+  return ppoll(&pfd, 1, &ts, NULL);
+}
+
+int
+microtcp_io_fd (microtcp_sock_t *socket)
+{
+  int fd;
+
+  if(socket->uring != NULL){
+    fd = microtcp_uring_fd(socket->uring, &socket->syscalls);
+    if(fd >= 0 || uring_fallback(socket) < 0)
+      return fd;
+  }
+  return socket->sd;
+}
@@ -0,0 +1,202 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_IO_H_
+#define LIB_MICROTCP_IO_H_
+
+#include <linux/errqueue.h>
+#include <netinet/udp.h>
+#include "microtcp.h"
+
+/*
+ * Batched datagram I/O
+ */
+#define MICROTCP_BATCH_LEN 64
+#define MICROTCP_PKT_LEN (sizeof(microtcp_header_t) + MICROTCP_MSS)
+#define MICROTCP_IOV_MAX 3 /* Header and a payload that may wrap around the send ring */
+#define MICROTCP_CMSG_LEN CMSG_SPACE(sizeof(struct scm_timestamping))
+#define MICROTCP_TXTIME_CMSG_LEN CMSG_SPACE(sizeof(uint64_t))
+#define MICROTCP_GSO_CMSG_LEN CMSG_SPACE(sizeof(uint16_t))
+#define MICROTCP_RX_CMSG_LEN (MICROTCP_CMSG_LEN + CMSG_SPACE(sizeof(int)))
+
+/*
+ * Segmentation offload. GSO hands the kernel up to MICROTCP_GSO_MAX_LEN
+ * bytes of equal-sized packets at once, GRO hands us back as many
+ * coalesced, so receive slots must be that large.
+ */
+#define MICROTCP_GSO_MAX_LEN 65000
+#define MICROTCP_GSO_MAX_SEGS 64
+#define MICROTCP_GRO_SLOT_LEN 65536
+#define MICROTCP_GRO_BATCH_LEN 16
+
+/**
+ * Packets waiting to be sent with a single sendmmsg() call. Each one is
+ * gathered from its header and pointers to the payload, which is never
+ * staged in a bounce buffer. The pieces of consecutive packets are
+ * consecutive in iovs, so that a run of them can go out as one GSO
+ * message.
+ */
+struct microtcp_tx_batch
+{
+  struct mmsghdr msgs[MICROTCP_BATCH_LEN];
+  struct iovec iovs[MICROTCP_BATCH_LEN * MICROTCP_IOV_MAX];
+  microtcp_header_t hdrs[MICROTCP_BATCH_LEN];
+  size_t lens[MICROTCP_BATCH_LEN]; /**< Length of each packet */
+  uint8_t cmsgs[MICROTCP_BATCH_LEN][MICROTCP_TXTIME_CMSG_LEN]; /**< Departure times for SO_TXTIME */
+  struct mmsghdr out[MICROTCP_BATCH_LEN]; /**< The messages handed to sendmmsg() */
+  int out_pkts[MICROTCP_BATCH_LEN]; /**< Packets each message carries */
+  uint8_t gso_cmsgs[MICROTCP_BATCH_LEN][MICROTCP_GSO_CMSG_LEN]; /**< Segment sizes for GSO */
+  int count;                    /**< Packets in the batch */
+  int iov_count;                /**< Pieces in use in iovs */
+};
+
+/**
+ * Datagrams received with a single recvmmsg() call, or taken from the
+ * io_uring receive ring, whose buffers the iovecs then point to. With
+ * GRO, a message may hold several datagrams of the same size back to
+ * back.
+ */
+struct microtcp_rx_batch
+{
+  struct mmsghdr msgs[MICROTCP_BATCH_LEN];
+  struct iovec iovs[MICROTCP_BATCH_LEN];
+  uint8_t *pkts;                /**< Receive slots, slot_len bytes each, NULL with io_uring */
+  size_t slot_len;
+  int slots;
+  uint8_t cmsgs[MICROTCP_BATCH_LEN][MICROTCP_RX_CMSG_LEN]; /**< Receive timestamps and GRO sizes */
+  struct sockaddr_in addrs[MICROTCP_BATCH_LEN]; /**< Where each message came from */
+  int count;                    /**< Messages in the batch */
+  int next;                     /**< Message holding the next datagram to hand out */
+  size_t off;                   /**< Offset of the next datagram in its message */
+  size_t seg_len;               /**< Size of the datagrams coalesced in message next */
+  int last;                     /**< Message of the datagram handed out last */
+};
+
+int
+microtcp_io_init (microtcp_sock_t *socket);
+
+void
+microtcp_io_free (microtcp_sock_t *socket);
+
+/**
+ * Returns the header of the next packet of the transmit batch. The batch
+ * is flushed first if it is full.
+ */
+microtcp_header_t *
+microtcp_io_tx_header (microtcp_sock_t *socket);
+
+/**
+ * Queues the packet whose header was filled in last for transmission.
+ * The payload is referenced, not copied, so it must stay untouched until
+ * the batch is flushed.
+ *
+ * @param payload the pieces of the payload
+ * @param iovcnt the number of pieces, at most MICROTCP_IOV_MAX - 1
+ */
+void
+microtcp_io_tx_commit (microtcp_sock_t *socket, const struct iovec *payload,
+                       int iovcnt);
+
+/**
+ * Holds the packet committed last in the kernel until the given time.
+ * The socket must have SO_TXTIME enabled.
+ *
+ * @param at_us the departure time in microseconds of CLOCK_MONOTONIC
+ */
+void
+microtcp_io_tx_time (microtcp_sock_t *socket, uint64_t at_us);
+
+/**
+ * Enables or disables UDP segmentation offload, GSO for the packets we
+ * send and GRO for those we receive. Call it before any traffic.
+ *
+ * @param enable TRUE to enable, FALSE to disable
+ * @return 0 on success or -1 if the kernel lacks either of them, in
+ * which case both stay off
+ */
+int
+microtcp_io_set_offload (microtcp_sock_t *socket, int enable);
+
+/**
+ * Sends every queued packet.
+ *
+ * @return the number of packets sent or -1 on failure
+ */
+int
+microtcp_io_flush (microtcp_sock_t *socket);
+
+/**
+ * Returns the next received datagram. When the receive batch is
+ * exhausted, pending packets are flushed and the batch is refilled with
+ * whatever the socket has queued. A connection of a listener takes its
+ * datagrams from the queue the listener fills instead.
+ *
+ * @param flags MSG_WAITFORONE to block (up to the socket timeout) or
+ * MSG_DONTWAIT to only take what is already queued
+ * @param len pointer to store the datagram length
+ * @return the datagram or NULL if none arrived
+ */
+uint8_t *
+microtcp_io_rx_next (microtcp_sock_t *socket, int flags, ssize_t *len);
+
+/**
+ * @return TRUE if datagrams of the last batch are still to be handed out
+ */
+int
+microtcp_io_rx_pending (microtcp_sock_t *socket);
+
+/**
+ * @return the address the datagram last handed out by
+ * microtcp_io_rx_next() came from
+ */
+const struct sockaddr_in *
+microtcp_io_rx_addr (microtcp_sock_t *socket);
+
+/**
+ * Returns how long the datagram last handed out by microtcp_io_rx_next()
+ * waited in the socket, from the software timestamp the kernel took when
+ * it arrived. Receive timestamps have to be enabled with
+ * microtcp_set_rx_timestamps(). Connections of a listener have none.
+ *
+ * @return the delay in microseconds, 0 if the datagram has no timestamp
+ */
+uint64_t
+microtcp_io_rx_delay (microtcp_sock_t *socket);
+
+/**
+ * Waits until a datagram arrives or the timeout expires.
+ *
+ * @param timeout_us the timeout in microseconds
+ * @return 1 if a datagram is waiting, 0 on timeout or -1 on failure
+ */
+int
+microtcp_io_wait (microtcp_sock_t *socket, uint64_t timeout_us);
+
+/**
+ * Returns the descriptor to poll for the datagrams of the socket: the
+ * UDP socket itself, or the receive ring of io_uring, which takes them
+ * out of the socket as they arrive. Not for connections of a listener.
+ *
+ * @return the descriptor or -1 on failure
+ */
+int
+microtcp_io_fd (microtcp_sock_t *socket);
+
+#endif /* LIB_MICROTCP_IO_H_ */
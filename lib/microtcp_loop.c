@@ -0,0 +1,416 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "microtcp_loop.h"
+#include "microtcp_demux.h"
+
+/*
+ * Reset an eventfd or a timerfd
+ */
+static inline void
+fd_clear(int fd)
+{
+  uint64_t count;
+  if(read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("microtcp loop");
+}
+
+/*
+ * Put a socket on the list of the next round, once
+ */
+static void
+entry_queue(struct microtcp_loop_entry *entry)
+{
+  if(entry->ready)
+    return;
+  entry->ready = TRUE;
+  entry->ready_next = entry->loop->ready;
+  entry->loop->ready = entry;
+}
+
+/*
+ * Watch the port of a listener, if no other socket of the loop does yet
+ */
+static struct microtcp_loop_port *
+port_get(struct microtcp_loop *loop, struct microtcp_listener *listener)
+{
+  struct microtcp_loop_port *port;
+  struct epoll_event ev;
+
+  for(port = loop->ports; port != NULL; port = port->next){
+    if(port->listener == listener){
+      port->refs++;
+      return port;
+    }
+  }
+
+  port = calloc(1, sizeof(struct microtcp_loop_port));
+  if(port == NULL)
+    return NULL;
+  port->type = MICROTCP_LOOP_PORT;
+  port->listener = listener;
+  port->refs = 1;
+  ev.events = EPOLLIN;
+  ev.data.ptr = port;
+  port->fd = microtcp_io_fd(&listener->sock);
+  if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, port->fd, &ev) == -1){
+    free(port);
+    return NULL;
+  }
+  port->next = loop->ports;
+  loop->ports = port;
+  return port;
+}
+
+static void
+port_put(struct microtcp_loop *loop, struct microtcp_loop_port *port)
+{
+  struct microtcp_loop_port **link;
+
+  if(--port->refs > 0)
+    return;
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, port->fd, NULL);
+  for(link = &loop->ports; *link != port; link = &(*link)->next)
+    ;
+  *link = port->next;
+  free(port);
+}
+
+/*
+ * Let a socket catch up and call it back if it is ready
+ *
+ * @return 1 if it was called back
+ */
+static int
+entry_run(struct microtcp_loop_entry *entry)
+{
+  microtcp_sock_t *socket = entry->socket;
+  int events, called = 0;
+
+  microtcp_service(socket);
+  events = microtcp_ready(socket) & entry->events;
+  if(events != 0){
+    entry->fn(socket, events, entry->arg);
+    called = 1;
+
+    // Maybe it was closed, and so removed
+    if(entry->socket == NULL)
+      return called;
+  }
+
+  // Level triggered, what the callback left is reported again
+  if(microtcp_ready(socket) & entry->events)
+    entry_queue(entry);
+  return called;
+}
+
+/*
+ * Sleep on the timerfd until the first timer of the wheel
+ */
+static void
+timer_update(struct microtcp_loop *loop)
+{
+  struct itimerspec its;
+  uint64_t next = microtcp_timer_next(loop->timers);
+
+  if(next == loop->tfd_us)
+    return;
+  memset(&its, 0, sizeof(its));
+  if(next != UINT64_MAX){
+    its.it_value.tv_sec = next / 1000000;
+    its.it_value.tv_nsec = (next % 1000000) * 1000;
+
+    // All zeros would disarm it
+    if(next == 0)
+      its.it_value.tv_nsec = 1;
+  }
+  if(timerfd_settime(loop->tfd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+    loop->tfd_us = next;
+}
+
+microtcp_loop_t *
+microtcp_loop_new (void)
+{
+  struct microtcp_loop *loop = calloc(1, sizeof(struct microtcp_loop));
+  struct epoll_event ev;
+
+  if(loop == NULL)
+    return NULL;
+  loop->type = MICROTCP_LOOP_TIMER;
+  loop->wake_type = MICROTCP_LOOP_WAKE;
+  loop->tfd_us = UINT64_MAX;
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  loop->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  loop->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  loop->timers = microtcp_timer_wheel_new(microtcp_now_us());
+  if(loop->epfd < 0 || loop->tfd < 0 || loop->wfd < 0 || loop->timers == NULL){
+    microtcp_loop_free(loop);
+    return NULL;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &loop->type;
+  if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->tfd, &ev) == -1){
+    microtcp_loop_free(loop);
+    return NULL;
+  }
+  ev.data.ptr = &loop->wake_type;
+  if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wfd, &ev) == -1){
+    microtcp_loop_free(loop);
+    return NULL;
+  }
+  return loop;
+}
+
+void
+microtcp_loop_free (microtcp_loop_t *loop)
+{
+  struct microtcp_loop_entry *entry, *next;
+  struct microtcp_loop_port *port, *next_port;
+
+  // Sockets still in the loop go back to standing alone
+  for(entry = loop->entries; entry != NULL; entry = next){
+    next = entry->all_next;
+    microtcp_move_timers(entry->socket, entry->own_timers);
+    entry->socket->loop_entry = NULL;
+    entry->socket = NULL;
+    if(!entry->ready)
+      free(entry);
+  }
+  for(entry = loop->ready; entry != NULL; entry = next){
+    next = entry->ready_next;
+    free(entry);
+  }
+  for(port = loop->ports; port != NULL; port = next_port){
+    next_port = port->next;
+    free(port);
+  }
+  if(loop->epfd >= 0)
+    close(loop->epfd);
+  if(loop->tfd >= 0)
+    close(loop->tfd);
+  if(loop->wfd >= 0)
+    close(loop->wfd);
+  microtcp_timer_wheel_free(loop->timers);
+  free(loop);
+}
+
+int
+microtcp_loop_add (microtcp_loop_t *loop, microtcp_sock_t *socket, int events,
+                   microtcp_event_fn fn, void *arg)
+{
+  struct microtcp_loop_entry *entry;
+  struct epoll_event ev;
+
+  if(socket->loop_entry != NULL || fn == NULL)
+    return -1;
+  entry = calloc(1, sizeof(struct microtcp_loop_entry));
+  if(entry == NULL)
+    return -1;
+  entry->type = MICROTCP_LOOP_SOCKET;
+  entry->loop = loop;
+  entry->socket = socket;
+  entry->events = events;
+  entry->fn = fn;
+  entry->arg = arg;
+
+  /*
+   * A socket of a listener doesn't read the port itself. The loop does,
+   * and waits on the eventfd the listener signals for it.
+   */
+  if(socket->listener != NULL){
+    entry->port = port_get(loop, socket->listener);
+    if(entry->port == NULL){
+      free(entry);
+      return -1;
+    }
+    entry->fd = socket->conn != NULL ? socket->conn->efd : socket->listener->efd;
+  }
+  else{
+    entry->fd = microtcp_io_fd(socket);
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = entry;
+  if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, entry->fd, &ev) == -1){
+    if(entry->port != NULL)
+      port_put(loop, entry->port);
+    free(entry);
+    return -1;
+  }
+
+  // Its timers expire with those of every other socket of the loop
+  entry->own_timers = socket->timers;
+  microtcp_move_timers(socket, loop->timers);
+  socket->nonblocking = TRUE;
+  socket->loop_entry = entry;
+  entry->all_next = loop->entries;
+  if(loop->entries != NULL)
+    loop->entries->all_prev = &entry->all_next;
+  entry->all_prev = &loop->entries;
+  loop->entries = entry;
+
+  // It may be ready already
+  entry_queue(entry);
+  return 0;
+}
+
+int
+microtcp_loop_modify (microtcp_loop_t *loop, microtcp_sock_t *socket, int events)
+{
+  struct microtcp_loop_entry *entry = socket->loop_entry;
+
+  if(entry == NULL || entry->loop != loop)
+    return -1;
+  entry->events = events;
+  entry_queue(entry);
+  return 0;
+}
+
+int
+microtcp_loop_del (microtcp_loop_t *loop, microtcp_sock_t *socket)
+{
+  struct microtcp_loop_entry *entry = socket->loop_entry;
+
+  if(entry == NULL || entry->loop != loop)
+    return -1;
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, entry->fd, NULL);
+  microtcp_move_timers(socket, entry->own_timers);
+  if(entry->port != NULL)
+    port_put(loop, entry->port);
+  *entry->all_prev = entry->all_next;
+  if(entry->all_next != NULL)
+    entry->all_next->all_prev = entry->all_prev;
+  socket->loop_entry = NULL;
+  entry->socket = NULL;
+
+  // microtcp_poll() may be walking the ready list or running the
+  // callback of the entry, it frees it there
+  if(!entry->ready && !entry->running)
+    free(entry);
+  return 0;
+}
+
+microtcp_loop_t *
+microtcp_loop_of (microtcp_sock_t *socket)
+{
+  return socket->loop_entry != NULL ? socket->loop_entry->loop : NULL;
+}
+
+void
+microtcp_loop_wake (microtcp_loop_t *loop)
+{
+  uint64_t one = 1;
+  if(write(loop->wfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("microtcp loop");
+}
+
+void
+microtcp_loop_touch (microtcp_sock_t *socket)
+{
+  if(socket->loop_entry != NULL)
+    entry_queue(socket->loop_entry);
+}
+
+/*
+ * Takes the epoll events
+ *
+ * @return TRUE if a port was read, which may have signalled more sockets
+ */
+static int
+loop_events(struct microtcp_loop *loop, struct epoll_event *ev, int n)
+{
+  struct microtcp_loop_entry *entry;
+  struct microtcp_loop_port *port;
+  int i, ports = FALSE;
+
+  for(i = 0; i < n; i++){
+    switch(*(int *)ev[i].data.ptr){
+    case MICROTCP_LOOP_SOCKET:
+      entry = ev[i].data.ptr;
+      if(entry->port != NULL)
+        fd_clear(entry->fd);
+      entry_queue(entry);
+      break;
+    case MICROTCP_LOOP_PORT:
+      port = ev[i].data.ptr;
+      microtcp_demux_read(port->listener);
+      ports = TRUE;
+      break;
+    case MICROTCP_LOOP_TIMER:
+      fd_clear(loop->tfd);
+      loop->tfd_us = UINT64_MAX;
+      microtcp_timer_run(loop->timers, microtcp_now_us());
+      break;
+    case MICROTCP_LOOP_WAKE:
+      fd_clear(loop->wfd);
+      break;
+    }
+  }
+  return ports;
+}
+
+int
+microtcp_poll (microtcp_loop_t *loop, int timeout_ms)
+{
+  struct epoll_event ev[MICROTCP_LOOP_EVENTS];
+  struct microtcp_loop_entry *entry, *list;
+  int n, calls = 0;
+
+  microtcp_timer_run(loop->timers, microtcp_now_us());
+  timer_update(loop);
+
+  n = epoll_wait(loop->epfd, ev, MICROTCP_LOOP_EVENTS,
+                 loop->ready != NULL ? 0 : timeout_ms);
+  if(n < 0){
+    if(errno != EINTR)
+      return -1;
+    n = 0;
+  }
+
+  // Datagrams read from a port are queued to eventfds polled right away
+  if(loop_events(loop, ev, n)){
+    n = epoll_wait(loop->epfd, ev, MICROTCP_LOOP_EVENTS, 0);
+    if(n > 0)
+      loop_events(loop, ev, n);
+  }
+
+  list = loop->ready;
+  loop->ready = NULL;
+  while(list != NULL){
+    entry = list;
+    list = entry->ready_next;
+    entry->ready = FALSE;
+    if(entry->socket == NULL){
+      free(entry);
+      continue;
+    }
+    entry->running = TRUE;
+    calls += entry_run(entry);
+    entry->running = FALSE;
+
+    // Removed by its callback
+    if(entry->socket == NULL && !entry->ready)
+      free(entry);
+  }
+  return calls;
+}
@@ -0,0 +1,116 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_LOOP_H_
+#define LIB_MICROTCP_LOOP_H_
+
+#include "microtcp.h"
+
+#define MICROTCP_LOOP_EVENTS 64 /* epoll events taken per system call */
+
+/*
+ * What an epoll event of the loop stands for
+ */
+#define MICROTCP_LOOP_SOCKET 0
+#define MICROTCP_LOOP_PORT 1
+#define MICROTCP_LOOP_TIMER 2
+#define MICROTCP_LOOP_WAKE 3
+
+/**
+ * A socket in an event loop
+ */
+struct microtcp_loop_entry
+{
+  int type;                     /**< MICROTCP_LOOP_SOCKET, first like in every epoll source */
+  struct microtcp_loop *loop;
+  microtcp_sock_t *socket;      /**< NULL once removed, until the entry leaves the ready list and its callback */
+  int events;                   /**< MICROTCP_POLL* events to report */
+  microtcp_event_fn fn;
+  void *arg;
+  int fd;                       /**< What epoll watches, the socket (see microtcp_io_fd()) or an eventfd of the listener */
+  struct microtcp_loop_port *port; /**< The port of the listener it was accepted from, if any */
+  struct microtcp_timer_wheel *own_timers; /**< Where the timers of the socket go back to when it leaves */
+  struct microtcp_loop_entry *ready_next;
+  int ready;                    /**< On the ready list */
+  int running;                  /**< Its callback is running, which may remove it */
+  struct microtcp_loop_entry *all_next; /**< Every entry of the loop, while in it */
+  struct microtcp_loop_entry **all_prev;
+};
+
+/**
+ * The port of a listener, read by the loop for every connection of the
+ * listener in it
+ */
+struct microtcp_loop_port
+{
+  int type;                     /**< MICROTCP_LOOP_PORT */
+  struct microtcp_listener *listener;
+  int fd;                       /**< What epoll watches, see microtcp_io_fd() */
+  int refs;                     /**< Entries of the loop on this port */
+  struct microtcp_loop_port *next;
+};
+
+struct microtcp_loop
+{
+  int epfd;
+  int type;                     /**< MICROTCP_LOOP_TIMER, the epoll source of tfd */
+  int tfd;                      /**< timerfd, armed at the next deadline of timers */
+  uint64_t tfd_us;              /**< When tfd fires, UINT64_MAX if disarmed */
+  int wake_type;                /**< MICROTCP_LOOP_WAKE, the epoll source of wfd */
+  int wfd;                      /**< eventfd, signalled by microtcp_loop_wake() */
+  struct microtcp_timer_wheel *timers; /**< The timers of every socket of the loop */
+  struct microtcp_loop_port *ports;
+  struct microtcp_loop_entry *entries;
+  struct microtcp_loop_entry *ready; /**< Sockets to look at in the next round */
+};
+
+/**
+ * Marks a socket of a loop to be looked at in the next round, after the
+ * application changed its state outside of the loop.
+ */
+void
+microtcp_loop_touch (microtcp_sock_t *socket);
+
+/*
+ * Implemented in microtcp.c
+ */
+
+/**
+ * Does whatever a socket has to do without waiting: takes the datagrams
+ * that arrived, acts on the timers that expired and flushes what that
+ * queued.
+ */
+void
+microtcp_service (microtcp_sock_t *socket);
+
+/**
+ * Moves the armed timers of a socket to another wheel, where the socket
+ * arms them from then on.
+ */
+void
+microtcp_move_timers (microtcp_sock_t *socket, struct microtcp_timer_wheel *wheel);
+
+/**
+ * @return the MICROTCP_POLL* events the socket is ready for
+ */
+int
+microtcp_ready (microtcp_sock_t *socket);
+
+#endif /* LIB_MICROTCP_LOOP_H_ */
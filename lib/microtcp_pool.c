@@ -0,0 +1,148 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "microtcp_pool.h"
+
+#define POOL_LINE 64
+#define POOL_HUGE_PAGE (2 << 20)
+
+/*
+ * Maps len bytes, from huge pages if the system has some reserved, or
+ * else asking for transparent ones
+ */
+static uint8_t *
+pool_map(size_t *len, int *huge_pages)
+{
+  uint8_t *mem;
+  size_t huge_len = (*len + POOL_HUGE_PAGE - 1) & ~(size_t)(POOL_HUGE_PAGE - 1);
+
+  *huge_pages = FALSE;
+#if MICROTCP_POOL_HUGE_PAGES
+  mem = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if(mem != MAP_FAILED){
+    *len = huge_len;
+    *huge_pages = TRUE;
+    return mem;
+  }
+#endif
+  mem = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(mem == MAP_FAILED)
+    return NULL;
+#if MICROTCP_POOL_HUGE_PAGES && defined(MADV_HUGEPAGE)
+  if(*len >= POOL_HUGE_PAGE)
+    madvise(mem, *len, MADV_HUGEPAGE);
+#endif
+  return mem;
+}
+
+struct microtcp_pool *
+microtcp_pool_new (size_t size, uint32_t count)
+{
+  struct microtcp_pool *pool;
+  uint32_t i;
+
+  if(count == 0)
+    return NULL;
+  if(posix_memalign((void **)&pool, POOL_LINE, sizeof(struct microtcp_pool)) != 0)
+    return NULL;
+  memset(pool, 0, sizeof(struct microtcp_pool));
+  pool->size = (size + POOL_LINE - 1) & ~(size_t)(POOL_LINE - 1);
+  pool->count = count;
+  pool->mem_len = pool->size * count;
+  pool->mem = pool_map(&pool->mem_len, &pool->huge_pages);
+  pool->next = malloc(count * sizeof(uint32_t));
+  if(pool->mem == NULL || pool->next == NULL){
+    microtcp_pool_free(pool);
+    return NULL;
+  }
+
+  // Buffer 0 on top, so that the first ones handed out are adjacent
+  for(i = 0; i < count; i++)
+    pool->next[i] = i + 2 <= count ? i + 2 : 0;
+  pool->top = 1;
+  return pool;
+}
+
+void
+microtcp_pool_free (struct microtcp_pool *pool)
+{
+  if(pool == NULL)
+    return;
+  if(pool->mem != NULL)
+    munmap(pool->mem, pool->mem_len);
+  free(pool->next);
+  free(pool);
+}
+
+uint8_t *
+microtcp_pool_get (struct microtcp_pool *pool)
+{
+  uint64_t top = __atomic_load_n(&pool->top, __ATOMIC_ACQUIRE), next, used, peak;
+  uint32_t index;
+
+  do{
+    index = top & 0xffffffff;
+    if(index == 0){
+      __atomic_add_fetch(&pool->exhausted, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+    // Stale if another thread took the buffer meanwhile, but then the
+    // change count has moved on and the swap fails
+    next = ((top >> 32) + 1) << 32 | __atomic_load_n(&pool->next[index - 1], __ATOMIC_RELAXED);
+  }while(!__atomic_compare_exchange_n(&pool->top, &top, next, TRUE,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  used = __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+  peak = __atomic_load_n(&pool->peak, __ATOMIC_RELAXED);
+  while(used > peak &&
+        !__atomic_compare_exchange_n(&pool->peak, &peak, used, TRUE,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  return pool->mem + (size_t)(index - 1) * pool->size;
+}
+
+void
+microtcp_pool_put (struct microtcp_pool *pool, uint8_t *buf)
+{
+  uint32_t index = (buf - pool->mem) / pool->size + 1;
+  uint64_t top = __atomic_load_n(&pool->top, __ATOMIC_RELAXED), next;
+
+  do{
+    __atomic_store_n(&pool->next[index - 1], (uint32_t)(top & 0xffffffff), __ATOMIC_RELAXED);
+    next = ((top >> 32) + 1) << 32 | index;
+  }while(!__atomic_compare_exchange_n(&pool->top, &top, next, TRUE,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  __atomic_sub_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+}
+
+void
+microtcp_pool_get_stats (struct microtcp_pool *pool, microtcp_pool_stats_t *stats)
+{
+  stats->size = pool->count;
+  stats->buffer_len = pool->size;
+  stats->in_use = __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED);
+  stats->peak = __atomic_load_n(&pool->peak, __ATOMIC_RELAXED);
+  stats->exhausted = __atomic_load_n(&pool->exhausted, __ATOMIC_RELAXED);
+  stats->huge_pages = pool->huge_pages;
+}
@@ -0,0 +1,79 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_POOL_H_
+#define LIB_MICROTCP_POOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "microtcp.h"
+
+/**
+ * A fixed number of equal buffers, cut out of one mapping and aligned to
+ * cache lines. Free buffers form a stack that any thread may push to or
+ * pop from without a lock: its head packs the index of the top buffer
+ * with a count of the changes, so that a buffer popped and pushed back
+ * in between cannot fool a compare-and-swap. The most recently freed
+ * buffer, the one most likely still in the cache, is handed out first.
+ *
+ * Pages are touched only when their buffers first are, so a pool costs
+ * memory as it is used, up to its bound.
+ */
+struct microtcp_pool
+{
+  uint64_t top __attribute__((aligned(64))); /**< Changes << 32 | index + 1 of the top free buffer, 0 if none */
+  uint32_t *next;               /**< The free buffer under each one, as index + 1 */
+  uint8_t *mem;
+  size_t mem_len;
+  size_t size;                  /**< Bytes of a buffer, a multiple of the cache line */
+  uint32_t count;
+  int huge_pages;               /**< Backed by huge pages */
+  uint64_t in_use __attribute__((aligned(64))); /**< Buffers handed out */
+  uint64_t peak;                /**< The most ever handed out at once */
+  uint64_t exhausted;           /**< Times none was left */
+};
+
+/**
+ * @param size the bytes every buffer holds
+ * @param count how many buffers, which bounds the memory of the pool
+ * @return the pool or NULL if out of memory
+ */
+struct microtcp_pool *
+microtcp_pool_new (size_t size, uint32_t count);
+
+/**
+ * Frees the pool. Its buffers must all have been put back.
+ */
+void
+microtcp_pool_free (struct microtcp_pool *pool);
+
+/**
+ * @return a buffer or NULL if all are in use
+ */
+uint8_t *
+microtcp_pool_get (struct microtcp_pool *pool);
+
+void
+microtcp_pool_put (struct microtcp_pool *pool, uint8_t *buf);
+
+void
+microtcp_pool_get_stats (struct microtcp_pool *pool, microtcp_pool_stats_t *stats);
+
+#endif /* LIB_MICROTCP_POOL_H_ */
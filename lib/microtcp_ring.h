@@ -0,0 +1,113 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_RING_H_
+#define LIB_MICROTCP_RING_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Lock-free ring of 64-bit entries between one producer and one
+ * consumer thread. Each side writes only its own index, on a cache line
+ * of its own.
+ *
+ * A push tells whether the ring was empty right before it, which is
+ * when a consumer may be asleep waiting for it. The producer publishes
+ * the entry before it looks at the consumer index, and the consumer
+ * publishes its index before it looks at the producer one, so one of
+ * the two always sees the other: either the consumer finds the entry
+ * before it goes to sleep, or the producer knows to wake it up.
+ */
+struct microtcp_ring
+{
+  uint64_t *slots;
+  uint32_t mask;                /**< Size - 1, the size is a power of 2 */
+  uint32_t head __attribute__((aligned(64))); /**< Next entry to push, written by the producer */
+  uint32_t tail __attribute__((aligned(64))); /**< Next entry to pop, written by the consumer */
+};
+
+/**
+ * @param size a power of 2
+ * @return 0 on success or -1 if out of memory
+ */
+static inline int
+microtcp_ring_init (struct microtcp_ring *ring, uint32_t size)
+{
+  ring->slots = calloc(size, sizeof(uint64_t));
+  ring->mask = size - 1;
+  ring->head = 0;
+  ring->tail = 0;
+  return ring->slots != NULL ? 0 : -1;
+}
+
+static inline void
+microtcp_ring_free (struct microtcp_ring *ring)
+{
+  free(ring->slots);
+  ring->slots = NULL;
+}
+
+/**
+ * Producer side.
+ *
+ * @return 1 if the ring was empty, 0 if not, -1 if it is full
+ */
+static inline int
+microtcp_ring_push (struct microtcp_ring *ring, uint64_t entry)
+{
+  uint32_t head = ring->head;
+
+  if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask)
+    return -1;
+  ring->slots[head & ring->mask] = entry;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head;
+}
+
+/**
+ * Consumer side.
+ *
+ * @return 1 if an entry was taken, 0 if the ring is empty
+ */
+static inline int
+microtcp_ring_pop (struct microtcp_ring *ring, uint64_t *entry)
+{
+  uint32_t tail = ring->tail;
+
+  if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail)
+    return 0;
+  *entry = ring->slots[tail & ring->mask];
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+/**
+ * Consumer side.
+ *
+ * @return TRUE if there is nothing to pop
+ */
+static inline int
+microtcp_ring_empty (struct microtcp_ring *ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail;
+}
+
+#endif /* LIB_MICROTCP_RING_H_ */
@@ -0,0 +1,342 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "microtcp_thread.h"
+#include "microtcp_loop.h"
+
+/*
+ * The socket the calling thread runs the protocol of, if it is a
+ * protocol thread
+ */
+static __thread microtcp_sock_t *protocol_socket;
+
+static inline void
+efd_signal(int efd)
+{
+  uint64_t one = 1;
+  if(write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("microtcp thread");
+}
+
+static inline void
+efd_wait(int efd)
+{
+  uint64_t count;
+  if(read(efd, &count, sizeof(count)) < 0 && errno != EINTR)
+    perror("microtcp thread");
+}
+
+int
+microtcp_thread_redirect (microtcp_sock_t *socket)
+{
+  return socket->thread != NULL && protocol_socket != socket;
+}
+
+/*
+ * Tell the application no more data comes, once
+ */
+static void
+proto_rx_end(struct microtcp_thread *t)
+{
+  if(t->rx_ended)
+    return;
+  t->rx_ended = TRUE;
+  if(microtcp_ring_push(&t->rx, MICROTCP_THREAD_DESC(MICROTCP_THREAD_END, 0)) == 1)
+    efd_signal(t->rx_efd);
+}
+
+/*
+ * Move data between the rings and the socket, as far as either lets
+ */
+static void
+proto_io(struct microtcp_thread *t)
+{
+  microtcp_sock_t *socket = t->socket;
+  uint32_t index, len;
+  uint8_t *buf;
+  ssize_t n;
+  int events;
+
+  // What the application queued, into the send buffer
+  while(!t->done){
+    if(!t->tx_busy){
+      if(!microtcp_ring_pop(&t->tx, &t->tx_desc))
+        break;
+      if(MICROTCP_THREAD_INDEX(t->tx_desc) == MICROTCP_THREAD_END){
+        t->done = TRUE;
+        return;
+      }
+      t->tx_busy = TRUE;
+      t->tx_off = 0;
+    }
+    index = MICROTCP_THREAD_INDEX(t->tx_desc);
+    len = MICROTCP_THREAD_LEN(t->tx_desc);
+    buf = t->tx_bufs + (size_t)index * MICROTCP_THREAD_BUF_LEN;
+    n = microtcp_send(socket, buf + t->tx_off, len - t->tx_off, 0);
+    if(n <= 0)
+      break;
+    t->tx_off += n;
+    if(t->tx_off < len)
+      break;
+    t->tx_busy = FALSE;
+    if(microtcp_ring_push(&t->tx_free, MICROTCP_THREAD_DESC(index, 0)) == 1)
+      efd_signal(t->tx_efd);
+  }
+
+  // What arrived, out to the application
+  while(!t->done){
+    if(!t->rx_held){
+      if(!microtcp_ring_pop(&t->rx_free, &t->rx_desc))
+        break;
+      t->rx_held = TRUE;
+    }
+    index = MICROTCP_THREAD_INDEX(t->rx_desc);
+    buf = t->rx_bufs + (size_t)index * MICROTCP_THREAD_BUF_LEN;
+    n = microtcp_recv(socket, buf, MICROTCP_THREAD_BUF_LEN, 0);
+    if(n == -1 && errno == EAGAIN)
+      break;
+
+    // The peer closed, the socket is released
+    if(n <= 0){
+      proto_rx_end(t);
+      t->done = TRUE;
+      return;
+    }
+    t->rx_held = FALSE;
+    if(microtcp_ring_push(&t->rx, MICROTCP_THREAD_DESC(index, n)) == 1)
+      efd_signal(t->rx_efd);
+  }
+
+  // Wake up for room in the send buffer only with data waiting for it,
+  // and for received data only with a buffer to put it in
+  events = (t->tx_busy ? MICROTCP_POLLOUT : 0) |
+           (t->rx_held || !microtcp_ring_empty(&t->rx_free) ? MICROTCP_POLLIN : 0);
+  if(events != t->events && socket->loop_entry != NULL){
+    microtcp_loop_modify(t->loop, socket, events);
+    t->events = events;
+  }
+}
+
+static void
+proto_event(microtcp_sock_t *socket, int events, void *arg)
+{
+  (void)socket;
+  (void)events;
+  proto_io(arg);
+}
+
+static void *
+proto_run(void *arg)
+{
+  struct microtcp_thread *t = arg;
+  microtcp_sock_t *socket = t->socket;
+
+  protocol_socket = socket;
+  while(!t->done){
+    proto_io(t);
+    if(!t->done && microtcp_poll(t->loop, -1) == -1){
+      perror("microtcp protocol thread");
+      break;
+    }
+  }
+
+  // The application closes, once what it queued is delivered
+  if(socket->state != CLOSED){
+    microtcp_loop_del(t->loop, socket);
+    t->result = microtcp_shutdown(socket, SHUT_RDWR);
+  }
+
+  // Also when the loop failed, or a reader would wait for it forever
+  proto_rx_end(t);
+
+  __atomic_store_n(&t->exited, TRUE, __ATOMIC_RELEASE);
+  efd_signal(t->tx_efd);
+  efd_signal(t->rx_efd);
+  return NULL;
+}
+
+static void
+thread_free(struct microtcp_thread *t)
+{
+  if(t->loop != NULL)
+    microtcp_loop_free(t->loop);
+  if(t->tx_efd >= 0)
+    close(t->tx_efd);
+  if(t->rx_efd >= 0)
+    close(t->rx_efd);
+  microtcp_ring_free(&t->tx);
+  microtcp_ring_free(&t->tx_free);
+  microtcp_ring_free(&t->rx);
+  microtcp_ring_free(&t->rx_free);
+  free(t->tx_bufs);
+  free(t->rx_bufs);
+  free(t);
+}
+
+int
+microtcp_thread_start (microtcp_sock_t *socket)
+{
+  struct microtcp_thread *t;
+  uint32_t i;
+
+  if(socket->thread != NULL || socket->loop_entry != NULL || socket->state != ESTABLISHED)
+    return -1;
+  t = calloc(1, sizeof(struct microtcp_thread));
+  if(t == NULL)
+    return -1;
+  t->socket = socket;
+  t->nonblocking = socket->nonblocking;
+  t->tx_efd = eventfd(0, EFD_CLOEXEC);
+  t->rx_efd = eventfd(0, EFD_CLOEXEC);
+  t->tx_bufs = aligned_alloc(64, MICROTCP_THREAD_BUFS * MICROTCP_THREAD_BUF_LEN);
+  t->rx_bufs = aligned_alloc(64, MICROTCP_THREAD_BUFS * MICROTCP_THREAD_BUF_LEN);
+  t->loop = microtcp_loop_new();
+
+  // Room for every buffer and the end mark on the way in
+  if(t->tx_efd < 0 || t->rx_efd < 0 || t->tx_bufs == NULL || t->rx_bufs == NULL ||
+     t->loop == NULL ||
+     microtcp_ring_init(&t->tx, 2 * MICROTCP_THREAD_BUFS) == -1 ||
+     microtcp_ring_init(&t->tx_free, MICROTCP_THREAD_BUFS) == -1 ||
+     microtcp_ring_init(&t->rx, 2 * MICROTCP_THREAD_BUFS) == -1 ||
+     microtcp_ring_init(&t->rx_free, MICROTCP_THREAD_BUFS) == -1){
+    thread_free(t);
+    return -1;
+  }
+  for(i = 0; i < MICROTCP_THREAD_BUFS; i++){
+    microtcp_ring_push(&t->tx_free, MICROTCP_THREAD_DESC(i, 0));
+    microtcp_ring_push(&t->rx_free, MICROTCP_THREAD_DESC(i, 0));
+  }
+
+  t->events = MICROTCP_POLLIN;
+  if(microtcp_loop_add(t->loop, socket, t->events, proto_event, t) == -1){
+    thread_free(t);
+    return -1;
+  }
+  socket->thread = t;
+  if(pthread_create(&t->tid, NULL, proto_run, t) != 0){
+    socket->thread = NULL;
+    microtcp_loop_del(t->loop, socket);
+    socket->nonblocking = t->nonblocking;
+    thread_free(t);
+    return -1;
+  }
+  return 0;
+}
+
+ssize_t
+microtcp_thread_send (microtcp_sock_t *socket, const void *buffer, size_t length)
+{
+  struct microtcp_thread *t = socket->thread;
+  size_t copied = 0, n;
+  uint64_t desc;
+  uint32_t index;
+
+  while(copied < length){
+    if(!microtcp_ring_pop(&t->tx_free, &desc)){
+      if(__atomic_load_n(&t->exited, __ATOMIC_ACQUIRE)){
+        errno = EPIPE;
+        break;
+      }
+      if(t->nonblocking){
+        errno = EAGAIN;
+        break;
+      }
+      efd_wait(t->tx_efd);
+      continue;
+    }
+
+    index = MICROTCP_THREAD_INDEX(desc);
+    n = length - copied < MICROTCP_THREAD_BUF_LEN ? length - copied : MICROTCP_THREAD_BUF_LEN;
+    memcpy(t->tx_bufs + (size_t)index * MICROTCP_THREAD_BUF_LEN, (const uint8_t *)buffer + copied, n);
+    if(microtcp_ring_push(&t->tx, MICROTCP_THREAD_DESC(index, n)) == 1)
+      microtcp_loop_wake(t->loop);
+    copied += n;
+  }
+  return copied > 0 || length == 0 ? (ssize_t)copied : -1;
+}
+
+ssize_t
+microtcp_thread_recv (microtcp_sock_t *socket, void *buffer, size_t length)
+{
+  struct microtcp_thread *t = socket->thread;
+  size_t copied = 0, n;
+  uint32_t index, len;
+
+  while(copied < length){
+    if(!t->app_busy){
+      // Hand out what we have rather than wait for more
+      if(!microtcp_ring_pop(&t->rx, &t->app_desc)){
+        if(copied > 0)
+          break;
+        if(t->nonblocking){
+          errno = EAGAIN;
+          return -1;
+        }
+        efd_wait(t->rx_efd);
+        continue;
+      }
+      t->app_busy = TRUE;
+      t->app_off = 0;
+    }
+
+    // The connection is closed, and the thread done
+    if(MICROTCP_THREAD_INDEX(t->app_desc) == MICROTCP_THREAD_END){
+      if(copied > 0)
+        break;
+      microtcp_thread_stop(socket);
+      errno = ENOTCONN;
+      return -1;
+    }
+
+    index = MICROTCP_THREAD_INDEX(t->app_desc);
+    len = MICROTCP_THREAD_LEN(t->app_desc);
+    n = length - copied < len - t->app_off ? length - copied : len - t->app_off;
+    memcpy((uint8_t *)buffer + copied,
+           t->rx_bufs + (size_t)index * MICROTCP_THREAD_BUF_LEN + t->app_off, n);
+    copied += n;
+    t->app_off += n;
+    if(t->app_off == len){
+      t->app_busy = FALSE;
+      if(microtcp_ring_push(&t->rx_free, MICROTCP_THREAD_DESC(index, 0)) == 1)
+        microtcp_loop_wake(t->loop);
+    }
+  }
+  return copied;
+}
+
+int
+microtcp_thread_stop (microtcp_sock_t *socket)
+{
+  struct microtcp_thread *t = socket->thread;
+  int result;
+
+  // After everything queued so far, the ring has room for it
+  microtcp_ring_push(&t->tx, MICROTCP_THREAD_DESC(MICROTCP_THREAD_END, 0));
+  microtcp_loop_wake(t->loop);
+  pthread_join(t->tid, NULL);
+
+  result = t->result;
+  socket->thread = NULL;
+  socket->nonblocking = t->nonblocking;
+  thread_free(t);
+  return result;
+}
@@ -0,0 +1,97 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_THREAD_H_
+#define LIB_MICROTCP_THREAD_H_
+
+#include <pthread.h>
+#include "microtcp.h"
+#include "microtcp_ring.h"
+
+/*
+ * An entry of the rings names a buffer of its direction and the bytes
+ * in it. The index past the last buffer marks the end: the application
+ * closes, or the peer did.
+ */
+#define MICROTCP_THREAD_DESC(index, len) ((uint64_t)(index) << 32 | (uint32_t)(len))
+#define MICROTCP_THREAD_INDEX(desc) ((uint32_t)((desc) >> 32))
+#define MICROTCP_THREAD_LEN(desc) ((uint32_t)(desc))
+#define MICROTCP_THREAD_END MICROTCP_THREAD_BUFS
+
+/**
+ * The protocol thread of a socket and the rings to and from it. Each
+ * ring has one side in each thread. The application sleeps on an
+ * eventfd, the protocol thread in the event loop.
+ */
+struct microtcp_thread
+{
+  microtcp_sock_t *socket;
+  pthread_t tid;
+  microtcp_loop_t *loop;        /**< Of the protocol thread, with the socket alone */
+  uint8_t *tx_bufs;             /**< MICROTCP_THREAD_BUFS buffers of data to send */
+  uint8_t *rx_bufs;             /**< MICROTCP_THREAD_BUFS buffers of received data */
+  struct microtcp_ring tx;      /**< Data to send, to the protocol thread */
+  struct microtcp_ring tx_free; /**< Sent buffers, back to the application */
+  struct microtcp_ring rx;      /**< Received data, to the application */
+  struct microtcp_ring rx_free; /**< Read buffers, back to the protocol thread */
+  int tx_efd;                   /**< eventfd, signalled when tx_free stops being empty */
+  int rx_efd;                   /**< eventfd, signalled when rx stops being empty */
+  int exited;                   /**< The protocol thread returned, or is about to */
+  int result;                   /**< What its microtcp_shutdown() returned */
+
+  /* Protocol thread side */
+  uint64_t tx_desc;             /**< Buffer being queued to the socket */
+  uint32_t tx_off;
+  int tx_busy;
+  uint64_t rx_desc;             /**< Free buffer the next data goes to */
+  int rx_held;
+  int rx_ended;                 /**< The end mark is on rx */
+  int events;                   /**< MICROTCP_POLL* events asked of the loop */
+  int done;
+
+  /* Application side */
+  int nonblocking;              /**< Of the calls of the application */
+  uint64_t app_desc;            /**< Buffer being read */
+  uint32_t app_off;
+  int app_busy;
+};
+
+/**
+ * @return TRUE if the calls on the socket go through its protocol
+ * thread, which is when it has one and this is not it
+ */
+int
+microtcp_thread_redirect (microtcp_sock_t *socket);
+
+ssize_t
+microtcp_thread_send (microtcp_sock_t *socket, const void *buffer, size_t length);
+
+ssize_t
+microtcp_thread_recv (microtcp_sock_t *socket, void *buffer, size_t length);
+
+/**
+ * Tells the protocol thread to close, waits for it and frees it.
+ *
+ * @return what microtcp_shutdown() returned in the thread
+ */
+int
+microtcp_thread_stop (microtcp_sock_t *socket);
+
+#endif /* LIB_MICROTCP_THREAD_H_ */
@@ -0,0 +1,198 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include "microtcp_timer.h"
+
+#define LEVEL_SHIFT(level) ((level) * MICROTCP_TIMER_SLOT_BITS)
+#define MAX_DELTA ((1ULL << LEVEL_SHIFT(MICROTCP_TIMER_LEVELS)) - 1)
+
+struct microtcp_timer_wheel *
+microtcp_timer_wheel_new (uint64_t now_us)
+{
+  struct microtcp_timer_wheel *wheel = calloc(1, sizeof(struct microtcp_timer_wheel));
+
+  if(wheel != NULL)
+    wheel->tick = now_us / MICROTCP_TIMER_TICK_US;
+  return wheel;
+}
+
+void
+microtcp_timer_wheel_free (struct microtcp_timer_wheel *wheel)
+{
+  free(wheel);
+}
+
+/*
+ * Link a timer into the slot its deadline belongs to, from where the
+ * wheel stands now
+ */
+static void
+wheel_place(struct microtcp_timer_wheel *wheel, microtcp_timer_t *timer)
+{
+  uint64_t delta;
+  microtcp_timer_t **slot;
+  int level = 0;
+
+  if(timer->expires < wheel->tick)
+    timer->expires = wheel->tick;
+  delta = timer->expires - wheel->tick;
+  if(delta > MAX_DELTA){
+    delta = MAX_DELTA;
+    timer->expires = wheel->tick + MAX_DELTA;
+  }
+  while(delta >> LEVEL_SHIFT(level + 1) != 0)
+    level++;
+
+  slot = &wheel->slots[level][(timer->expires >> LEVEL_SHIFT(level)) & (MICROTCP_TIMER_SLOTS - 1)];
+  timer->next = *slot;
+  if(timer->next != NULL)
+    timer->next->pprev = &timer->next;
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+static void
+timer_unlink(microtcp_timer_t *timer)
+{
+  *timer->pprev = timer->next;
+  if(timer->next != NULL)
+    timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+void
+microtcp_timer_arm (struct microtcp_timer_wheel *wheel, microtcp_timer_t *timer,
+                    uint64_t expires_us)
+{
+  if(microtcp_timer_pending(timer))
+    timer_unlink(timer);
+  else
+    wheel->count++;
+  timer->expires = (expires_us + MICROTCP_TIMER_TICK_US - 1) / MICROTCP_TIMER_TICK_US;
+  wheel_place(wheel, timer);
+}
+
+void
+microtcp_timer_cancel (struct microtcp_timer_wheel *wheel, microtcp_timer_t *timer)
+{
+  if(!microtcp_timer_pending(timer))
+    return;
+  timer_unlink(timer);
+  wheel->count--;
+}
+
+/*
+ * Move the timers of a slot of an upper level down to where they belong now
+ */
+static void
+wheel_cascade(struct microtcp_timer_wheel *wheel, int level)
+{
+  size_t index = (wheel->tick >> LEVEL_SHIFT(level)) & (MICROTCP_TIMER_SLOTS - 1);
+  microtcp_timer_t *timer = wheel->slots[level][index], *next;
+
+  wheel->slots[level][index] = NULL;
+  for(; timer != NULL; timer = next){
+    next = timer->next;
+    wheel_place(wheel, timer);
+  }
+}
+
+size_t
+microtcp_timer_run (struct microtcp_timer_wheel *wheel, uint64_t now_us)
+{
+  uint64_t target = now_us / MICROTCP_TIMER_TICK_US;
+  microtcp_timer_t *timer;
+  size_t index, i, fired = 0;
+  int level;
+
+  while(wheel->tick <= target){
+    // Nothing left to turn for
+    if(wheel->count == 0){
+      wheel->tick = target + 1;
+      break;
+    }
+
+    // Skip the empty slots up to the next one with timers or the end of
+    // the lap, a long sleep costs a step per lap and not per tick
+    index = wheel->tick & (MICROTCP_TIMER_SLOTS - 1);
+    if(index != 0 && wheel->slots[0][index] == NULL){
+      for(i = index + 1; i < MICROTCP_TIMER_SLOTS && wheel->slots[0][i] == NULL; i++)
+        ;
+      wheel->tick += i - index;
+      if(wheel->tick > target + 1)
+        wheel->tick = target + 1;
+      continue;
+    }
+
+    // Level 0 went around, bring the next slot of the level above down
+    for(level = 1; index == 0 && level < MICROTCP_TIMER_LEVELS; level++){
+      wheel_cascade(wheel, level);
+      index = (wheel->tick >> LEVEL_SHIFT(level)) & (MICROTCP_TIMER_SLOTS - 1);
+    }
+
+    // A callback that arms a timer again puts it into a later tick
+    index = wheel->tick & (MICROTCP_TIMER_SLOTS - 1);
+    wheel->tick++;
+    while((timer = wheel->slots[0][index]) != NULL){
+      timer_unlink(timer);
+      wheel->count--;
+      fired++;
+      timer->fn(timer);
+    }
+  }
+  return fired;
+}
+
+uint64_t
+microtcp_timer_next (const struct microtcp_timer_wheel *wheel)
+{
+  uint64_t next = UINT64_MAX, at;
+  size_t index;
+  int level, i, first;
+
+  if(wheel->count == 0)
+    return UINT64_MAX;
+
+  for(i = 0; i < MICROTCP_TIMER_SLOTS; i++){
+    if(wheel->slots[0][(wheel->tick + i) & (MICROTCP_TIMER_SLOTS - 1)] != NULL){
+      next = wheel->tick + i;
+      break;
+    }
+  }
+
+  // An upper slot turns down when the wheel reaches its start. The
+  // current one is still due if the wheel stands right at its start,
+  // otherwise it holds the timers of the next lap.
+  for(level = 1; level < MICROTCP_TIMER_LEVELS; level++){
+    index = wheel->tick >> LEVEL_SHIFT(level);
+    first = (wheel->tick & ((1ULL << LEVEL_SHIFT(level)) - 1)) != 0;
+    for(i = first; i < first + MICROTCP_TIMER_SLOTS; i++){
+      if(wheel->slots[level][(index + i) & (MICROTCP_TIMER_SLOTS - 1)] != NULL){
+        at = (index + i) << LEVEL_SHIFT(level);
+        if(at < next)
+          next = at;
+        break;
+      }
+    }
+  }
+  return next * MICROTCP_TIMER_TICK_US;
+}
@@ -0,0 +1,135 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_TIMER_H_
+#define LIB_MICROTCP_TIMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Hierarchical timer wheel. Level 0 has one slot per tick, every level
+ * above covers MICROTCP_TIMER_SLOTS slots of the one below. A timer sits
+ * in the slot of the coarsest level its deadline fits in, and is moved
+ * down a level each time the wheel turns to that slot, so arming and
+ * canceling are O(1) whatever the deadline.
+ */
+#define MICROTCP_TIMER_TICK_US 64
+#define MICROTCP_TIMER_SLOT_BITS 6
+#define MICROTCP_TIMER_SLOTS (1 << MICROTCP_TIMER_SLOT_BITS)
+#define MICROTCP_TIMER_LEVELS 4 /* Deadlines up to 64^4 ticks, about 18 minutes, ahead */
+
+/**
+ * A timer, embedded in the structure it fires for. The callback finds
+ * that structure with microtcp_container_of().
+ */
+typedef struct microtcp_timer
+{
+  struct microtcp_timer *next;  /**< Next timer of the slot */
+  struct microtcp_timer **pprev; /**< Link pointing at this timer, NULL if not armed */
+  uint64_t expires;             /**< Tick it fires at */
+  void (*fn)(struct microtcp_timer *timer); /**< Called on expiry, may arm the timer again */
+} microtcp_timer_t;
+
+struct microtcp_timer_wheel
+{
+  microtcp_timer_t *slots[MICROTCP_TIMER_LEVELS][MICROTCP_TIMER_SLOTS];
+  uint64_t tick;                /**< Next tick to expire, earlier ones are done */
+  size_t count;                 /**< Armed timers */
+};
+
+#define microtcp_container_of(ptr, type, member) \
+  ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/**
+ * @return the time in microseconds of CLOCK_MONOTONIC, the clock every
+ * timer, RTT and rate of the library is measured with
+ */
+static inline uint64_t
+microtcp_now_us (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Allocates a wheel with no timers.
+ *
+ * @param now_us the current time in microseconds, in the clock the
+ * timers are armed with
+ * @return the wheel or NULL if out of memory
+ */
+struct microtcp_timer_wheel *
+microtcp_timer_wheel_new (uint64_t now_us);
+
+void
+microtcp_timer_wheel_free (struct microtcp_timer_wheel *wheel);
+
+static inline void
+microtcp_timer_init (microtcp_timer_t *timer, void (*fn)(microtcp_timer_t *timer))
+{
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->fn = fn;
+}
+
+static inline int
+microtcp_timer_pending (const microtcp_timer_t *timer)
+{
+  return timer->pprev != NULL;
+}
+
+/**
+ * Arms a timer, or moves it if it is already armed. It fires at the
+ * first microtcp_timer_run() at or past expires_us, rounded up to a tick.
+ */
+void
+microtcp_timer_arm (struct microtcp_timer_wheel *wheel, microtcp_timer_t *timer,
+                    uint64_t expires_us);
+
+/**
+ * Disarms a timer. Does nothing if it is not armed.
+ */
+void
+microtcp_timer_cancel (struct microtcp_timer_wheel *wheel, microtcp_timer_t *timer);
+
+/**
+ * Turns the wheel up to now_us and calls every timer that expired, all
+ * of a slot at once. Empty slots are skipped over.
+ *
+ * @return the number of timers that fired
+ */
+size_t
+microtcp_timer_run (struct microtcp_timer_wheel *wheel, uint64_t now_us);
+
+/**
+ * Returns when microtcp_timer_run() next has work, to sleep until then.
+ * A deadline past level 0 is reported as the time its slot moves down a
+ * level, which is never later than the deadline itself.
+ *
+ * @return the time in microseconds or UINT64_MAX if no timer is armed
+ */
+uint64_t
+microtcp_timer_next (const struct microtcp_timer_wheel *wheel);
+
+#endif /* LIB_MICROTCP_TIMER_H_ */
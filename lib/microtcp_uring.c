@@ -0,0 +1,666 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "microtcp_uring.h"
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+
+#define URING_TX_ENTRIES 64     /* Sends submitted at once */
+#define URING_RX_ENTRIES 4      /* Only the receive is ever submitted */
+
+/* One io_uring instance, as mapped from the kernel */
+struct uring_ring
+{
+  int fd;
+  int sqpoll;
+  unsigned sq_entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_flags;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  void *cq_map;
+  size_t sq_map_len;
+  size_t cq_map_len;
+  size_t sqes_len;
+};
+
+struct microtcp_uring
+{
+  int sd;
+  struct uring_ring tx;
+  struct uring_ring rx;
+  int tx_res[URING_TX_ENTRIES]; /* Result of each send of a submission */
+  struct io_uring_buf_ring *br; /* The buffers the kernel may receive into */
+  size_t br_len;
+  uint16_t br_tail;
+  uint8_t *bufs;
+  size_t buf_len;
+  int buf_count;
+  uint16_t *held;               /* Buffers handed out by the last recv */
+  int held_count;
+  struct msghdr rx_msg;         /* Room the kernel leaves for the name and control data */
+  int armed;                    /* The multishot receive is posted */
+  int received;                 /* It received at least once */
+  int failed;                   /* The kernel refused it, errno of why */
+};
+
+static int
+uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg,
+            size_t argsz)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static void
+ring_free(struct uring_ring *r)
+{
+  if(r->sqes != NULL)
+    munmap(r->sqes, r->sqes_len);
+  if(r->cq_map != NULL && r->cq_map != r->sq_map)
+    munmap(r->cq_map, r->cq_map_len);
+  if(r->sq_map != NULL)
+    munmap(r->sq_map, r->sq_map_len);
+  if(r->fd >= 0)
+    close(r->fd);
+  memset(r, 0, sizeof(struct uring_ring));
+  r->fd = -1;
+}
+
+static int
+ring_setup(struct uring_ring *r, unsigned entries, struct io_uring_params *p)
+{
+  unsigned *array, i;
+
+  memset(r, 0, sizeof(struct uring_ring));
+  r->fd = syscall(__NR_io_uring_setup, entries, p);
+  if(r->fd < 0)
+    return -1;
+
+  // Timed waits need the extended argument of io_uring_enter()
+  if(!(p->features & IORING_FEAT_EXT_ARG)){
+    ring_free(r);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  r->sq_map_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  r->cq_map_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if(p->features & IORING_FEAT_SINGLE_MMAP){
+    if(r->cq_map_len > r->sq_map_len)
+      r->sq_map_len = r->cq_map_len;
+    r->cq_map_len = r->sq_map_len;
+  }
+  r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if(r->sq_map == MAP_FAILED){
+    r->sq_map = NULL;
+    ring_free(r);
+    return -1;
+  }
+  if(p->features & IORING_FEAT_SINGLE_MMAP){
+    r->cq_map = r->sq_map;
+  }
+  else{
+    r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if(r->cq_map == MAP_FAILED){
+      r->cq_map = NULL;
+      ring_free(r);
+      return -1;
+    }
+  }
+  r->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->sqes == MAP_FAILED){
+    r->sqes = NULL;
+    ring_free(r);
+    return -1;
+  }
+
+  r->sq_entries = p->sq_entries;
+  r->sqpoll = (p->flags & IORING_SETUP_SQPOLL) != 0;
+  r->sq_head = (unsigned *)((uint8_t *)r->sq_map + p->sq_off.head);
+  r->sq_tail = (unsigned *)((uint8_t *)r->sq_map + p->sq_off.tail);
+  r->sq_mask = (unsigned *)((uint8_t *)r->sq_map + p->sq_off.ring_mask);
+  r->sq_flags = (unsigned *)((uint8_t *)r->sq_map + p->sq_off.flags);
+  r->cq_head = (unsigned *)((uint8_t *)r->cq_map + p->cq_off.head);
+  r->cq_tail = (unsigned *)((uint8_t *)r->cq_map + p->cq_off.tail);
+  r->cq_mask = (unsigned *)((uint8_t *)r->cq_map + p->cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((uint8_t *)r->cq_map + p->cq_off.cqes);
+
+  // Entry i of the submission queue always stands for sqes[i]
+  array = (unsigned *)((uint8_t *)r->sq_map + p->sq_off.array);
+  for(i = 0; i < p->sq_entries; i++)
+    array[i] = i;
+  return 0;
+}
+
+/*
+ * The next free submission entry, cleared. It is queued by ring_push().
+ */
+static struct io_uring_sqe *
+ring_sqe(struct uring_ring *r)
+{
+  unsigned tail = *r->sq_tail;
+  struct io_uring_sqe *sqe;
+
+  if(tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+    return NULL;
+  sqe = &r->sqes[tail & *r->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+static void
+ring_push(struct uring_ring *r)
+{
+  __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Hands the queued entries to the kernel, unless a kernel thread polls
+ * for them and is awake
+ */
+static int
+ring_submit(struct uring_ring *r, unsigned n, unsigned wait, uint64_t *syscalls)
+{
+  if(r->sqpoll){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!(__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP))
+      return 0;
+    (*syscalls)++;
+    return uring_enter(r->fd, 0, 0, IORING_ENTER_SQ_WAKEUP, NULL, 0);
+  }
+  (*syscalls)++;
+  return uring_enter(r->fd, n, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+ * Sleeps until a completion arrives or timeout_us passes
+ */
+static int
+ring_wait(struct uring_ring *r, uint64_t timeout_us, uint64_t *syscalls)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+
+  ts.tv_sec = timeout_us / 1000000;
+  ts.tv_nsec = (timeout_us % 1000000) * 1000;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = (uintptr_t)&ts;
+  (*syscalls)++;
+  if(uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                 &arg, sizeof(arg)) < 0 && errno != ETIME && errno != EINTR)
+    return -1;
+  return 0;
+}
+
+struct microtcp_uring *
+microtcp_uring_new (int sd, int *sqpoll)
+{
+  struct microtcp_uring *uring;
+  struct io_uring_params p;
+
+  uring = calloc(1, sizeof(struct microtcp_uring));
+  if(uring == NULL)
+    return NULL;
+  uring->sd = sd;
+  uring->tx.fd = -1;
+  uring->rx.fd = -1;
+
+  // A kernel thread for the sends if we may have one, else plain submits
+  memset(&p, 0, sizeof(p));
+  if(*sqpoll){
+    p.flags = IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = MICROTCP_URING_SQ_IDLE_MS;
+    if(ring_setup(&uring->tx, URING_TX_ENTRIES, &p) == -1){
+      memset(&p, 0, sizeof(p));
+      *sqpoll = FALSE;
+    }
+  }
+  if(uring->tx.fd < 0 && ring_setup(&uring->tx, URING_TX_ENTRIES, &p) == -1){
+    microtcp_uring_free(uring);
+    return NULL;
+  }
+
+  // Room for a completion of every buffer, and of the receive ending
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = 2 * MICROTCP_URING_BUFS;
+  if(ring_setup(&uring->rx, URING_RX_ENTRIES, &p) == -1){
+    microtcp_uring_free(uring);
+    return NULL;
+  }
+  return uring;
+}
+
+static void
+rx_buffers_free(struct microtcp_uring *uring)
+{
+  struct io_uring_buf_reg reg;
+
+  if(uring->br != NULL){
+    memset(&reg, 0, sizeof(reg));
+    syscall(__NR_io_uring_register, uring->rx.fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(uring->br, uring->br_len);
+  }
+  free(uring->bufs);
+  free(uring->held);
+  uring->br = NULL;
+  uring->bufs = NULL;
+  uring->held = NULL;
+  uring->buf_count = 0;
+  uring->held_count = 0;
+}
+
+void
+microtcp_uring_free (struct microtcp_uring *uring)
+{
+  if(uring == NULL)
+    return;
+  rx_buffers_free(uring);
+  ring_free(&uring->tx);
+  ring_free(&uring->rx);
+  free(uring);
+}
+
+/*
+ * Gives the buffers handed out last back to the kernel
+ */
+static void
+rx_recycle(struct microtcp_uring *uring)
+{
+  int mask = uring->buf_count - 1, i;
+  struct io_uring_buf *buf;
+
+  for(i = 0; i < uring->held_count; i++){
+    buf = &uring->br->bufs[(uring->br_tail + i) & mask];
+    buf->addr = (uintptr_t)(uring->bufs + uring->held[i] * uring->buf_len);
+    buf->len = uring->buf_len;
+    buf->bid = uring->held[i];
+  }
+  uring->br_tail += uring->held_count;
+  uring->held_count = 0;
+  __atomic_store_n(&uring->br->tail, uring->br_tail, __ATOMIC_RELEASE);
+}
+
+int
+microtcp_uring_rx_buffers (struct microtcp_uring *uring, int count, size_t len,
+                           size_t control_len)
+{
+  struct io_uring_buf_reg reg;
+  struct io_uring_buf_ring *br;
+  size_t br_len = count * sizeof(struct io_uring_buf);
+  size_t buf_len = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage)
+                   + control_len + len;
+  uint8_t *bufs;
+  uint16_t *held;
+  int i;
+
+  if(uring->armed){
+    errno = EBUSY;
+    return -1;
+  }
+  if(count > MICROTCP_URING_BUFS){
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Each buffer holds the name and control data ahead of the datagram
+  buf_len = (buf_len + 63) & ~(size_t)63;
+  bufs = aligned_alloc(64, count * buf_len);
+  held = malloc(count * sizeof(uint16_t));
+  br = mmap(NULL, br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(bufs == NULL || held == NULL || br == MAP_FAILED){
+    free(bufs);
+    free(held);
+    if(br != MAP_FAILED)
+      munmap(br, br_len);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  rx_buffers_free(uring);
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)br;
+  reg.ring_entries = count;
+  reg.bgid = 0;
+  if(syscall(__NR_io_uring_register, uring->rx.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+    free(bufs);
+    free(held);
+    munmap(br, br_len);
+    return -1;
+  }
+  uring->br = br;
+  uring->br_len = br_len;
+  uring->br_tail = 0;
+  uring->bufs = bufs;
+  uring->buf_len = buf_len;
+  uring->buf_count = count;
+  uring->held = held;
+  memset(&uring->rx_msg, 0, sizeof(struct msghdr));
+  uring->rx_msg.msg_namelen = sizeof(struct sockaddr_storage);
+  uring->rx_msg.msg_controllen = control_len;
+
+  // Every buffer starts out with the kernel
+  for(i = 0; i < count; i++)
+    held[i] = i;
+  uring->held_count = count;
+  rx_recycle(uring);
+  return 0;
+}
+
+/*
+ * Posts the multishot receive, which stays posted until the buffers run
+ * out or the socket fails
+ */
+static int
+rx_arm(struct microtcp_uring *uring, uint64_t *syscalls)
+{
+  struct io_uring_sqe *sqe;
+
+  if(uring->failed){
+    errno = uring->failed;
+    return -1;
+  }
+  if(uring->armed)
+    return 0;
+  sqe = ring_sqe(&uring->rx);
+  if(sqe == NULL || uring->br == NULL){
+    errno = EBUSY;
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = uring->sd;
+  sqe->addr = (uintptr_t)&uring->rx_msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  ring_push(&uring->rx);
+  if(ring_submit(&uring->rx, 1, 0, syscalls) < 0)
+    return -1;
+  uring->armed = TRUE;
+  return 0;
+}
+
+/*
+ * Takes the completions at the head of the receive queue that carry no
+ * datagram. A kernel without multishot receives fails the first one.
+ *
+ * @return TRUE if a datagram is next
+ */
+static int
+rx_skip(struct microtcp_uring *uring)
+{
+  unsigned head = *uring->rx.cq_head;
+  struct io_uring_cqe *cqe;
+
+  while(head != __atomic_load_n(uring->rx.cq_tail, __ATOMIC_ACQUIRE)){
+    cqe = &uring->rx.cqes[head & *uring->rx.cq_mask];
+    if(cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+      break;
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+      uring->armed = FALSE;
+    if(cqe->res < 0 && !uring->received && (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP))
+      uring->failed = -cqe->res;
+    head++;
+  }
+  __atomic_store_n(uring->rx.cq_head, head, __ATOMIC_RELEASE);
+  return head != __atomic_load_n(uring->rx.cq_tail, __ATOMIC_ACQUIRE);
+}
+
+int
+microtcp_uring_send (struct microtcp_uring *uring, struct mmsghdr *msgs,
+                     unsigned int vlen, uint64_t *syscalls)
+{
+  struct uring_ring *r = &uring->tx;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  unsigned done = 0, n, got, head, i;
+  int spins;
+
+  while(done < vlen){
+    n = vlen - done < URING_TX_ENTRIES ? vlen - done : URING_TX_ENTRIES;
+    for(i = 0; i < n; i++){
+      sqe = ring_sqe(r);
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = uring->sd;
+      sqe->addr = (uintptr_t)&msgs[done + i].msg_hdr;
+      sqe->len = 1;
+      sqe->user_data = i;
+      ring_push(r);
+    }
+    if(ring_submit(r, n, n, syscalls) < 0 && errno != EINTR)
+      return done > 0 ? (int)done : -1;
+
+    // The payload lives in the send buffer, so wait until it was copied
+    for(got = 0, spins = 0; got < n; ){
+      head = *r->cq_head;
+      while(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+        cqe = &r->cqes[head & *r->cq_mask];
+        uring->tx_res[cqe->user_data] = cqe->res;
+        head++;
+        got++;
+      }
+      __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+      if(got == n)
+        break;
+      if(r->sqpoll && spins++ < MICROTCP_URING_SPIN)
+        continue;
+      (*syscalls)++;
+      if(uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        return done > 0 ? (int)done : -1;
+    }
+
+    // Like sendmmsg(), stop at the first failure
+    for(i = 0; i < n; i++){
+      if(uring->tx_res[i] < 0){
+        if(done + i > 0)
+          return done + i;
+        errno = -uring->tx_res[i];
+        return -1;
+      }
+      msgs[done + i].msg_len = uring->tx_res[i];
+    }
+    done += n;
+  }
+  return done;
+}
+
+/*
+ * Checks for a datagram, posting the receive again if it ended
+ *
+ * @return 1 if a datagram is next, 0 if not or -1 if the receive can't
+ * be posted
+ */
+static int
+rx_ready(struct microtcp_uring *uring, uint64_t *syscalls)
+{
+  int tries;
+
+  for(tries = 0; tries < 2; tries++){
+    if(rx_arm(uring, syscalls) == -1)
+      return -1;
+    if(rx_skip(uring))
+      return 1;
+    if(uring->failed){
+      errno = uring->failed;
+      return -1;
+    }
+    if(uring->armed)
+      break;
+  }
+  return 0;
+}
+
+int
+microtcp_uring_recv (struct microtcp_uring *uring, struct mmsghdr *msgs,
+                     unsigned int vlen, uint64_t timeout_us, uint64_t *syscalls)
+{
+  struct io_uring_recvmsg_out *out;
+  struct io_uring_cqe *cqe;
+  struct msghdr *hdr;
+  unsigned head, n = 0;
+  uint8_t *buf, *control;
+  uint16_t bid;
+  int ret;
+
+  rx_recycle(uring);
+  ret = rx_ready(uring, syscalls);
+  if(ret == 0 && timeout_us > 0){
+    if(ring_wait(&uring->rx, timeout_us, syscalls) == -1)
+      return -1;
+    ret = rx_ready(uring, syscalls);
+  }
+  if(ret == -1)
+    return -1;
+
+  while(n < vlen && rx_skip(uring)){
+    head = *uring->rx.cq_head;
+    cqe = &uring->rx.cqes[head & *uring->rx.cq_mask];
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+      uring->armed = FALSE;
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uring->held[uring->held_count++] = bid;
+    __atomic_store_n(uring->rx.cq_head, head + 1, __ATOMIC_RELEASE);
+
+    // The name and control data come first, as much room as we left
+    buf = uring->bufs + bid * uring->buf_len;
+    out = (struct io_uring_recvmsg_out *)buf;
+    control = buf + sizeof(struct io_uring_recvmsg_out) + uring->rx_msg.msg_namelen;
+    hdr = &msgs[n].msg_hdr;
+    if(hdr->msg_name != NULL){
+      if(out->namelen < hdr->msg_namelen)
+        hdr->msg_namelen = out->namelen;
+      memcpy(hdr->msg_name, buf + sizeof(struct io_uring_recvmsg_out), hdr->msg_namelen);
+    }
+    hdr->msg_control = out->controllen > 0 ? control : NULL;
+    hdr->msg_controllen = out->controllen;
+    hdr->msg_flags = out->flags;
+    hdr->msg_iov[0].iov_base = control + uring->rx_msg.msg_controllen;
+    hdr->msg_iov[0].iov_len = out->payloadlen;
+    msgs[n].msg_len = out->payloadlen;
+    uring->received = TRUE;
+    n++;
+  }
+
+  // Keep the receive posted, or nothing wakes up whoever polls for it
+  if(!uring->armed && rx_ready(uring, syscalls) == -1 && n == 0)
+    return -1;
+  return n;
+}
+
+int
+microtcp_uring_wait (struct microtcp_uring *uring, uint64_t timeout_us,
+                     uint64_t *syscalls)
+{
+  int ret = rx_ready(uring, syscalls);
+
+  if(ret != 0 || timeout_us == 0)
+    return ret;
+  if(ring_wait(&uring->rx, timeout_us, syscalls) == -1)
+    return -1;
+  return rx_ready(uring, syscalls);
+}
+
+int
+microtcp_uring_fd (struct microtcp_uring *uring, uint64_t *syscalls)
+{
+  if(rx_ready(uring, syscalls) == -1)
+    return -1;
+  return uring->rx.fd;
+}
+
+#else /* no multishot receives in the kernel headers */
+
+struct microtcp_uring *
+microtcp_uring_new (int sd, int *sqpoll)
+{
+  errno = ENOSYS;
+  return NULL;
+}
+
+void
+microtcp_uring_free (struct microtcp_uring *uring)
+{
+}
+
+int
+microtcp_uring_rx_buffers (struct microtcp_uring *uring, int count, size_t len,
+                           size_t control_len)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+microtcp_uring_send (struct microtcp_uring *uring, struct mmsghdr *msgs,
+                     unsigned int vlen, uint64_t *syscalls)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+microtcp_uring_recv (struct microtcp_uring *uring, struct mmsghdr *msgs,
+                     unsigned int vlen, uint64_t timeout_us, uint64_t *syscalls)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+microtcp_uring_wait (struct microtcp_uring *uring, uint64_t timeout_us,
+                     uint64_t *syscalls)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+microtcp_uring_fd (struct microtcp_uring *uring, uint64_t *syscalls)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
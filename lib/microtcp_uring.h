@@ -0,0 +1,114 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_URING_H_
+#define LIB_MICROTCP_URING_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * io_uring datagram I/O, spoken through the raw system calls. Receives
+ * come from one multishot recvmsg that the kernel keeps posted, into
+ * buffers of a ring we hand it. Sends go out as a batch of sendmsg
+ * entries. Sends and receives have a ring each: the sends of a batch are
+ * waited for before the batch is reused, and the receive ring then only
+ * ever holds datagrams, so its descriptor can be polled for them.
+ */
+#define MICROTCP_URING_BUFS 256       /* Receive buffers of single datagrams */
+#define MICROTCP_URING_GRO_BUFS 32    /* Receive buffers of coalesced ones */
+#define MICROTCP_URING_SQ_IDLE_MS 100 /* The SQPOLL thread sleeps after that long without sends */
+#define MICROTCP_URING_SPIN 4096      /* Polls of the send completions before sleeping on them */
+
+struct microtcp_uring;
+
+/**
+ * Sets up the rings of the UDP socket sd.
+ *
+ * @param sqpoll TRUE to have a kernel thread take the sends, so that
+ * they need no system call while it is awake. Set to FALSE if the
+ * kernel refused one.
+ * @return the rings or NULL if the kernel lacks any of what they need,
+ * with errno set
+ */
+struct microtcp_uring *
+microtcp_uring_new (int sd, int *sqpoll);
+
+void
+microtcp_uring_free (struct microtcp_uring *uring);
+
+/**
+ * Replaces the receive buffers. Only before the receive is first posted.
+ *
+ * @param count a power of 2, at most MICROTCP_URING_BUFS
+ * @param len the largest datagram, or GRO message, to receive
+ * @param control_len room for the control data of each
+ * @return 0 on success or -1 on failure, which leaves the old buffers
+ */
+int
+microtcp_uring_rx_buffers (struct microtcp_uring *uring, int count, size_t len,
+                           size_t control_len);
+
+/**
+ * Sends the messages and waits until the kernel took them all, like
+ * sendmmsg() does.
+ *
+ * @param syscalls counter of the system calls made
+ * @return the number of messages sent before the first that failed, or
+ * -1 with errno set if that is the first one
+ */
+int
+microtcp_uring_send (struct microtcp_uring *uring, struct mmsghdr *msgs,
+                     unsigned int vlen, uint64_t *syscalls);
+
+/**
+ * Takes the datagrams received so far, like recvmmsg() does, except
+ * that the data is not copied: the single iovec of each message is
+ * pointed to the buffer holding it, and so is msg_control. The buffers
+ * of a call are given back to the kernel on the next one.
+ *
+ * @param timeout_us how long to wait for the first datagram, 0 not to
+ * @return the number of messages, 0 if none arrived or -1 if the kernel
+ * can't keep a receive posted, with errno set
+ */
+int
+microtcp_uring_recv (struct microtcp_uring *uring, struct mmsghdr *msgs,
+                     unsigned int vlen, uint64_t timeout_us, uint64_t *syscalls);
+
+/**
+ * Waits until a datagram arrives or the timeout expires.
+ *
+ * @return 1 if a datagram is waiting, 0 on timeout or -1 if the kernel
+ * can't keep a receive posted
+ */
+int
+microtcp_uring_wait (struct microtcp_uring *uring, uint64_t timeout_us,
+                     uint64_t *syscalls);
+
+/**
+ * Posts the receive if it is not already.
+ *
+ * @return the descriptor that polls readable while datagrams wait, or
+ * -1 if the receive could not be posted
+ */
+int
+microtcp_uring_fd (struct microtcp_uring *uring, uint64_t *syscalls);
+
+#endif /* LIB_MICROTCP_URING_H_ */
@@ -0,0 +1,175 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A non-blocking listener answers the SYN of a peer and goes on with
+ * the handshake without waiting for it: microtcp_accept_conn() returns
+ * EAGAIN at once until the peer acknowledges, and sends the SYN ACK
+ * again when its timer expires. The ACK of the peer is lost, and its
+ * first data segment stands in for it. The peer is played here over a
+ * plain UDP socket.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "../lib/microtcp.h"
+#include "../utils/crc32.h"
+#include "test_common.h"
+
+#define TEST_PORT 9302
+#define TEST_CALL_US 50000 /* Well below the RTO a blocking handshake waits for */
+#define TEST_ISN 1000
+#define TEST_SERVER_ISN 5000
+#define TEST_DATA "first segment"
+
+/*
+ * The library draws its sequence numbers from rand(), so this one lets
+ * the peer know those of the listener
+ */
+int
+rand (void)
+{
+  return TEST_SERVER_ISN;
+}
+
+static uint64_t
+test_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Sends a segment to the listener
+ */
+static void
+test_send (int sd, const struct sockaddr_in *sin, uint32_t seq, uint32_t ack,
+           uint16_t control, const char *data)
+{
+  uint8_t packet[sizeof(microtcp_header_t) + sizeof(TEST_DATA)];
+  microtcp_header_t *header = (microtcp_header_t *) packet;
+  size_t len = data ? strlen (data) : 0;
+
+  memset (packet, 0, sizeof(packet));
+  header->seq_number = htonl (seq);
+  header->ack_number = htonl (ack);
+  header->control = htons (control);
+  header->window = htons (0xffff);
+  header->data_len = htonl (len);
+  memcpy (packet + sizeof(microtcp_header_t), data, len);
+  header->checksum = htonl (crc32 (packet, sizeof(microtcp_header_t) + len));
+  sendto (sd, packet, sizeof(microtcp_header_t) + len, 0,
+          (const struct sockaddr *) sin, sizeof(struct sockaddr_in));
+}
+
+/*
+ * Calls microtcp_accept_conn() until it hands out a connection or the
+ * peer got as many SYN ACKs
+ *
+ * @return 0 once accepted, 1 once the SYN ACKs arrived, -1 on failure
+ */
+static int
+test_accept (microtcp_sock_t *listener, microtcp_sock_t *conn, int sd,
+             int synacks)
+{
+  microtcp_header_t header;
+  struct sockaddr_in sin;
+  uint64_t start, took;
+  int i, ret;
+
+  for (i = 0; i < 2000; i++) {
+    start = test_now ();
+    ret = microtcp_accept_conn (listener, conn, (struct sockaddr *) &sin,
+                                sizeof(struct sockaddr_in));
+    took = test_now () - start;
+    if (took > TEST_CALL_US) {
+      fprintf (stderr, "microtcp_accept_conn() blocked for %lu us\n", (unsigned long) took);
+      return -1;
+    }
+    if (ret == 0)
+      return 0;
+    if (errno != EAGAIN) {
+      perror ("microtcp_accept_conn");
+      return -1;
+    }
+
+    while (recv (sd, &header, sizeof(header), MSG_DONTWAIT) == sizeof(header)) {
+      if (ntohs (header.control) != SYNACK || ntohl (header.ack_number) != TEST_ISN + 1
+          || ntohl (header.seq_number) != TEST_SERVER_ISN) {
+        fprintf (stderr, "no SYN ACK\n");
+        return -1;
+      }
+      if (--synacks == 0)
+        return 1;
+    }
+    usleep (1000);
+  }
+  fprintf (stderr, "gave up\n");
+  return -1;
+}
+
+int
+main (void)
+{
+  microtcp_sock_t listener, conn;
+  struct sockaddr_in sin;
+  char buffer[sizeof(TEST_DATA)];
+  int sd, failed = 1;
+
+  test_start ();
+  listener = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  test_address (&sin, TEST_PORT);
+  sd = socket (AF_INET, SOCK_DGRAM, 0);
+  if (sd == -1
+      || microtcp_bind (&listener, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1
+      || microtcp_listen (&listener, 1) == -1
+      || microtcp_set_nonblocking (&listener, TRUE) == -1) {
+    perror ("listener");
+    return EXIT_FAILURE;
+  }
+
+  /* The SYN ACK, and the one its timer sends again, with no ACK yet */
+  test_send (sd, &sin, TEST_ISN, 0, SYN, NULL);
+  if (test_accept (&listener, &conn, sd, 2) == 1) {
+    test_send (sd, &sin, TEST_ISN + 1, TEST_SERVER_ISN + 1, 0, TEST_DATA);
+    if (test_accept (&listener, &conn, sd, 0) == 0) {
+      memset (buffer, 0, sizeof(buffer));
+      failed = conn.state != ESTABLISHED || conn.seq_number != TEST_SERVER_ISN + 1
+               || microtcp_recv (&conn, buffer, sizeof(buffer), 0) != (ssize_t) strlen (TEST_DATA)
+               || strcmp (buffer, TEST_DATA) != 0;
+      printf ("accepted after 2 SYN ACKs: %s\n", failed ? "data lost" : "established");
+
+      /* The answers to the FIN of the connection, that has the same number */
+      test_send (sd, &sin, 0, TEST_SERVER_ISN + 1, ACK, NULL);
+      test_send (sd, &sin, TEST_ISN + 1 + strlen (TEST_DATA), 0, FINACK, NULL);
+      if (microtcp_shutdown (&conn, SHUT_RDWR) == -1
+          || microtcp_recv (&conn, buffer, 1, 0) != -1)
+        failed = 1;
+    }
+  }
+
+  microtcp_shutdown (&listener, SHUT_RDWR);
+  close (sd);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -32,6 +32,10 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include "../lib/microtcp.h"
 
@@ -48,6 +52,54 @@ print_statistics (ssize_t received, struct timespec start, struct timespec end)
   printf ("Throughput achieved: %f MB/s\n", megabytes / elapsed);
 }
 
+/* CPU time of the whole process, kernel threads of io_uring included */
+static inline void
+print_cpu (const microtcp_sock_t *s, uint64_t bytes)
+{
+  static const char *backends[] = { "sendmmsg/recvmmsg", "io_uring", "io_uring with SQPOLL" };
+  struct rusage usage;
+  double cpu;
+
+  getrusage (RUSAGE_SELF, &usage);
+  cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6
+      + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+  printf ("I/O: %s\n", backends[s->io_backend]);
+  printf ("CPU time per MB: %f ms (user %ld.%06ld s, system %ld.%06ld s)\n",
+          cpu * 1000 / (bytes / (1024.0 * 1024.0)),
+          (long) usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
+          (long) usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec);
+}
+
+/* Occupancy of the packet pool the connections of a listener share */
+static inline void
+print_pool (microtcp_sock_t *listener)
+{
+  microtcp_pool_stats_t stats;
+
+  if (microtcp_pool_stats (listener, &stats) == -1)
+    return;
+  printf ("Packet pool: %llu buffers of %llu bytes%s, peak %llu in use, "
+          "%llu datagrams dropped when empty\n",
+          (unsigned long long) stats.size, (unsigned long long) stats.buffer_len,
+          stats.huge_pages ? " on huge pages" : "",
+          (unsigned long long) stats.peak, (unsigned long long) stats.exhausted);
+}
+
+/* The datagram I/O named on the command line */
+static int
+parse_backend (const char *name, microtcp_io_backend_t *backend)
+{
+  if (strcmp (name, "mmsg") == 0)
+    *backend = MICROTCP_IO_MMSG;
+  else if (strcmp (name, "uring") == 0)
+    *backend = MICROTCP_IO_URING;
+  else if (strcmp (name, "sqpoll") == 0)
+    *backend = MICROTCP_IO_URING_SQPOLL;
+  else
+    return -1;
+  return 0;
+}
+
 int
 server_tcp (uint16_t listen_port, const char *file)
 {
@@ -157,7 +209,8 @@ server_tcp (uint16_t listen_port, const char *file)
 }
 
 int
-server_microtcp (uint16_t listen_port, const char *file)
+server_microtcp (uint16_t listen_port, const char *file, int offload,
+                 int protocol_thread, microtcp_io_backend_t backend)
 {
   FILE *fp;
   struct sockaddr_in sin; // Adress
@@ -176,13 +229,15 @@ server_microtcp (uint16_t listen_port, const char *file)
   }
 
   // Create socket
-  microtcp_sock_t s = microtcp_socket(AF_INET, SOCK_DGRAM, 0);
+  microtcp_sock_t s = microtcp_socket_io(AF_INET, SOCK_DGRAM, 0, backend);
+  if(!offload)
+    microtcp_set_offload(&s, FALSE);
 
   // Reset buffeer
   memset(&sin, 0, sizeof(struct sockaddr_in));
 
   sin.sin_family = AF_INET; // Set family
-  sin.sin_port = htons(8080); // Set port
+  sin.sin_port = htons(listen_port); // Set port
   sin.sin_addr.s_addr = INADDR_ANY; // All addresses
 
   // Socket keep track
@@ -195,6 +250,10 @@ server_microtcp (uint16_t listen_port, const char *file)
   // Wait for connection
   microtcp_accept(&s, (struct sockaddr *)&sin, sizeof(struct sockaddr_in));
 
+  // ACKs keep going out while we write to the file
+  if(protocol_thread && microtcp_thread_start(&s) == -1)
+    perror("microtcp_thread_start");
+
   // Socket keep track
   s.address = sin; // Keep track of address
   s.address_len = sizeof(struct sockaddr_in); // Keep track of address length
@@ -212,10 +271,229 @@ server_microtcp (uint16_t listen_port, const char *file)
   }
   clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
   print_statistics (s.bytes_received, start_time, end_time);
+  printf ("System calls per MB: %f\n",
+          s.syscalls / (s.bytes_received / (1024.0 * 1024.0)));
+  print_cpu (&s, s.bytes_received);
 
   // :)
   fclose(fp);
+  free(buffer);
+
+  return 0;
+}
+
+/* A connection of the multi-connection server */
+struct server_conn
+{
+  microtcp_sock_t sock;
+  FILE *fp;
+  pthread_t thread;
+};
+
+static void *
+server_conn_run (void *arg)
+{
+  struct server_conn *c = arg;
+  uint8_t buffer[CHUNK_SIZE];
+  int received;
+
+  while ((received = microtcp_recv (&c->sock, buffer, CHUNK_SIZE, 0)) > 0)
+    fwrite (buffer, sizeof(uint8_t), received, c->fp);
+  fclose (c->fp);
+  return NULL;
+}
+
+/*
+ * Serves that many clients at once on one port, each one in a thread of
+ * its own that saves what it receives to file.<i>
+ */
+int
+server_microtcp_many (uint16_t listen_port, const char *file, int connections,
+                      int offload, microtcp_io_backend_t backend)
+{
+  struct server_conn *conns;
+  struct sockaddr_in sin;
+  struct timespec start_time;
+  struct timespec end_time;
+  uint64_t bytes = 0;
+  char name[512];
+  int i;
+
+  conns = calloc (connections, sizeof(struct server_conn));
+  if (!conns) {
+    perror ("Allocate connections");
+    return -EXIT_FAILURE;
+  }
+
+  microtcp_sock_t s = microtcp_socket_io (AF_INET, SOCK_DGRAM, 0, backend);
+  if (!offload)
+    microtcp_set_offload (&s, FALSE);
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (listen_port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+  microtcp_bind (&s, (struct sockaddr *) &sin, sizeof(struct sockaddr_in));
+  if (microtcp_listen (&s, connections) == -1) {
+    perror ("microtcp_listen");
+    free (conns);
+    return -EXIT_FAILURE;
+  }
+
+  for (i = 0; i < connections; i++) {
+    if (microtcp_accept_conn (&s, &conns[i].sock, (struct sockaddr *) &sin,
+                              sizeof(struct sockaddr_in)) == -1) {
+      i--;
+      continue;
+    }
+    if (i == 0)
+      clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+
+    snprintf (name, sizeof(name), "%s.%d", file, i);
+    conns[i].fp = fopen (name, "w");
+    if (!conns[i].fp) {
+      perror ("Open file for writing");
+      exit (EXIT_FAILURE);
+    }
+    pthread_create (&conns[i].thread, NULL, server_conn_run, &conns[i]);
+  }
+
+  for (i = 0; i < connections; i++) {
+    pthread_join (conns[i].thread, NULL);
+    bytes += conns[i].sock.bytes_received;
+  }
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+
+  print_statistics (bytes, start_time, end_time);
+  printf ("Connections: %d\n", connections);
+  print_cpu (&s, bytes);
+  print_pool (&s);
+
+  microtcp_shutdown (&s, SHUT_RDWR);
+  free (conns);
+  return 0;
+}
+
+/* The multi-connection server driven by one event loop */
+struct server_loop
+{
+  microtcp_loop_t *loop;
+  microtcp_sock_t listener;
+  struct server_conn *conns;
+  const char *file;
+  int connections;
+  int accepted;
+  int closed;
+};
+
+static void
+server_loop_conn (microtcp_sock_t *socket, int events, void *arg)
+{
+  struct server_conn *c = arg;
+  uint8_t buffer[CHUNK_SIZE];
+  ssize_t received;
+
+  (void) events;
+  while ((received = microtcp_recv (socket, buffer, CHUNK_SIZE, 0)) > 0)
+    fwrite (buffer, sizeof(uint8_t), received, c->fp);
+
+  /* Closed by the peer, and so out of the loop */
+  if (received == -1 && errno != EAGAIN) {
+    fclose (c->fp);
+    c->fp = NULL;
+  }
+}
+
+static void
+server_loop_accept (microtcp_sock_t *socket, int events, void *arg)
+{
+  struct server_loop *l = arg;
+  struct server_conn *c;
+  struct sockaddr_in sin;
+  char name[512];
+
+  (void) events;
+  while (l->accepted < l->connections) {
+    c = &l->conns[l->accepted];
+    if (microtcp_accept_conn (socket, &c->sock, (struct sockaddr *) &sin,
+                              sizeof(struct sockaddr_in)) == -1)
+      return;
+
+    snprintf (name, sizeof(name), "%s.%d", l->file, l->accepted);
+    c->fp = fopen (name, "w");
+    if (!c->fp) {
+      perror ("Open file for writing");
+      exit (EXIT_FAILURE);
+    }
+    microtcp_loop_add (l->loop, &c->sock, MICROTCP_POLLIN, server_loop_conn, c);
+    l->accepted++;
+  }
+}
+
+/*
+ * Serves that many clients at once on one port, all of them from one
+ * thread with an event loop
+ */
+int
+server_microtcp_loop (uint16_t listen_port, const char *file, int connections,
+                      int offload, microtcp_io_backend_t backend)
+{
+  struct server_loop l;
+  struct sockaddr_in sin;
+  struct timespec start_time;
+  struct timespec end_time;
+  uint64_t bytes = 0;
+  int i, open;
+
+  memset (&l, 0, sizeof(l));
+  memset (&start_time, 0, sizeof(start_time));
+  l.file = file;
+  l.connections = connections;
+  l.conns = calloc (connections, sizeof(struct server_conn));
+  l.loop = microtcp_loop_new ();
+  if (!l.conns || !l.loop) {
+    perror ("Allocate event loop");
+    return -EXIT_FAILURE;
+  }
+
+  l.listener = microtcp_socket_io (AF_INET, SOCK_DGRAM, 0, backend);
+  if (!offload)
+    microtcp_set_offload (&l.listener, FALSE);
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (listen_port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+  microtcp_bind (&l.listener, (struct sockaddr *) &sin, sizeof(struct sockaddr_in));
+  if (microtcp_listen (&l.listener, connections) == -1) {
+    perror ("microtcp_listen");
+    return -EXIT_FAILURE;
+  }
+  microtcp_loop_add (l.loop, &l.listener, MICROTCP_POLLIN, server_loop_accept, &l);
 
+  /* Until every connection was accepted and closed */
+  do {
+    if (microtcp_poll (l.loop, -1) == -1) {
+      perror ("microtcp_poll");
+      return -EXIT_FAILURE;
+    }
+    if (l.accepted > 0 && start_time.tv_sec == 0)
+      clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+    for (i = 0, open = 0; i < l.accepted; i++)
+      open += l.conns[i].fp != NULL;
+  } while (l.accepted < connections || open > 0);
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+
+  for (i = 0; i < connections; i++)
+    bytes += l.conns[i].sock.bytes_received;
+  print_statistics (bytes, start_time, end_time);
+  printf ("Connections: %d\n", connections);
+  print_cpu (&l.listener, bytes);
+  print_pool (&l.listener);
+
+  microtcp_shutdown (&l.listener, SHUT_RDWR);
+  microtcp_loop_free (l.loop);
+  free (l.conns);
   return 0;
 }
 
@@ -302,15 +580,16 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
 }
 
 int
-client_microtcp (const char *serverip, uint16_t server_port, const char *file)
+client_microtcp (const char *serverip, uint16_t server_port, const char *file,
+                 int rx_timestamps, const char *cc, const char *pacing,
+                 int offload, int protocol_thread, int use_sendfile,
+                 microtcp_io_backend_t backend)
 {
   struct sockaddr_in sin; // Address
   FILE *fp;
   uint8_t *buffer;
   size_t read_items = 0;
   ssize_t data_sent;
-  size_t size = 0;
-
 
   /* Allocate memory for the application receive buffer */
   buffer = (uint8_t *) malloc (CHUNK_SIZE);
@@ -334,7 +613,7 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
   // fread(buffer, sizeof(uint8_t), size, fp);
 
   // Create socket
-  microtcp_sock_t s = microtcp_socket(AF_INET, SOCK_DGRAM, 0);
+  microtcp_sock_t s = microtcp_socket_io(AF_INET, SOCK_DGRAM, 0, backend);
 
   memset(&sin, 0, sizeof(struct sockaddr_in)); // Reset buffer
   sin.sin_family = AF_INET; // Set family
@@ -345,17 +624,60 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
   s.address = sin; // Keep track of address
   s.address_len = sizeof(struct sockaddr_in); // Keep track of address length
 
+  if(cc != NULL && microtcp_set_congestion_control(&s, cc) == -1){
+    fprintf(stderr, "Unknown congestion control %s\n", cc);
+    return -EXIT_FAILURE;
+  }
+
+  if(pacing != NULL){
+    if(strcmp(pacing, "off") == 0)
+      microtcp_set_pacing(&s, MICROTCP_PACING_OFF);
+    else if(strcmp(pacing, "txtime") == 0)
+      microtcp_set_pacing(&s, MICROTCP_PACING_TXTIME);
+    else if(strcmp(pacing, "timer") != 0){
+      fprintf(stderr, "Unknown pacing %s\n", pacing);
+      return -EXIT_FAILURE;
+    }
+  }
+
+  if(!offload)
+    microtcp_set_offload(&s, FALSE);
+
+  // RTT samples without the time ACKs wait in the socket
+  if(rx_timestamps && microtcp_set_rx_timestamps(&s, TRUE) == -1)
+    perror("SO_TIMESTAMPING");
+
   // Connect
   microtcp_connect(&s, (struct sockaddr *)&sin, sizeof(struct sockaddr_in));
 
+  // ACKs are taken and segments retransmitted while we read the file
+  if(protocol_thread && microtcp_thread_start(&s) == -1)
+    perror("microtcp_thread_start");
+
   // printf ("Starting sending data...\n");
   // data_sent = microtcp_send (&s, buffer, size * sizeof(uint8_t), 0);
   // printf("Sent: %d\n", data_sent);
 
   /* Start sending the data */
   printf ("Starting sending data...\n");
-  while (!feof (fp)) {
+  if (use_sendfile) {
+    struct stat st;
+
+    /* The whole file at once, straight out of the page cache */
+    if (fstat (fileno (fp), &st) == -1
+        || microtcp_sendfile (&s, fileno (fp), 0, st.st_size) != st.st_size) {
+      perror ("microtcp_sendfile");
+      free (buffer);
+      fclose (fp);
+      return -EXIT_FAILURE;
+    }
+  }
+  while (!use_sendfile && !feof (fp)) {
     read_items = fread (buffer, sizeof(uint8_t), CHUNK_SIZE, fp);
+
+    /* A file of whole chunks only hits its end on the read after the last */
+    if (read_items < 1 && feof (fp))
+      break;
     if (read_items < 1) {
       perror ("Failed read from file");
       free (buffer);
@@ -379,10 +701,55 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
   // Shutdown
   printf ("Data sent. Terminating...\n");
   microtcp_shutdown(&s, SHUT_RDWR);
+  printf ("Bytes on the wire: %lu (%lu retransmitted in %lu segments)\n",
+          s.bytes_send, s.bytes_retransmitted, s.packets_retransmitted);
+  printf ("System calls per MB: %f\n",
+          s.syscalls / (s.bytes_send / (1024.0 * 1024.0)));
+  printf ("RTT: %u us (smoothed %u us), RTO: %u us\n",
+          s.rtt_us, s.srtt_us, s.rto_us);
+  printf ("Pacing: %f MB/s, bursts of %u bytes\n",
+          s.pacing_rate / (1024.0 * 1024.0), s.pacing_burst);
+  print_cpu (&s, s.bytes_send);
+  free (buffer);
+  fclose (fp);
 
   return 0;
 }
 
+/*
+ * Runs that many clients at once, each one in a process of its own
+ */
+int
+client_microtcp_many (const char *serverip, uint16_t server_port,
+                      const char *file, int rx_timestamps, const char *cc,
+                      const char *pacing, int offload, int connections,
+                      int use_sendfile, microtcp_io_backend_t backend)
+{
+  int i, status, exit_code = 0;
+  pid_t pid;
+
+  for (i = 0; i < connections; i++) {
+    pid = fork ();
+    if (pid == -1) {
+      perror ("fork");
+      return -EXIT_FAILURE;
+    }
+    if (pid == 0) {
+      /* Only the totals of the server matter */
+      if (!freopen ("/dev/null", "w", stdout))
+        perror ("freopen");
+      exit (client_microtcp (serverip, server_port, file, rx_timestamps, cc,
+                             pacing, offload, FALSE, use_sendfile,
+                             backend) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+  while (wait (&status) > 0) {
+    if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS)
+      exit_code = -EXIT_FAILURE;
+  }
+  return exit_code;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -391,11 +758,20 @@ main (int argc, char **argv)
   int exit_code = 0;
   char *filestr = NULL;
   char *ipstr = NULL;
+  char *ccstr = NULL;
+  char *pacingstr = NULL;
   uint8_t is_server = 0;
   uint8_t use_microtcp = 0;
+  uint8_t rx_timestamps = 0;
+  uint8_t offload = 1;
+  int connections = 0;
+  uint8_t event_loop = 0;
+  uint8_t protocol_thread = 0;
+  uint8_t use_sendfile = 0;
+  microtcp_io_backend_t backend = MICROTCP_IO_MMSG;
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hsmf:p:a:")) != -1) {
+  while ((opt = getopt (argc, argv, "hsmtGeTSf:p:a:c:P:n:U:")) != -1) {
     switch (opt)
       {
       /* If -s is set, program runs on server mode */
@@ -406,6 +782,26 @@ main (int argc, char **argv)
       case 'm':
         use_microtcp = 1;
         break;
+        /* if -t is set the microTCP client takes RTT samples with kernel receive timestamps */
+      case 't':
+        rx_timestamps = 1;
+        break;
+        /* if -G is set microTCP sends and receives single datagrams, without GSO/GRO */
+      case 'G':
+        offload = 0;
+        break;
+        /* if -e is set the -n server serves its connections from one event loop */
+      case 'e':
+        event_loop = 1;
+        break;
+        /* if -T is set microTCP runs the protocol in a thread of its own */
+      case 'T':
+        protocol_thread = 1;
+        break;
+        /* if -S is set the microTCP client sends the file with microtcp_sendfile() */
+      case 'S':
+        use_sendfile = 1;
+        break;
       case 'f':
         filestr = strdup (optarg);
         /* A few checks will be nice here...*/
@@ -418,17 +814,45 @@ main (int argc, char **argv)
       case 'a':
         ipstr = strdup (optarg);
         break;
+      case 'c':
+        ccstr = strdup (optarg);
+        break;
+      case 'P':
+        pacingstr = strdup (optarg);
+        break;
+        /* if -n is set microTCP serves, or opens, that many connections at once */
+      case 'n':
+        connections = atoi (optarg);
+        break;
+        /* if -U is set microTCP moves its datagrams with the given I/O backend */
+      case 'U':
+        if (parse_backend (optarg, &backend) == -1) {
+          fprintf (stderr, "Unknown I/O backend %s\n", optarg);
+          exit (EXIT_FAILURE);
+        }
+        break;
 
       default:
         printf (
-            "Usage: bandwidth_test [-s] [-m] -p port -f file"
+            "Usage: bandwidth_test [-s] [-m] [-t] [-G] [-c cc] [-P pacing] [-n connections] [-e] [-T] [-S] [-U io] -p port -f file"
             "Options:\n"
             "   -s                  If set, the program runs as server. Otherwise as client.\n"
             "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
+            "   -t                  If set, the microTCP client uses kernel receive timestamps for its RTT samples.\n"
+            "   -G                  If set, microTCP does not use UDP segmentation offload (GSO/GRO).\n"
             "   -f <string>         If -s is set the -f option specifies the filename of the file that will be saved.\n"
             "                       If not, is the source file at the client side that will be sent to the server.\n"
             "   -p <int>            The listening port of the server\n"
             "   -a <string>         The IP address of the server. This option is ignored if the tool runs in server mode.\n"
+            "   -c <string>         The congestion control of the microTCP client: reno, newreno, cubic or bbr.\n"
+            "   -P <string>         The pacing of the microTCP client: off, timer (the default) or txtime.\n"
+            "   -n <int>            The number of microTCP connections at once, all to the port of the server.\n"
+            "                       The server saves connection i to file.i\n"
+            "   -e                  If set, the -n server serves all its connections from one thread with an event loop.\n"
+            "   -T                  If set, microTCP runs the protocol in a thread of its own, apart from the file I/O.\n"
+            "   -S                  If set, the microTCP client sends the file with microtcp_sendfile(), out of the page cache.\n"
+            "   -U <string>         The datagram I/O of microTCP: mmsg (the default), uring or sqpoll (io_uring\n"
+            "                       with a kernel thread polling for the sends).\n"
             "   -h                  prints this help\n");
         exit (EXIT_FAILURE);
       }
@@ -443,16 +867,28 @@ main (int argc, char **argv)
    */
   if (is_server) {
 
-    if (use_microtcp) {
-      exit_code = server_microtcp (port, filestr);
+    if (use_microtcp && connections > 0 && event_loop) {
+      exit_code = server_microtcp_loop (port, filestr, connections, offload, backend);
+    }
+    else if (use_microtcp && connections > 0) {
+      exit_code = server_microtcp_many (port, filestr, connections, offload, backend);
+    }
+    else if (use_microtcp) {
+      exit_code = server_microtcp (port, filestr, offload, protocol_thread, backend);
     }
     else {
       exit_code = server_tcp (port, filestr);
     }
   }
   else {
-    if (use_microtcp) {
-      exit_code = client_microtcp (ipstr, port, filestr);
+    if (use_microtcp && connections > 0) {
+      exit_code = client_microtcp_many (ipstr, port, filestr, rx_timestamps,
+                                        ccstr, pacingstr, offload, connections,
+                                        use_sendfile, backend);
+    }
+    else if (use_microtcp) {
+      exit_code = client_microtcp (ipstr, port, filestr, rx_timestamps, ccstr, pacingstr,
+                                   offload, protocol_thread, use_sendfile, backend);
     }
     else {
       exit_code = client_tcp (ipstr, port, filestr);
@@ -461,6 +897,8 @@ main (int argc, char **argv)
 
   free (filestr);
   free (ipstr);
+  free (ccstr);
+  free (pacingstr);
   return exit_code;
 }
 
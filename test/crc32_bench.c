@@ -0,0 +1,121 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the throughput of every CRC-32 kernel the CPU supports, plain
+ * and fused with a copy (against memcpy() followed by the plain kernel).
+ * crc32_test checks that they agree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../utils/crc32.h"
+
+#define BUF_LEN (1 << 20)
+#define BENCH_NS 200000000ULL
+
+static const char *kernels[] = { "table", "slice8", "slice16", "pclmul", "armv8" };
+static const size_t sizes[] = { 24, 64, 256, 1424, 4096, 65536 };
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * GB/s of the kernel over len bytes. With dst, of copying them there
+ * too, fused if copy is set or else with memcpy().
+ */
+static double
+bench (crc32_kernel_t kernel, crc32_copy_kernel_t copy, const uint8_t *buf,
+       uint8_t *dst, size_t len)
+{
+  uint64_t start = now_ns (), elapsed, bytes = 0;
+  volatile uint32_t sink = 0;
+  size_t off = 0;
+
+  do {
+    if (copy) {
+      sink ^= copy (0xffffffff, dst + off, buf + off, len);
+    }
+    else if (dst) {
+      memcpy (dst + off, buf + off, len);
+      sink ^= kernel (0xffffffff, dst + off, len);
+    }
+    else {
+      sink ^= kernel (0xffffffff, buf + off, len);
+    }
+    bytes += len;
+    off = (off + len) % (BUF_LEN - len);
+    elapsed = now_ns () - start;
+  } while (elapsed < BENCH_NS);
+  (void)sink;
+  return bytes / (double)elapsed;
+}
+
+int
+main (void)
+{
+  crc32_kernel_t kernel;
+  crc32_copy_kernel_t copy;
+  uint8_t *buf, *dst;
+  size_t i, j;
+
+  buf = malloc (BUF_LEN);
+  dst = malloc (BUF_LEN);
+  if (!buf || !dst) {
+    perror ("Allocate buffer");
+    return EXIT_FAILURE;
+  }
+  srand (1);
+  for (i = 0; i < BUF_LEN; i++)
+    buf[i] = rand ();
+
+  printf ("update_crc32() runs %s\n\n%-10s", crc32_kernel_name (), "GB/s");
+  for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+    printf ("%10zu", sizes[j]);
+  printf ("\n");
+
+  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    kernel = crc32_kernel (kernels[i]);
+    copy = crc32_copy_kernel (kernels[i]);
+    if (kernel == NULL)
+      continue;
+    printf ("%-10s", kernels[i]);
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+      printf ("%10.2f", bench (kernel, NULL, buf, NULL, sizes[j]));
+    printf ("\n %-9s", "+memcpy");
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+      printf ("%10.2f", bench (kernel, NULL, buf, dst, sizes[j]));
+    printf ("\n %-9s", "fused");
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+      printf ("%10.2f", bench (kernel, copy, buf, dst, sizes[j]));
+    printf ("\n");
+  }
+
+  free (buf);
+  free (dst);
+  return EXIT_SUCCESS;
+}
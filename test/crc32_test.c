@@ -0,0 +1,116 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cross-checks every CRC-32 kernel the CPU supports against the byte at
+ * a time table: whole, progressive, combined and fused with a copy.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../utils/crc32.h"
+
+#define BUF_LEN (1 << 20)
+#define CHECK_ROUNDS 20000
+
+static const char *kernels[] = { "table", "slice8", "slice16", "pclmul", "armv8" };
+
+/*
+ * Random lengths and alignments, whole and split in two progressive calls
+ */
+static int
+cross_check (const char *name, crc32_kernel_t kernel, crc32_copy_kernel_t copy,
+             const uint8_t *buf, uint8_t *dst)
+{
+  crc32_kernel_t reference = crc32_kernel ("table");
+  size_t off, len, split;
+  uint32_t expected, got;
+  int i;
+
+  for (i = 0; i < CHECK_ROUNDS; i++) {
+    off = rand () % 64;
+    len = i < 256 ? (size_t)i : (size_t)rand () % 9000;
+    split = len > 0 ? (size_t)rand () % len : 0;
+
+    expected = reference (0xffffffff, buf + off, len);
+    got = kernel (0xffffffff, buf + off, len);
+    if (got == expected)
+      got = kernel (kernel (0xffffffff, buf + off, split), buf + off + split, len - split);
+    if (got == expected)
+      got = crc32_combine_op (kernel (0xffffffff, buf + off, split),
+                              kernel (0, buf + off + split, len - split),
+                              crc32_combine_gen (len - split));
+    if (got == expected) {
+      got = copy (0xffffffff, dst + off / 2, buf + off, len);
+      if (memcmp (dst + off / 2, buf + off, len) != 0) {
+        printf ("%s: copy of %zu bytes at offset %zu differs\n", name, len, off);
+        return -1;
+      }
+    }
+    if (got != expected) {
+      printf ("%s: CRC of %zu bytes at offset %zu is 0x%08x, expected 0x%08x\n",
+              name, len, off, got, expected);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int
+main (void)
+{
+  crc32_kernel_t kernel;
+  uint8_t *buf, *dst;
+  size_t i;
+  int failed = 0;
+
+  buf = malloc (BUF_LEN);
+  dst = malloc (BUF_LEN);
+  if (!buf || !dst) {
+    perror ("Allocate buffer");
+    return EXIT_FAILURE;
+  }
+  srand (1);
+  for (i = 0; i < BUF_LEN; i++)
+    buf[i] = rand ();
+
+  // The check value of CRC-32
+  if (crc32 ((const uint8_t *)"123456789", 9) != 0xcbf43926) {
+    printf ("crc32() of \"123456789\" is not 0xcbf43926\n");
+    failed = 1;
+  }
+
+  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    kernel = crc32_kernel (kernels[i]);
+    if (kernel == NULL) {
+      printf ("%s: not supported\n", kernels[i]);
+      continue;
+    }
+    if (cross_check (kernels[i], kernel, crc32_copy_kernel (kernels[i]), buf, dst) == -1)
+      failed = 1;
+    else
+      printf ("%s: %d rounds agree\n", kernels[i], CHECK_ROUNDS);
+  }
+
+  free (buf);
+  free (dst);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
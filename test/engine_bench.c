@@ -0,0 +1,271 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Aggregate throughput of a sharded engine with 1, 2, 4... shards, up
+ * to the given maximum. For each count, that many client processes each
+ * open a connection to the engine on the loopback and send it the same
+ * number of bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "../lib/microtcp.h"
+
+#define CHUNK_SIZE 65536
+#define MAX_SHARDS 256
+#define DRAIN_NS 10000000000ULL
+
+/* Counters of a shard, only ever written by its thread */
+struct bench_shard
+{
+  uint64_t bytes;
+  int accepted;
+  int closed;
+} __attribute__((aligned(64)));
+
+struct bench_conn
+{
+  microtcp_sock_t sock;
+  struct bench_shard *shard;
+};
+
+static struct bench_shard shards[MAX_SHARDS];
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_recv (microtcp_sock_t *socket, int events, void *arg)
+{
+  struct bench_conn *c = arg;
+  uint8_t buffer[CHUNK_SIZE];
+  ssize_t received;
+
+  (void) events;
+  while ((received = microtcp_recv (socket, buffer, CHUNK_SIZE, 0)) > 0)
+    c->shard->bytes += received;
+
+  /* Closed by the peer, and so out of the loop */
+  if (received == -1 && errno != EAGAIN) {
+    __atomic_add_fetch (&c->shard->closed, 1, __ATOMIC_RELEASE);
+    free (c);
+  }
+}
+
+static void
+bench_accept (microtcp_sock_t *socket, int events, void *arg)
+{
+  struct bench_shard *shard = arg;
+  struct bench_conn *c;
+  struct sockaddr_in sin;
+
+  (void) events;
+  for (;;) {
+    c = malloc (sizeof(struct bench_conn));
+    if (!c)
+      return;
+    if (microtcp_accept_conn (socket, &c->sock, (struct sockaddr *) &sin,
+                              sizeof(struct sockaddr_in)) == -1) {
+      free (c);
+      return;
+    }
+    c->shard = shard;
+    shard->accepted++;
+    microtcp_loop_add (microtcp_loop_of (socket), &c->sock, MICROTCP_POLLIN,
+                       bench_recv, c);
+  }
+}
+
+static int
+bench_shard_init (microtcp_loop_t *loop, microtcp_sock_t *listener, int shard,
+                  void *arg)
+{
+  (void) arg;
+  memset (&shards[shard], 0, sizeof(struct bench_shard));
+  return microtcp_loop_add (loop, listener, MICROTCP_POLLIN, bench_accept,
+                            &shards[shard]);
+}
+
+/*
+ * A client process: one connection that sends bytes
+ */
+static int
+bench_client (uint16_t port, const uint8_t *buf, size_t bytes)
+{
+  struct sockaddr_in sin;
+  size_t sent, n;
+
+  microtcp_sock_t s = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  s.address = sin;
+  s.address_len = sizeof(struct sockaddr_in);
+  if (microtcp_connect (&s, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1)
+    return EXIT_FAILURE;
+
+  for (sent = 0; sent < bytes; sent += n) {
+    n = bytes - sent < CHUNK_SIZE ? bytes - sent : CHUNK_SIZE;
+    microtcp_send (&s, buf, n, 0);
+  }
+  microtcp_shutdown (&s, SHUT_RDWR);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * One round with that many shards
+ *
+ * @return 0 if every connection delivered its bytes
+ */
+static int
+bench_round (int nshards, int connections, size_t bytes, uint16_t port,
+             const uint8_t *buf)
+{
+  struct sockaddr_in sin;
+  microtcp_engine_t *engine;
+  uint64_t start, elapsed, total = 0;
+  int i, closed, status, failed = 0;
+  pid_t pid;
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  engine = microtcp_engine_new ((struct sockaddr *) &sin, sizeof(sin), nshards,
+                                connections, bench_shard_init, NULL);
+  if (!engine) {
+    perror ("microtcp_engine_new");
+    return -1;
+  }
+
+  start = now_ns ();
+  for (i = 0; i < connections; i++) {
+    pid = fork ();
+    if (pid == 0)
+      _exit (bench_client (port, buf, bytes));
+    if (pid < 0) {
+      perror ("fork");
+      failed = 1;
+      break;
+    }
+  }
+  while (wait (&status) > 0) {
+    if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS)
+      failed = 1;
+  }
+
+  /* The last bytes may still be on their way through a shard */
+  do {
+    for (i = 0, closed = 0; i < nshards; i++)
+      closed += __atomic_load_n (&shards[i].closed, __ATOMIC_ACQUIRE);
+    elapsed = now_ns () - start;
+  } while (closed < connections && elapsed < DRAIN_NS);
+  microtcp_engine_free (engine);
+
+  printf ("%6d %11d", nshards, connections);
+  for (i = 0; i < nshards; i++)
+    total += shards[i].bytes;
+  printf (" %10.2f %9.3f %10.1f   ", total / (1024.0 * 1024.0), elapsed * 1e-9,
+          total / (1024.0 * 1024.0) / (elapsed * 1e-9));
+  for (i = 0; i < nshards; i++)
+    printf ("%s%d", i > 0 ? "/" : "", shards[i].accepted);
+  printf ("\n");
+
+  if (closed < connections || total != (uint64_t)connections * bytes)
+    failed = 1;
+  return failed ? -1 : 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  int max_shards = 1;
+  int connections = 16;
+  size_t bytes = 16 << 20;
+  uint16_t port = 8080;
+  uint8_t *buf;
+  int opt, n, failed = 0;
+  size_t i;
+
+  while ((opt = getopt (argc, argv, "hs:n:b:p:")) != -1) {
+    switch (opt)
+      {
+      case 's':
+        max_shards = atoi (optarg);
+        break;
+      case 'n':
+        connections = atoi (optarg);
+        break;
+      case 'b':
+        bytes = strtoull (optarg, NULL, 10);
+        break;
+      case 'p':
+        port = atoi (optarg);
+        break;
+      default:
+        printf (
+            "Usage: engine_bench [-s shards] [-n connections] [-b bytes] [-p port]\n"
+            "Options:\n"
+            "   -s <int>            The most shards to try, in powers of 2 from 1 (default 1).\n"
+            "   -n <int>            The client connections of each round (default 16).\n"
+            "   -b <int>            The bytes every connection sends (default 16 MB).\n"
+            "   -p <int>            The port of the engine (default 8080).\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+  if (max_shards < 1 || max_shards > MAX_SHARDS || connections < 1) {
+    fprintf (stderr, "1 to %d shards and at least one connection\n", MAX_SHARDS);
+    return EXIT_FAILURE;
+  }
+
+  buf = malloc (CHUNK_SIZE);
+  if (!buf) {
+    perror ("Allocate buffer");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < CHUNK_SIZE; i++)
+    buf[i] = rand ();
+
+  printf ("shards connections         MB   seconds       MB/s   connections per shard\n");
+  for (n = 1; n <= max_shards; n *= 2) {
+    if (bench_round (n, connections, bytes, port, buf) == -1)
+      failed = 1;
+  }
+  if (max_shards & (max_shards - 1) && bench_round (max_shards, connections, bytes, port, buf) == -1)
+    failed = 1;
+
+  free (buf);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,237 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput and CPU cost of each datagram I/O backend. For each one, a
+ * receiver and a sender process move the same number of bytes over the
+ * loopback, and the CPU time both of them took, kernel threads
+ * included, is charged to every MB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include "../lib/microtcp.h"
+
+#define CHUNK_SIZE 65536
+
+/* What a process of a round reports back through its pipe */
+struct bench_report
+{
+  uint64_t bytes;
+  uint64_t syscalls;
+  int backend;                  /* The backend it got */
+};
+
+static const char *names[] = { "mmsg", "uring", "sqpoll" };
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double
+cpu_seconds (const struct rusage *usage)
+{
+  return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec * 1e-6
+      + usage->ru_stime.tv_sec + usage->ru_stime.tv_usec * 1e-6;
+}
+
+static int
+bench_receiver (uint16_t port, microtcp_io_backend_t backend, int fd)
+{
+  struct bench_report report;
+  struct sockaddr_in sin;
+  uint8_t *buffer = malloc (CHUNK_SIZE);
+  ssize_t received;
+
+  microtcp_sock_t s = microtcp_socket_io (AF_INET, SOCK_DGRAM, 0, backend);
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  microtcp_bind (&s, (struct sockaddr *) &sin, sizeof(struct sockaddr_in));
+  if (!buffer || microtcp_accept (&s, (struct sockaddr *) &sin,
+                                  sizeof(struct sockaddr_in)) == -1)
+    return EXIT_FAILURE;
+
+  memset (&report, 0, sizeof(report));
+  while ((received = microtcp_recv (&s, buffer, CHUNK_SIZE, 0)) > 0)
+    report.bytes += received;
+  report.syscalls = s.syscalls;
+  report.backend = s.io_backend;
+  if (write (fd, &report, sizeof(report)) != sizeof(report))
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+static int
+bench_sender (uint16_t port, microtcp_io_backend_t backend, size_t bytes, int fd)
+{
+  struct bench_report report;
+  struct sockaddr_in sin;
+  uint8_t *buf = malloc (CHUNK_SIZE);
+  size_t sent, n, i;
+
+  if (!buf)
+    return EXIT_FAILURE;
+  for (i = 0; i < CHUNK_SIZE; i++)
+    buf[i] = rand ();
+
+  microtcp_sock_t s = microtcp_socket_io (AF_INET, SOCK_DGRAM, 0, backend);
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  s.address = sin;
+  s.address_len = sizeof(struct sockaddr_in);
+  if (microtcp_connect (&s, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1)
+    return EXIT_FAILURE;
+
+  for (sent = 0; sent < bytes; sent += n) {
+    n = bytes - sent < CHUNK_SIZE ? bytes - sent : CHUNK_SIZE;
+    microtcp_send (&s, buf, n, 0);
+  }
+  microtcp_shutdown (&s, SHUT_RDWR);
+
+  memset (&report, 0, sizeof(report));
+  report.bytes = sent;
+  report.syscalls = s.syscalls;
+  report.backend = s.io_backend;
+  if (write (fd, &report, sizeof(report)) != sizeof(report))
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+/*
+ * One round with both ends on the given backend
+ *
+ * @return 0 if every byte arrived
+ */
+static int
+bench_round (microtcp_io_backend_t backend, size_t bytes, uint16_t port)
+{
+  struct bench_report reports[2];
+  struct rusage usage;
+  uint64_t start, elapsed;
+  double cpu = 0, mb;
+  int pipes[2][2], status, i, failed = 0;
+  pid_t pids[2];
+
+  for (i = 0; i < 2; i++) {
+    if (pipe (pipes[i]) == -1) {
+      perror ("pipe");
+      return -1;
+    }
+  }
+
+  pids[0] = fork ();
+  if (pids[0] == 0)
+    _exit (bench_receiver (port, backend, pipes[0][1]));
+  usleep (100000);
+  start = now_ns ();
+  pids[1] = fork ();
+  if (pids[1] == 0)
+    _exit (bench_sender (port, backend, bytes, pipes[1][1]));
+  if (pids[0] < 0 || pids[1] < 0) {
+    perror ("fork");
+    return -1;
+  }
+
+  memset (reports, 0, sizeof(reports));
+  for (i = 0; i < 2; i++) {
+    if (wait4 (pids[i], &status, 0, &usage) == -1 || !WIFEXITED (status)
+        || WEXITSTATUS (status) != EXIT_SUCCESS
+        || read (pipes[i][0], &reports[i], sizeof(reports[i])) != sizeof(reports[i]))
+      failed = 1;
+    cpu += cpu_seconds (&usage);
+    close (pipes[i][0]);
+    close (pipes[i][1]);
+  }
+  elapsed = now_ns () - start;
+
+  mb = reports[0].bytes / (1024.0 * 1024.0);
+  printf ("%-8s %-8s %10.2f %9.3f %10.1f %12.3f %12.1f %12.1f\n", names[backend],
+          names[reports[1].backend], mb, elapsed * 1e-9, mb / (elapsed * 1e-9),
+          mb > 0 ? cpu * 1000 / mb : 0.0,
+          mb > 0 ? reports[1].syscalls / mb : 0.0,
+          mb > 0 ? reports[0].syscalls / mb : 0.0);
+
+  if (reports[0].bytes != bytes)
+    failed = 1;
+  return failed ? -1 : 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t bytes = 64 << 20;
+  uint16_t port = 8080;
+  int rounds = 1;
+  int opt, i, failed = 0;
+  microtcp_io_backend_t backend;
+
+  while ((opt = getopt (argc, argv, "hb:p:r:")) != -1) {
+    switch (opt)
+      {
+      case 'b':
+        bytes = strtoull (optarg, NULL, 10);
+        break;
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'r':
+        rounds = atoi (optarg);
+        break;
+      default:
+        printf (
+            "Usage: io_bench [-b bytes] [-p port] [-r rounds]\n"
+            "Options:\n"
+            "   -b <int>            The bytes of each transfer (default 64 MB).\n"
+            "   -p <int>            The port of the first receiver, one more for each round (default 8080).\n"
+            "   -r <int>            The transfers with each backend (default 1).\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  /*
+   * "got" is the backend the kernel let the sender have. Every round
+   * takes a port of its own, since io_uring lets go of the sockets of
+   * a process some time after it exits.
+   */
+  printf ("backend  got              MB   seconds       MB/s    CPU ms/MB  tx calls/MB  rx calls/MB\n");
+  for (backend = MICROTCP_IO_MMSG; backend <= MICROTCP_IO_URING_SQPOLL; backend++) {
+    for (i = 0; i < rounds; i++) {
+      if (bench_round (backend, bytes, port++) == -1)
+        failed = 1;
+    }
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
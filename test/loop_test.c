@@ -0,0 +1,163 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A connection of an event loop whose callback closes it: the last
+ * microtcp_recv() finds the peer gone and takes the socket out of the
+ * loop while the loop is still running the callback.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include "../lib/microtcp.h"
+#include "test_common.h"
+
+#define TEST_PORT 9301
+#define TEST_CONNECTIONS 4
+#define TEST_BYTES (256 * 1024)
+
+struct test_conn
+{
+  microtcp_sock_t sock;
+  uint64_t bytes;
+  int bad;                      /* Bytes that differ from what was sent */
+  int closed;
+};
+
+struct test_server
+{
+  microtcp_loop_t *loop;
+  struct test_conn conns[TEST_CONNECTIONS];
+  int accepted;
+};
+
+static void
+test_conn_event (microtcp_sock_t *socket, int events, void *arg)
+{
+  struct test_conn *c = arg;
+  uint8_t buffer[4096];
+  ssize_t received, i;
+
+  (void) events;
+  while ((received = microtcp_recv (socket, buffer, sizeof(buffer), 0)) > 0) {
+    for (i = 0; i < received; i++)
+      c->bad += buffer[i] != (uint8_t) (c->bytes + i);
+    c->bytes += received;
+  }
+
+  /* The socket is out of the loop now, and its callback still running */
+  if (received == -1 && errno != EAGAIN)
+    c->closed = 1;
+}
+
+static void
+test_accept_event (microtcp_sock_t *socket, int events, void *arg)
+{
+  struct test_server *srv = arg;
+  struct test_conn *c;
+  struct sockaddr_in sin;
+
+  (void) events;
+  while (srv->accepted < TEST_CONNECTIONS) {
+    c = &srv->conns[srv->accepted];
+    if (microtcp_accept_conn (socket, &c->sock, (struct sockaddr *) &sin,
+                              sizeof(struct sockaddr_in)) == -1)
+      return;
+    if (microtcp_loop_add (srv->loop, &c->sock, MICROTCP_POLLIN, test_conn_event, c) == -1)
+      exit (EXIT_FAILURE);
+    srv->accepted++;
+  }
+}
+
+static int
+test_client (void)
+{
+  struct sockaddr_in sin;
+  uint8_t *buf = malloc (TEST_BYTES);
+  int i;
+
+  if (!buf)
+    return EXIT_FAILURE;
+  for (i = 0; i < TEST_BYTES; i++)
+    buf[i] = i;
+
+  microtcp_sock_t s = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  test_address (&sin, TEST_PORT);
+  s.address = sin;
+  s.address_len = sizeof(struct sockaddr_in);
+  if (microtcp_connect (&s, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1
+      || microtcp_send (&s, buf, TEST_BYTES, 0) != TEST_BYTES)
+    return EXIT_FAILURE;
+  microtcp_shutdown (&s, SHUT_RDWR);
+  free (buf);
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  struct test_server srv;
+  struct sockaddr_in sin;
+  microtcp_sock_t listener;
+  int i, closed, failed = 0;
+  pid_t pids[TEST_CONNECTIONS];
+
+  test_start ();
+  memset (&srv, 0, sizeof(srv));
+  srv.loop = microtcp_loop_new ();
+  listener = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  test_address (&sin, TEST_PORT);
+  if (!srv.loop
+      || microtcp_bind (&listener, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1
+      || microtcp_listen (&listener, TEST_CONNECTIONS) == -1
+      || microtcp_loop_add (srv.loop, &listener, MICROTCP_POLLIN, test_accept_event, &srv) == -1) {
+    perror ("listener");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < TEST_CONNECTIONS; i++) {
+    pids[i] = test_fork ();
+    if (pids[i] == 0)
+      _exit (test_client ());
+  }
+
+  do {
+    if (microtcp_poll (srv.loop, -1) == -1) {
+      perror ("microtcp_poll");
+      return EXIT_FAILURE;
+    }
+    for (i = 0, closed = 0; i < srv.accepted; i++)
+      closed += srv.conns[i].closed;
+  } while (closed < TEST_CONNECTIONS);
+
+  for (i = 0; i < TEST_CONNECTIONS; i++) {
+    if (test_wait (pids[i]) == -1)
+      failed = 1;
+    if (srv.conns[i].bytes != TEST_BYTES || srv.conns[i].bad
+        || srv.conns[i].sock.loop_entry != NULL)
+      failed = 1;
+    printf ("connection %d: %llu bytes, %d wrong\n", i,
+            (unsigned long long) srv.conns[i].bytes, srv.conns[i].bad);
+  }
+
+  microtcp_shutdown (&listener, SHUT_RDWR);
+  microtcp_loop_free (srv.loop);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * What the tests share: a loopback address, a child process for the
+ * peer and a bound on how long a test may hang
+ */
+
+#ifndef TEST_TEST_COMMON_H_
+#define TEST_TEST_COMMON_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <arpa/inet.h>
+
+#define TEST_TIMEOUT_S 60
+
+/*
+ * Ends the test with SIGALRM if it hangs
+ */
+static inline void
+test_start (void)
+{
+  alarm (TEST_TIMEOUT_S);
+}
+
+/*
+ * The loopback address at a port
+ */
+static inline void
+test_address (struct sockaddr_in *sin, uint16_t port)
+{
+  memset (sin, 0, sizeof(struct sockaddr_in));
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons (port);
+  sin->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+}
+
+/*
+ * Forks a child that is killed if the test dies, not to outlive a
+ * server that crashed
+ *
+ * @return as fork(), 0 in the child
+ */
+static inline pid_t
+test_fork (void)
+{
+  pid_t pid = fork ();
+
+  if (pid == 0)
+    prctl (PR_SET_PDEATHSIG, SIGKILL);
+  return pid;
+}
+
+/*
+ * Waits for a child
+ *
+ * @return 0 if it exited with EXIT_SUCCESS, -1 otherwise
+ */
+static inline int
+test_wait (pid_t pid)
+{
+  int status;
+
+  if (waitpid (pid, &status, 0) == -1 || !WIFEXITED (status)
+      || WEXITSTATUS (status) != EXIT_SUCCESS)
+    return -1;
+  return 0;
+}
+
+/*
+ * Kills a child and reaps it
+ */
+static inline void
+test_kill (pid_t pid)
+{
+  kill (pid, SIGKILL);
+  waitpid (pid, NULL, 0);
+}
+
+#endif /* TEST_TEST_COMMON_H_ */
@@ -0,0 +1,141 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Arms 100k timers (or as many as asked) on one wheel, the way an engine
+ * with that many connections arms their retransmission timers, and
+ * measures arming, moving, canceling, finding the next deadline and
+ * expiring them all with a tickless sleep from deadline to deadline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../lib/microtcp_timer.h"
+
+#define SPREAD_US 1000000ULL
+#define NEXT_CALLS 100000
+
+struct bench_timer
+{
+  microtcp_timer_t timer;
+  uint64_t deadline;
+};
+
+static uint64_t clock_us;
+static size_t fired;
+static size_t early;
+static size_t late;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_fire (microtcp_timer_t *timer)
+{
+  struct bench_timer *t = microtcp_container_of (timer, struct bench_timer, timer);
+
+  fired++;
+  if (clock_us < t->deadline)
+    early++;
+  else if (clock_us >= t->deadline + MICROTCP_TIMER_TICK_US)
+    late++;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct microtcp_timer_wheel *wheel;
+  struct bench_timer *timers;
+  size_t count = argc > 1 ? strtoull (argv[1], NULL, 10) : 100000;
+  size_t i, wakeups = 0, canceled = 0;
+  uint64_t start, elapsed, next;
+  volatile uint64_t sink = 0;
+
+  timers = malloc (count * sizeof(struct bench_timer));
+  wheel = microtcp_timer_wheel_new (0);
+  if (!timers || !wheel || count == 0) {
+    perror ("Allocate timers");
+    return EXIT_FAILURE;
+  }
+  srand (1);
+  for (i = 0; i < count; i++) {
+    microtcp_timer_init (&timers[i].timer, bench_fire);
+    timers[i].deadline = 1 + (uint64_t)rand () % SPREAD_US;
+  }
+
+  printf ("%zu timers, deadlines spread over %llu ms\n", count, SPREAD_US / 1000);
+
+  start = now_ns ();
+  for (i = 0; i < count; i++)
+    microtcp_timer_arm (wheel, &timers[i].timer, timers[i].deadline);
+  elapsed = now_ns () - start;
+  printf ("arm:     %8.1f ns per timer\n", elapsed / (double)count);
+
+  // An ACK restarts the retransmission timer of its connection
+  start = now_ns ();
+  for (i = 0; i < count; i++) {
+    timers[i].deadline = 1 + (uint64_t)rand () % SPREAD_US;
+    microtcp_timer_arm (wheel, &timers[i].timer, timers[i].deadline);
+  }
+  elapsed = now_ns () - start;
+  printf ("re-arm:  %8.1f ns per timer\n", elapsed / (double)count);
+
+  start = now_ns ();
+  for (i = 0; i < NEXT_CALLS; i++)
+    sink += microtcp_timer_next (wheel);
+  elapsed = now_ns () - start;
+  printf ("next:    %8.1f ns per call\n", elapsed / (double)NEXT_CALLS);
+
+  start = now_ns ();
+  for (i = 0; i < count; i += 4) {
+    microtcp_timer_cancel (wheel, &timers[i].timer);
+    canceled++;
+  }
+  elapsed = now_ns () - start;
+  printf ("cancel:  %8.1f ns per timer\n", elapsed / (double)canceled);
+
+  // Sleep straight to the next deadline, and expire everything due
+  start = now_ns ();
+  while ((next = microtcp_timer_next (wheel)) != UINT64_MAX) {
+    clock_us = next;
+    microtcp_timer_run (wheel, clock_us);
+    wakeups++;
+  }
+  elapsed = now_ns () - start;
+  printf ("expire:  %8.1f ns per timer, %zu wakeups for %zu timers\n",
+          elapsed / (double)fired, wakeups, fired);
+  (void)sink;
+
+  free (timers);
+  microtcp_timer_wheel_free (wheel);
+  if (fired != count - canceled || early > 0 || late > 0) {
+    printf ("%zu of %zu timers fired, %zu early and %zu late\n", fired,
+            count - canceled, early, late);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A segment the peer acknowledges only in part and then misses: the
+ * sender sends what is left of it again, and that packet has to carry
+ * a checksum of its own, not the one of the whole segment. The peer is
+ * played here over a plain UDP socket.
+ */
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include "../lib/microtcp.h"
+#include "../utils/crc32.h"
+#include "test_common.h"
+
+#define TEST_PORT 9303
+#define TEST_BYTES (4 * MICROTCP_MSS)
+#define TEST_ACKED (MICROTCP_MSS / 2)
+
+static int
+test_client (void)
+{
+  struct sockaddr_in sin;
+  uint8_t buf[TEST_BYTES];
+  int i;
+
+  for (i = 0; i < TEST_BYTES; i++)
+    buf[i] = i;
+
+  microtcp_sock_t s = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  test_address (&sin, TEST_PORT);
+  s.address = sin;
+  s.address_len = sizeof(struct sockaddr_in);
+  if (microtcp_connect (&s, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1
+      || microtcp_send (&s, buf, TEST_BYTES, 0) != TEST_BYTES)
+    return EXIT_FAILURE;
+
+  /* Keeps sending until the peer is done with it */
+  microtcp_shutdown (&s, SHUT_RDWR);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Sends a header with no payload to the client
+ */
+static void
+test_reply (int sd, const struct sockaddr_in *client, uint32_t seq, uint32_t ack,
+            uint16_t control, uint32_t options)
+{
+  microtcp_header_t header;
+
+  memset (&header, 0, sizeof(header));
+  header.seq_number = htonl (seq);
+  header.ack_number = htonl (ack);
+  header.control = htons (control);
+  header.window = htons (0xffff);
+  header.future_use0 = htonl (options);
+  header.checksum = htonl (crc32 ((const uint8_t *) &header, sizeof(header)));
+  sendto (sd, &header, sizeof(header), 0, (const struct sockaddr *) client,
+          sizeof(struct sockaddr_in));
+}
+
+int
+main (void)
+{
+  struct sockaddr_in sin, client;
+  socklen_t client_len = sizeof(client);
+  uint8_t packet[sizeof(microtcp_header_t) + MICROTCP_MSS];
+  microtcp_header_t *header = (microtcp_header_t *) packet;
+  uint32_t checksum, data, seq, len, isn = 1000;
+  ssize_t received;
+  int sd, partial_acked = 0, failed = 1;
+  pid_t pid;
+
+  test_start ();
+  sd = socket (AF_INET, SOCK_DGRAM, 0);
+  test_address (&sin, TEST_PORT);
+  if (sd == -1 || bind (sd, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+    perror ("bind");
+    return EXIT_FAILURE;
+  }
+
+  pid = test_fork ();
+  if (pid == 0)
+    _exit (test_client ());
+
+  /* The handshake, with timestamps so that the resent packet is patched */
+  received = recvfrom (sd, packet, sizeof(packet), 0, (struct sockaddr *) &client, &client_len);
+  if (received < (ssize_t) sizeof(microtcp_header_t) || ntohs (header->control) != SYN) {
+    fprintf (stderr, "no SYN\n");
+    test_kill (pid);
+    return EXIT_FAILURE;
+  }
+  data = ntohl (header->seq_number) + 1;
+  test_reply (sd, &client, isn, data, SYNACK, MICROTCP_OPT_TS);
+
+  while ((received = recv (sd, packet, sizeof(packet), 0)) >= (ssize_t) sizeof(microtcp_header_t)) {
+    seq = ntohl (header->seq_number);
+    len = ntohl (header->data_len) & ((1 << MICROTCP_CID_SHIFT) - 1);
+    if (ntohs (header->control) != 0 || len == 0)
+      continue;
+
+    /* Half of the first segment arrived, the rest of it never does */
+    if (!partial_acked && seq == data) {
+      test_reply (sd, &client, isn + 1, data + TEST_ACKED, ACK, 0);
+      partial_acked = 1;
+      continue;
+    }
+    if (!partial_acked || seq != data + TEST_ACKED)
+      continue;
+
+    checksum = ntohl (header->checksum);
+    header->checksum = 0;
+    failed = len != MICROTCP_MSS - TEST_ACKED || checksum != crc32 (packet, received);
+    printf ("resent %u bytes at %u: checksum %s\n", len, seq - data,
+            checksum == crc32 (packet, received) ? "good" : "bad");
+    break;
+  }
+
+  test_kill (pid);
+  close (sd);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Connections whose sequence numbers wrap around 2^32 halfway through
+ * the data, sent once with microtcp_send() and once with
+ * microtcp_sendfile(): the receiver has to keep taking the segments
+ * past the wrap in order, and the sender has to see them acknowledged.
+ */
+
+#include <stdio.h>
+#include "../lib/microtcp.h"
+#include "test_common.h"
+
+#define TEST_PORT 9304 /* microtcp_sendfile() on the next one */
+#define TEST_BYTES (1024 * 1024)
+#define TEST_ISN (0xffffffffU - TEST_BYTES / 2)
+
+/*
+ * The library draws its initial sequence numbers from rand(), so this
+ * one puts both ends right below the wrap
+ */
+int
+rand (void)
+{
+  return (int) TEST_ISN;
+}
+
+/*
+ * Writes the data to a file that is already unlinked, -1 on error
+ */
+static int
+test_file (const uint8_t *buf)
+{
+  char path[] = "/tmp/wrap_testXXXXXX";
+  int fd = mkstemp (path);
+
+  if (fd == -1)
+    return -1;
+  unlink (path);
+  if (write (fd, buf, TEST_BYTES) != TEST_BYTES) {
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int
+test_client (int use_sendfile)
+{
+  struct sockaddr_in sin;
+  uint8_t *buf = malloc (TEST_BYTES);
+  ssize_t sent;
+  int i, fd = -1;
+
+  if (!buf)
+    return EXIT_FAILURE;
+  for (i = 0; i < TEST_BYTES; i++)
+    buf[i] = i;
+  if (use_sendfile && (fd = test_file (buf)) == -1)
+    return EXIT_FAILURE;
+
+  microtcp_sock_t s = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  test_address (&sin, TEST_PORT + use_sendfile);
+  s.address = sin;
+  s.address_len = sizeof(struct sockaddr_in);
+  if (microtcp_connect (&s, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1)
+    return EXIT_FAILURE;
+  if (use_sendfile)
+    sent = microtcp_sendfile (&s, fd, 0, TEST_BYTES);
+  else
+    sent = microtcp_send (&s, buf, TEST_BYTES, 0);
+  if (sent != TEST_BYTES)
+    return EXIT_FAILURE;
+  free (buf);
+
+  /* The FIN is acknowledged only after all the data past the wrap */
+  if (microtcp_shutdown (&s, SHUT_RDWR) == -1
+      || s.snd_una != (uint32_t) (TEST_ISN + 1 + TEST_BYTES))
+    return EXIT_FAILURE;
+  if (fd != -1)
+    close (fd);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * One connection to a client sending the one way or the other, 0 if
+ * all of its data arrived
+ */
+static int
+test_round (int use_sendfile)
+{
+  struct sockaddr_in sin;
+  uint8_t buffer[4096];
+  uint64_t bytes = 0;
+  ssize_t received, i;
+  int bad = 0, failed = 0;
+  pid_t pid;
+
+  microtcp_sock_t s = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  test_address (&sin, TEST_PORT + use_sendfile);
+  if (microtcp_bind (&s, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1) {
+    perror ("bind");
+    return -1;
+  }
+
+  pid = test_fork ();
+  if (pid == 0)
+    _exit (test_client (use_sendfile));
+
+  if (microtcp_accept (&s, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1) {
+    perror ("accept");
+    return -1;
+  }
+  while ((received = microtcp_recv (&s, buffer, sizeof(buffer), 0)) > 0) {
+    for (i = 0; i < received; i++)
+      bad += buffer[i] != (uint8_t) (bytes + i);
+    bytes += received;
+  }
+
+  if (test_wait (pid) == -1)
+    failed = -1;
+  if (bytes != TEST_BYTES || bad)
+    failed = -1;
+  printf ("%s: %llu bytes across the wrap, %d wrong\n",
+          use_sendfile ? "microtcp_sendfile" : "microtcp_send",
+          (unsigned long long) bytes, bad);
+  return failed;
+}
+
+int
+main (void)
+{
+  int failed = 0;
+
+  test_start ();
+  failed |= test_round (0);
+  failed |= test_round (1);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,542 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "crc32.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+#define CRC32_POLY 0xEDB88320 /* 0x04C11DB7 bit-reflected */
+
+/*
+ * The tables of slicing-by-N. Table k advances the CRC of a byte by k
+ * more zero bytes, so that N bytes are folded in with N independent
+ * lookups.
+ */
+static uint32_t crc32_slice_lut[16][256];
+
+/*
+ * One byte per step, the original implementation
+ */
+static uint32_t
+crc32_table (uint32_t crc, const uint8_t *data, size_t len)
+{
+  static const uint32_t crc32_lut[256] =
+    { 0x00000000L, 0x77073096L, 0xEE0E612CL, 0x990951BAL, 0x076DC419L,
+        0x706AF48FL, 0xE963A535L, 0x9E6495A3L, 0x0EDB8832L, 0x79DCB8A4L,
+        0xE0D5E91EL, 0x97D2D988L, 0x09B64C2BL, 0x7EB17CBDL, 0xE7B82D07L,
+        0x90BF1D91L, 0x1DB71064L, 0x6AB020F2L, 0xF3B97148L, 0x84BE41DEL,
+        0x1ADAD47DL, 0x6DDDE4EBL, 0xF4D4B551L, 0x83D385C7L, 0x136C9856L,
+        0x646BA8C0L, 0xFD62F97AL, 0x8A65C9ECL, 0x14015C4FL, 0x63066CD9L,
+        0xFA0F3D63L, 0x8D080DF5L, 0x3B6E20C8L, 0x4C69105EL, 0xD56041E4L,
+        0xA2677172L, 0x3C03E4D1L, 0x4B04D447L, 0xD20D85FDL, 0xA50AB56BL,
+        0x35B5A8FAL, 0x42B2986CL, 0xDBBBC9D6L, 0xACBCF940L, 0x32D86CE3L,
+        0x45DF5C75L, 0xDCD60DCFL, 0xABD13D59L, 0x26D930ACL, 0x51DE003AL,
+        0xC8D75180L, 0xBFD06116L, 0x21B4F4B5L, 0x56B3C423L, 0xCFBA9599L,
+        0xB8BDA50FL, 0x2802B89EL, 0x5F058808L, 0xC60CD9B2L, 0xB10BE924L,
+        0x2F6F7C87L, 0x58684C11L, 0xC1611DABL, 0xB6662D3DL, 0x76DC4190L,
+        0x01DB7106L, 0x98D220BCL, 0xEFD5102AL, 0x71B18589L, 0x06B6B51FL,
+        0x9FBFE4A5L, 0xE8B8D433L, 0x7807C9A2L, 0x0F00F934L, 0x9609A88EL,
+        0xE10E9818L, 0x7F6A0DBBL, 0x086D3D2DL, 0x91646C97L, 0xE6635C01L,
+        0x6B6B51F4L, 0x1C6C6162L, 0x856530D8L, 0xF262004EL, 0x6C0695EDL,
+        0x1B01A57BL, 0x8208F4C1L, 0xF50FC457L, 0x65B0D9C6L, 0x12B7E950L,
+        0x8BBEB8EAL, 0xFCB9887CL, 0x62DD1DDFL, 0x15DA2D49L, 0x8CD37CF3L,
+        0xFBD44C65L, 0x4DB26158L, 0x3AB551CEL, 0xA3BC0074L, 0xD4BB30E2L,
+        0x4ADFA541L, 0x3DD895D7L, 0xA4D1C46DL, 0xD3D6F4FBL, 0x4369E96AL,
+        0x346ED9FCL, 0xAD678846L, 0xDA60B8D0L, 0x44042D73L, 0x33031DE5L,
+        0xAA0A4C5FL, 0xDD0D7CC9L, 0x5005713CL, 0x270241AAL, 0xBE0B1010L,
+        0xC90C2086L, 0x5768B525L, 0x206F85B3L, 0xB966D409L, 0xCE61E49FL,
+        0x5EDEF90EL, 0x29D9C998L, 0xB0D09822L, 0xC7D7A8B4L, 0x59B33D17L,
+        0x2EB40D81L, 0xB7BD5C3BL, 0xC0BA6CADL, 0xEDB88320L, 0x9ABFB3B6L,
+        0x03B6E20CL, 0x74B1D29AL, 0xEAD54739L, 0x9DD277AFL, 0x04DB2615L,
+        0x73DC1683L, 0xE3630B12L, 0x94643B84L, 0x0D6D6A3EL, 0x7A6A5AA8L,
+        0xE40ECF0BL, 0x9309FF9DL, 0x0A00AE27L, 0x7D079EB1L, 0xF00F9344L,
+        0x8708A3D2L, 0x1E01F268L, 0x6906C2FEL, 0xF762575DL, 0x806567CBL,
+        0x196C3671L, 0x6E6B06E7L, 0xFED41B76L, 0x89D32BE0L, 0x10DA7A5AL,
+        0x67DD4ACCL, 0xF9B9DF6FL, 0x8EBEEFF9L, 0x17B7BE43L, 0x60B08ED5L,
+        0xD6D6A3E8L, 0xA1D1937EL, 0x38D8C2C4L, 0x4FDFF252L, 0xD1BB67F1L,
+        0xA6BC5767L, 0x3FB506DDL, 0x48B2364BL, 0xD80D2BDAL, 0xAF0A1B4CL,
+        0x36034AF6L, 0x41047A60L, 0xDF60EFC3L, 0xA867DF55L, 0x316E8EEFL,
+        0x4669BE79L, 0xCB61B38CL, 0xBC66831AL, 0x256FD2A0L, 0x5268E236L,
+        0xCC0C7795L, 0xBB0B4703L, 0x220216B9L, 0x5505262FL, 0xC5BA3BBEL,
+        0xB2BD0B28L, 0x2BB45A92L, 0x5CB36A04L, 0xC2D7FFA7L, 0xB5D0CF31L,
+        0x2CD99E8BL, 0x5BDEAE1DL, 0x9B64C2B0L, 0xEC63F226L, 0x756AA39CL,
+        0x026D930AL, 0x9C0906A9L, 0xEB0E363FL, 0x72076785L, 0x05005713L,
+        0x95BF4A82L, 0xE2B87A14L, 0x7BB12BAEL, 0x0CB61B38L, 0x92D28E9BL,
+        0xE5D5BE0DL, 0x7CDCEFB7L, 0x0BDBDF21L, 0x86D3D2D4L, 0xF1D4E242L,
+        0x68DDB3F8L, 0x1FDA836EL, 0x81BE16CDL, 0xF6B9265BL, 0x6FB077E1L,
+        0x18B74777L, 0x88085AE6L, 0xFF0F6A70L, 0x66063BCAL, 0x11010B5CL,
+        0x8F659EFFL, 0xF862AE69L, 0x616BFFD3L, 0x166CCF45L, 0xA00AE278L,
+        0xD70DD2EEL, 0x4E048354L, 0x3903B3C2L, 0xA7672661L, 0xD06016F7L,
+        0x4969474DL, 0x3E6E77DBL, 0xAED16A4AL, 0xD9D65ADCL, 0x40DF0B66L,
+        0x37D83BF0L, 0xA9BCAE53L, 0xDEBB9EC5L, 0x47B2CF7FL, 0x30B5FFE9L,
+        0xBDBDF21CL, 0xCABAC28AL, 0x53B39330L, 0x24B4A3A6L, 0xBAD03605L,
+        0xCDD70693L, 0x54DE5729L, 0x23D967BFL, 0xB3667A2EL, 0xC4614AB8L,
+        0x5D681B02L, 0x2A6F2B94L, 0xB40BBE37L, 0xC30C8EA1L, 0x5A05DF1BL,
+        0x2D02EF8DL };
+
+  size_t i;
+  for (i = 0; i < len; i++) {
+    crc = (crc >> 8) ^ crc32_lut[(crc ^ data[i]) & 0xff];
+  }
+  return crc;
+}
+
+static uint32_t
+crc32_table_copy (uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+  memcpy (dst, src, len);
+  return crc32_table (crc, dst, len);
+}
+
+/*
+ * The kernels below take a destination too. If it is not NULL, the
+ * data is copied there on the way, so that it is read only once. They
+ * are always inlined, for the compiler to drop the stores of the
+ * plain variants.
+ */
+#define CRC32_INLINE static inline __attribute__((always_inline))
+
+CRC32_INLINE uint32_t
+crc32_bytes (uint32_t crc, uint8_t *dst, const uint8_t *data, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (dst)
+      dst[i] = data[i];
+    crc = (crc >> 8) ^ crc32_slice_lut[0][(crc ^ data[i]) & 0xff];
+  }
+  return crc;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+CRC32_INLINE uint32_t
+crc32_load32 (const uint8_t *p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof(v));
+  return v;
+}
+
+#define SLICE4(t, w) \
+  (crc32_slice_lut[(t) + 3][(w) & 0xff] ^ crc32_slice_lut[(t) + 2][((w) >> 8) & 0xff] ^ \
+   crc32_slice_lut[(t) + 1][((w) >> 16) & 0xff] ^ crc32_slice_lut[(t)][(w) >> 24])
+
+CRC32_INLINE uint32_t
+crc32_slice8_body (uint32_t crc, uint8_t *dst, const uint8_t *data, size_t len)
+{
+  uint32_t one, two;
+
+  while (len >= 8) {
+    one = crc32_load32 (data) ^ crc;
+    two = crc32_load32 (data + 4);
+    // Stored from the cache line the loads just brought in
+    if (dst) {
+      memcpy (dst, data, 8);
+      dst += 8;
+    }
+    crc = SLICE4 (4, one) ^ SLICE4 (0, two);
+    data += 8;
+    len -= 8;
+  }
+  return crc32_bytes (crc, dst, data, len);
+}
+
+CRC32_INLINE uint32_t
+crc32_slice16_body (uint32_t crc, uint8_t *dst, const uint8_t *data, size_t len)
+{
+  uint32_t one, two, three, four;
+
+  while (len >= 16) {
+    one = crc32_load32 (data) ^ crc;
+    two = crc32_load32 (data + 4);
+    three = crc32_load32 (data + 8);
+    four = crc32_load32 (data + 12);
+    if (dst) {
+      memcpy (dst, data, 16);
+      dst += 16;
+    }
+    crc = SLICE4 (12, one) ^ SLICE4 (8, two) ^ SLICE4 (4, three) ^ SLICE4 (0, four);
+    data += 16;
+    len -= 16;
+  }
+  return crc32_bytes (crc, dst, data, len);
+}
+#else
+/* The slicing kernels read words little-endian */
+#define crc32_slice8_body crc32_bytes
+#define crc32_slice16_body crc32_bytes
+#endif
+
+static uint32_t
+crc32_slice8 (uint32_t crc, const uint8_t *data, size_t len)
+{
+  return crc32_slice8_body (crc, NULL, data, len);
+}
+
+static uint32_t
+crc32_slice8_copy (uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+  return crc32_slice8_body (crc, dst, src, len);
+}
+
+static uint32_t
+crc32_slice16 (uint32_t crc, const uint8_t *data, size_t len)
+{
+  return crc32_slice16_body (crc, NULL, data, len);
+}
+
+static uint32_t
+crc32_slice16_copy (uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+  return crc32_slice16_body (crc, dst, src, len);
+}
+
+#if defined(__x86_64__)
+/*
+ * Folding with carry-less multiplication, from "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). Four
+ * 128-bit lanes are folded 64 bytes at a time, then into one lane, then
+ * Barrett reduced to 32 bits. The constants are those of the paper for
+ * the bit-reflected polynomial.
+ */
+#define CRC32_PCLMUL __attribute__((target ("pclmul,sse4.1")))
+
+CRC32_PCLMUL CRC32_INLINE __m128i
+crc32_pclmul_load (uint8_t *dst, const uint8_t *buf, size_t off)
+{
+  __m128i x = _mm_loadu_si128 ((const __m128i *)(buf + off));
+
+  if (dst)
+    _mm_storeu_si128 ((__m128i *)(dst + off), x);
+  return x;
+}
+
+CRC32_PCLMUL CRC32_INLINE uint32_t
+crc32_pclmul_blocks (uint32_t crc, uint8_t *dst, const uint8_t *buf, size_t len)
+{
+  const __m128i k1k2 = _mm_set_epi64x (0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x (0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x (0x0000000000, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x (0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32 (~0, 0, ~0, 0);
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = crc32_pclmul_load (dst, buf, 0x00);
+  x2 = crc32_pclmul_load (dst, buf, 0x10);
+  x3 = crc32_pclmul_load (dst, buf, 0x20);
+  x4 = crc32_pclmul_load (dst, buf, 0x30);
+  x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 (crc));
+  buf += 64;
+  dst = dst ? dst + 64 : NULL;
+  len -= 64;
+
+  // Four lanes in parallel
+  x0 = k1k2;
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128 (x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128 (x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128 (x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128 (x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128 (x4, x0, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), crc32_pclmul_load (dst, buf, 0x00));
+    x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), crc32_pclmul_load (dst, buf, 0x10));
+    x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), crc32_pclmul_load (dst, buf, 0x20));
+    x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), crc32_pclmul_load (dst, buf, 0x30));
+    buf += 64;
+    dst = dst ? dst + 64 : NULL;
+    len -= 64;
+  }
+
+  // Fold the lanes into one
+  x0 = k3k4;
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+  // Then the remaining 16-byte blocks into it
+  while (len >= 16) {
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, crc32_pclmul_load (dst, buf, 0)), x5);
+    buf += 16;
+    dst = dst ? dst + 16 : NULL;
+    len -= 16;
+  }
+
+  // 128 bits to 64
+  x2 = _mm_clmulepi64_si128 (x1, x0, 0x10);
+  x1 = _mm_xor_si128 (_mm_srli_si128 (x1, 8), x2);
+  x2 = _mm_srli_si128 (x1, 4);
+  x1 = _mm_and_si128 (x1, mask32);
+  x1 = _mm_clmulepi64_si128 (x1, k5k0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  // Barrett reduction to 32
+  x2 = _mm_and_si128 (x1, mask32);
+  x2 = _mm_clmulepi64_si128 (x2, poly, 0x10);
+  x2 = _mm_and_si128 (x2, mask32);
+  x2 = _mm_clmulepi64_si128 (x2, poly, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+  return _mm_extract_epi32 (x1, 1);
+}
+
+CRC32_PCLMUL CRC32_INLINE uint32_t
+crc32_pclmul_body (uint32_t crc, uint8_t *dst, const uint8_t *data, size_t len)
+{
+  size_t blocks;
+
+  // Short buffers, like a bare header, aren't worth the setup
+  if (len < 64)
+    return crc32_slice16_body (crc, dst, data, len);
+
+  blocks = len & ~(size_t)15;
+  crc = crc32_pclmul_blocks (crc, dst, data, blocks);
+  return crc32_slice16_body (crc, dst ? dst + blocks : NULL, data + blocks, len - blocks);
+}
+
+CRC32_PCLMUL static uint32_t
+crc32_pclmul (uint32_t crc, const uint8_t *data, size_t len)
+{
+  return crc32_pclmul_body (crc, NULL, data, len);
+}
+
+CRC32_PCLMUL static uint32_t
+crc32_pclmul_copy (uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+  return crc32_pclmul_body (crc, dst, src, len);
+}
+
+static int
+crc32_pclmul_supported (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("pclmul") && __builtin_cpu_supports ("sse4.1");
+}
+#endif
+
+#if defined(__aarch64__)
+/*
+ * The CRC32 instructions of ARMv8 use this very polynomial, so no
+ * folding is needed
+ */
+#define CRC32_ARMV8 __attribute__((target ("+crc")))
+
+CRC32_ARMV8 CRC32_INLINE uint32_t
+crc32_armv8_body (uint32_t crc, uint8_t *dst, const uint8_t *data, size_t len)
+{
+  uint64_t v;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy (&v, data + i, sizeof(v));
+    if (dst)
+      memcpy (dst + i, &v, sizeof(v));
+    crc = __crc32d (crc, v);
+  }
+  for (; i < len; i++) {
+    if (dst)
+      dst[i] = data[i];
+    crc = __crc32b (crc, data[i]);
+  }
+  return crc;
+}
+
+CRC32_ARMV8 static uint32_t
+crc32_armv8 (uint32_t crc, const uint8_t *data, size_t len)
+{
+  return crc32_armv8_body (crc, NULL, data, len);
+}
+
+CRC32_ARMV8 static uint32_t
+crc32_armv8_copy (uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+  return crc32_armv8_body (crc, dst, src, len);
+}
+
+static int
+crc32_armv8_supported (void)
+{
+  return (getauxval (AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static const struct
+{
+  const char *name;
+  crc32_kernel_t update;
+  crc32_copy_kernel_t copy;
+  int (*supported) (void);      /* NULL if every CPU has what it needs */
+} crc32_kernels[] = {
+#if defined(__x86_64__)
+  { "pclmul", crc32_pclmul, crc32_pclmul_copy, crc32_pclmul_supported },
+#endif
+#if defined(__aarch64__)
+  { "armv8", crc32_armv8, crc32_armv8_copy, crc32_armv8_supported },
+#endif
+  { "slice16", crc32_slice16, crc32_slice16_copy, NULL },
+  { "slice8", crc32_slice8, crc32_slice8_copy, NULL },
+  { "table", crc32_table, crc32_table_copy, NULL },
+};
+
+#define CRC32_KERNELS (sizeof(crc32_kernels) / sizeof(crc32_kernels[0]))
+
+/* The fastest first, so the first one supported wins */
+static size_t crc32_selected = CRC32_KERNELS - 1;
+
+/* x^(2^n) modulo the polynomial, for n = 0..31 */
+static uint32_t crc32_x2n[32];
+
+/*
+ * Multiply a and b modulo the polynomial, both bit-reflected
+ */
+static uint32_t
+multmodp (uint32_t a, uint32_t b)
+{
+  uint32_t m = (uint32_t)1 << 31, p = 0;
+
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+  }
+  return p;
+}
+
+__attribute__((constructor))
+static void
+crc32_init (void)
+{
+  uint32_t crc;
+  size_t i, k;
+
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (CRC32_POLY & -(crc & 1));
+    crc32_slice_lut[0][i] = crc;
+  }
+  for (k = 1; k < 16; k++)
+    for (i = 0; i < 256; i++)
+      crc32_slice_lut[k][i] = (crc32_slice_lut[k - 1][i] >> 8) ^
+                              crc32_slice_lut[0][crc32_slice_lut[k - 1][i] & 0xff];
+
+  crc = (uint32_t)1 << 30;     /* x^1 */
+  for (k = 0; k < 32; k++) {
+    crc32_x2n[k] = crc;
+    crc = multmodp (crc, crc);
+  }
+
+  for (i = 0; i < CRC32_KERNELS; i++) {
+    if (crc32_kernels[i].supported == NULL || crc32_kernels[i].supported ()) {
+      crc32_selected = i;
+      break;
+    }
+  }
+}
+
+uint32_t
+update_crc32 (uint32_t crc, const uint8_t *data, size_t len)
+{
+  return crc32_kernels[crc32_selected].update (crc, data, len);
+}
+
+uint32_t
+update_crc32_copy (uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+  return crc32_kernels[crc32_selected].copy (crc, dst, src, len);
+}
+
+uint32_t
+crc32_combine_gen (size_t len)
+{
+  uint32_t p = (uint32_t)1 << 31; /* x^0 */
+  unsigned k = 3;               /* Eight bits per byte */
+
+  while (len) {
+    if (len & 1)
+      p = multmodp (crc32_x2n[k & 31], p);
+    len >>= 1;
+    k++;
+  }
+  return p;
+}
+
+uint32_t
+crc32_combine_op (uint32_t crc1, uint32_t crc2, uint32_t op)
+{
+  return multmodp (op, crc1) ^ crc2;
+}
+
+crc32_kernel_t
+crc32_kernel (const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < CRC32_KERNELS; i++) {
+    if (strcmp (crc32_kernels[i].name, name) != 0)
+      continue;
+    if (crc32_kernels[i].supported != NULL && !crc32_kernels[i].supported ())
+      return NULL;
+    return crc32_kernels[i].update;
+  }
+  return NULL;
+}
+
+crc32_copy_kernel_t
+crc32_copy_kernel (const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < CRC32_KERNELS; i++) {
+    if (strcmp (crc32_kernels[i].name, name) != 0)
+      continue;
+    if (crc32_kernels[i].supported != NULL && !crc32_kernels[i].supported ())
+      return NULL;
+    return crc32_kernels[i].copy;
+  }
+  return NULL;
+}
+
+const char *
+crc32_kernel_name (void)
+{
+  return crc32_kernels[crc32_selected].name;
+}